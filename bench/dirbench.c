@@ -0,0 +1,172 @@
+// dirbench
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir.h"
+
+/* Times the directory block iterator over a synthetic directory, against
+ * the way e3ls used to do it: follow rec_len, and strncpy every name into
+ * a stack buffer.  No disk is involved; the blocks are built in memory,
+ * the way mke2fs and the kernel lay them out (records packed, the last
+ * one in each block stretched to the end), so this is just the parsing.
+ *
+ * Assumptions:
+ *  - Names are 8 to 39 bytes, which is about what a big mail spool or
+ *    build tree has in it. */
+
+#define EXT3_LL_MAX_NAME 256
+
+static double _now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fills blocks with n entries; returns how many blocks it took. */
+static int _build(uint8_t *blocks, int bs, int n)
+{
+	struct ext3_dir_entry *rec, *last = NULL;
+	int nblocks = 0, pos = bs;
+	int i, len, reclen;
+	
+	srand(1);
+	for (i = 0; i < n; i++)
+	{
+		len = 8 + rand() % 32;
+		reclen = (DIR_REC_HEADER + len + 3) & ~3;
+		if (pos + reclen > bs)
+		{
+			if (last)
+				last->rec_len += bs - pos;
+			pos = 0;
+			nblocks++;
+		}
+		rec = (struct ext3_dir_entry *)(blocks + (nblocks - 1) * (size_t)bs + pos);
+		rec->inode = 12 + i;
+		rec->rec_len = reclen;
+		rec->name_len = len;
+		rec->file_type = DIR_FT_REG_FILE;
+		snprintf(rec->name, len + 1, "f%0*d", len - 1, i);
+		last = rec;
+		pos += reclen;
+	}
+	if (last)
+		last->rec_len += bs - pos;
+	return nblocks;
+}
+
+static long _iter(const uint8_t *blocks, int bs, int nblocks, long *sum)
+{
+	struct dir_block_iter it;
+	struct dirent_view de;
+	long n = 0;
+	int b;
+	
+	for (b = 0; b < nblocks; b++)
+	{
+		dir_block_iter_init(&it, blocks + b * (size_t)bs, bs);
+		while (dir_block_iter_next(&it, &de))
+		{
+			*sum += de.name[de.name_len - 1] + de.inode;
+			n++;
+		}
+	}
+	return n;
+}
+
+static long _copy(const uint8_t *blocks, int bs, int nblocks, long *sum)
+{
+	char fname[EXT3_LL_MAX_NAME];
+	const struct ext3_dir_entry *rec;
+	long n = 0;
+	int b, pos;
+	
+	for (b = 0; b < nblocks; b++)
+	{
+		for (pos = 0; pos < bs; pos += rec->rec_len)
+		{
+			rec = (const struct ext3_dir_entry *)(blocks + b * (size_t)bs + pos);
+			if (rec->rec_len == 0)
+				break;
+			strncpy(fname, rec->name, rec->name_len);
+			fname[rec->name_len] = 0;
+			*sum += fname[rec->name_len - 1] + rec->inode;
+			n++;
+		}
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	int n = (argc > 1) ? strtol(argv[1], NULL, 0) : 1000000;
+	int bs = (argc > 2) ? strtol(argv[2], NULL, 0) : 4096;
+	int rounds = 5;
+	uint8_t *blocks;
+	int nblocks, r;
+	long got, sum1 = 0, sum2 = 0;
+	double t, best_iter = 1e9, best_copy = 1e9;
+	
+	if ((argc > 3) || (n <= 0) || (bs < 1024) || (bs > 65536) || (bs & (bs - 1)))
+	{
+		printf("Usage: %s [entries [blocksize]]\n", argv[0]);
+		printf("Builds a directory of that many entries (default 1000000) in memory, in\n");
+		printf("blocks of blocksize bytes (default 4096), and times walking it.\n");
+		exit(1);
+	}
+	
+	/* Even 8-byte names take 16 bytes a record. */
+	blocks = calloc(((size_t)n * 48) / bs + 2, bs);
+	if (!blocks)
+	{
+		perror("dirbench: calloc");
+		exit(1);
+	}
+	nblocks = _build(blocks, bs, n);
+	
+	for (r = 0; r < rounds; r++)
+	{
+		t = _now();
+		got = _iter(blocks, bs, nblocks, &sum1);
+		t = _now() - t;
+		if (got != n)
+		{
+			printf("dir_block_iter found %ld entries, not %d\n", got, n);
+			exit(1);
+		}
+		if (t < best_iter)
+			best_iter = t;
+		
+		t = _now();
+		got = _copy(blocks, bs, nblocks, &sum2);
+		t = _now() - t;
+		if (got != n)
+		{
+			printf("copying walk found %ld entries, not %d\n", got, n);
+			exit(1);
+		}
+		if (t < best_copy)
+			best_copy = t;
+	}
+	if (sum1 != sum2)
+	{
+		printf("the two walks disagree about the names\n");
+		exit(1);
+	}
+	
+	printf("%d entries in %d blocks of %d bytes; best of %d\n", n, nblocks, bs, rounds);
+	printf("dir_block_iter: %8.2f ms  %6.2f ns/entry\n", best_iter * 1e3, best_iter * 1e9 / n);
+	printf("strncpy walk:   %8.2f ms  %6.2f ns/entry\n", best_copy * 1e3, best_copy * 1e9 / n);
+	
+	free(blocks);
+	return 0;
+}
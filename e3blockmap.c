@@ -0,0 +1,266 @@
+// e3blockmap
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "inode.h"
+#include "namei.h"
+#include "bitmap.h"
+#include "blockmap.h"
+
+/* Answers "what's in block N?" -- free space, the filesystem's own
+ * metadata, or which inode and where in it -- and, with -c, checks the
+ * whole map against the block bitmaps.  The map comes from walking every
+ * in-use inode's block map once, so asking about a thousand blocks costs
+ * no more than asking about one.
+ *
+ * Assumptions:
+ *  - The first inode to claim a block owns it; which one that is depends
+ *    on which thread got there first, so with cross-links the owner we
+ *    print for a block can change from run to run.  The list of
+ *    cross-links doesn't: it names every claimant, lowest first.
+ *  - A group whose block bitmap was never initialized (BLOCK_UNINIT) only
+ *    has its own metadata in it, so that isn't worth reporting. */
+
+static const char *_type(uint16_t mode)
+{
+	switch (mode & 0xF000)
+	{
+	case 0x8000: return "file";
+	case 0x4000: return "dir";
+	case 0xA000: return "symlink";
+	default:     return "inode";
+	}
+}
+
+struct finder {
+	block_t want;
+	block_t lblk;
+	int what;
+	int found;
+};
+
+static int _find(void *arg, block_t lblk, block_t pblk, block_t n, int what)
+{
+	struct finder *f = arg;
+	
+	if ((f->want < pblk) || (f->want >= pblk + n))
+		return 0;
+	f->lblk = (what == IWALK_DATA) ? lblk + (f->want - pblk) : lblk;
+	f->what = what;
+	f->found = 1;
+	return 1;
+}
+
+/* Says where in inode ino block b is, going back over its block map. */
+static void _describe(e3tools_t *e3t, block_t b, uint32_t ino)
+{
+	struct ext2_inode inode;
+	struct finder f;
+	char path[4096];
+	
+	printf("%lld\tinode %u", (long long int)b, ino);
+	if (inode_find(e3t, ino, &inode) < 0)
+	{
+		printf("\n");
+		return;
+	}
+	printf(" (%s", _type(inode.i_mode));
+	if (((inode.i_mode & 0xF000) == 0x4000) && (namei_path(e3t, ino, path, sizeof(path)) == 0))
+		printf(" %s", path);
+	printf(")");
+	
+	memset(&f, 0, sizeof(f));
+	f.want = b;
+	inode_block_walk(e3t, &inode, _find, &f);
+	if (!f.found)
+		printf(", but it doesn't point there any more\n");
+	else if (f.what == IWALK_DATA)
+		printf(", logical block %lld\n", (long long int)f.lblk);
+	else if (f.what == IWALK_XATTR)
+		printf(", extended attribute block\n");
+	else if (inode.i_flags & INODE_EXTENTS_FL)
+		printf(", extent tree block\n");
+	else
+		printf(", indirect block\n");
+}
+
+static void _show(e3tools_t *e3t, struct blockmap *bm, block_t b)
+{
+	uint32_t owner;
+	
+	if (b >= SB_BLOCKS_COUNT(&e3t->sb))
+	{
+		printf("%lld\tpast the end of the filesystem\n", (long long int)b);
+		return;
+	}
+	owner = blockmap_owner(bm, b);
+	if (owner == BLOCKMAP_FREE)
+		printf("%lld\tfree\n", (long long int)b);
+	else if (owner == BLOCKMAP_METADATA)
+		printf("%lld\tmetadata\n", (long long int)b);
+	else
+		_describe(e3t, b, owner);
+}
+
+static void _run(const char *what, block_t start, block_t end, int bg)
+{
+	if (end - start == 1)
+		printf("%s: block %lld (group %d)\n", what, (long long int)start, bg);
+	else
+		printf("%s: blocks %lld-%lld (group %d)\n", what, (long long int)start, (long long int)(end - 1), bg);
+}
+
+/* Compares the map with the bitmaps, group by group, and reports runs of
+ * blocks that something owns but the bitmap says are free, and runs the
+ * bitmap says are in use that nothing owns. */
+static void _check(e3tools_t *e3t, struct blockmap *bm)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	uint8_t *bitmap = malloc(bs);
+	const struct blockmap_xlink *xl;
+	long long int nunmarked = 0, nunowned = 0;
+	int nxl, i, bg, rv;
+	
+	nxl = blockmap_xlinks(bm, &xl);
+	for (i = 0; i < nxl; i++)
+	{
+		printf("cross-link: block %lld is claimed by ", (long long int)xl[i].block);
+		if (xl[i].lo == BLOCKMAP_METADATA)
+			printf("the filesystem's metadata");
+		else
+			printf("inode %u", xl[i].lo);
+		if (xl[i].hi == BLOCKMAP_METADATA)
+			printf(" and the filesystem's metadata\n");
+		else
+			printf(" and inode %u\n", xl[i].hi);
+	}
+	
+	if (!bitmap)
+	{
+		perror("e3blockmap: malloc");
+		return;
+	}
+	for (bg = 0; bg < e3t->ngroups; bg++)
+	{
+		struct e3_group_geom *g = &e3t->geom[bg];
+		block_t b, start = 0, n = g->nblocks;
+		int state, prev = 0;	/* 1: owned but free in the bitmap, 2: in use in the bitmap but not owned */
+		
+		rv = bitmap_read_block_bitmap(e3t, bg, bitmap);
+		if (rv < 0)
+		{
+			printf("group %d: couldn't read the block bitmap\n", bg);
+			continue;
+		}
+		if (n > U64(bs) * 8)
+			n = U64(bs) * 8;
+		for (b = 0; b <= n; b++)
+		{
+			state = 0;
+			if (b < n)
+			{
+				uint32_t owner = blockmap_owner(bm, g->start + b);
+				int used = (bitmap[b >> 3] >> (b & 7)) & 1;
+				
+				if (owner && !used && !((rv == 1) && (owner == BLOCKMAP_METADATA)))
+					state = 1;
+				else if (!owner && used)
+					state = 2;
+			}
+			if (state == prev)
+				continue;
+			if (prev == 1)
+			{
+				_run("in use but free in the bitmap", g->start + start, g->start + b, bg);
+				nunmarked += b - start;
+			} else if (prev == 2) {
+				_run("marked in use but owned by nothing", g->start + start, g->start + b, bg);
+				nunowned += b - start;
+			}
+			prev = state;
+			start = b;
+		}
+	}
+	free(bitmap);
+	
+	printf("%d cross-linked blocks, %lld in use but free in the bitmap, %lld marked in use but owned by nothing; %d inodes' maps couldn't be followed\n",
+	       nxl, nunmarked, nunowned, blockmap_errors(bm));
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	struct blockmap *bm;
+	int opt, i;
+	int nthreads = 4;
+	int sectors = 0;
+	int check = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "j:sc")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			sectors = 1;
+			break;
+		case 'c':
+			check = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((optind > argc) || ((optind == argc) && !check) || !e3t.geom)
+	{
+		printf("Usage: %s [-j threads] [-s] [-c] [block...]\n", argv[0]);
+		printf("-j sets how many threads walk the inodes (default 4)\n");
+		printf("-s takes 512-byte sector numbers, as the kernel logs them, instead of blocks\n");
+		printf("-c reports cross-linked blocks, and blocks the bitmaps disagree about\n");
+		printf("Prints who owns each block: nothing, the filesystem, or which inode and\n");
+		printf("where in it.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	bm = blockmap_new(&e3t);
+	if (!bm || (blockmap_build(bm, nthreads) < 0))
+	{
+		printf("Couldn't build the block map\n");
+		exit(1);
+	}
+	
+	for (i = optind; i < argc; i++)
+	{
+		block_t b = strtoull(argv[i], NULL, 0);
+		
+		if (sectors)
+			b = b * 512 / SB_BLOCK_SIZE(&e3t.sb);
+		_show(&e3t, bm, b);
+	}
+	if (check)
+		_check(&e3t, bm);
+	
+	blockmap_free(bm);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
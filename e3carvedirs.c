@@ -0,0 +1,260 @@
+// e3carvedirs
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "diskio.h"
+#include "dir.h"
+#include "scan.h"
+
+/* When the inode tables are gone, the directories are still out there as
+ * blocks that nothing points to any more.  The first block of every
+ * directory starts with "." and "..", which give away both its own inode
+ * number and its parent's; every other directory block is just a chain
+ * of records whose rec_lens add up to exactly one block.  We read the
+ * whole disk, throw out almost every block with a couple of word compares
+ * on its first few bytes, and run what's left through the same validator
+ * that e3ls uses. */
+
+struct carved {
+	block_t block;
+	uint32_t ino;		/* 0 if the block isn't a directory's first */
+	uint32_t parent;
+	int nentries;
+};
+
+static struct {
+	e3tools_t *e3t;
+	int bs;
+	int all;		/* -a: report blocks without a "." too */
+	uint32_t ninodes;
+	pthread_mutex_t lock;
+	struct carved *found;
+	int nfound, alloc;
+} cd;
+
+static uint64_t _load64(const uint8_t *p)
+{
+	uint64_t v;
+	
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t _load32(const uint8_t *p)
+{
+	uint32_t v;
+	
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Could this be the first block of a directory?  Bytes 4-8 have to be
+ * rec_len 12, name_len 1 and a '.', and bytes 18-21 name_len 2 and "..";
+ * the file types (bytes 7 and 19) must say directory, or be 0 on a
+ * filesystem without them. */
+static int _maybe_head(const uint8_t *p)
+{
+	if ((_load64(p + 4) & 0x000000FF00FFFFFFULL) != 0x0000002E0001000CULL)
+		return 0;
+	if ((_load32(p + 18) & 0xFFFF00FF) != 0x2E2E0002)
+		return 0;
+	return ((p[7] | p[19]) & ~DIR_FT_DIR) == 0;
+}
+
+/* Could this be some other block of a directory?  Just the first record's
+ * header has to make sense. */
+static int _maybe_other(const uint8_t *p, int bs)
+{
+	const struct ext3_dir_entry *de = (const struct ext3_dir_entry *)p;
+	
+	return (de->rec_len >= DIR_REC_HEADER) && (de->rec_len <= bs) && !(de->rec_len & 3) &&
+	       de->name_len && (de->name_len <= de->rec_len - DIR_REC_HEADER) && (de->file_type <= DIR_FT_SYMLINK);
+}
+
+/* The real check: the rec_len chain has to cover the block exactly, and
+ * every live record has to have a name that could be a name, a file type
+ * that could be a file type, and an inode number that the filesystem has.
+ * Returns how many live records there are, or -1. */
+static int _validate(const uint8_t *p)
+{
+	struct dir_block_iter it;
+	struct dirent_view de;
+	int i, n = 0;
+	
+	dir_block_iter_init(&it, p, cd.bs);
+	if ((it.status != DIR_BLOCK_OK) || (it.end != cd.bs))
+		return -1;
+	while (dir_block_iter_next(&it, &de))
+	{
+		if (!de.inode)
+			continue;
+		if ((de.inode > cd.ninodes) || !de.name_len || (de.file_type > DIR_FT_SYMLINK))
+			return -1;
+		for (i = 0; i < de.name_len; i++)
+			if (!de.name[i] || (de.name[i] == '/'))
+				return -1;
+		n++;
+	}
+	return n;
+}
+
+/* Moves a thread's finds into the shared list, so the lock is taken once
+ * every few dozen blocks found rather than once for each. */
+static void _flush(struct carved *local, int nlocal)
+{
+	pthread_mutex_lock(&cd.lock);
+	if (cd.nfound + nlocal > cd.alloc)
+	{
+		cd.alloc = (cd.alloc + nlocal) * 2;
+		cd.found = realloc(cd.found, cd.alloc * sizeof(*cd.found));
+		if (!cd.found)
+		{
+			perror("e3carvedirs: realloc");
+			exit(1);
+		}
+	}
+	memcpy(cd.found + cd.nfound, local, nlocal * sizeof(*local));
+	cd.nfound += nlocal;
+	pthread_mutex_unlock(&cd.lock);
+}
+
+static void _carve(void *arg, block_t b, int n, const uint8_t *buf)
+{
+	struct carved local[64];
+	int nlocal = 0;
+	int i, nent;
+	
+	(void) arg;
+	for (i = 0; i < n; i++)
+	{
+		const uint8_t *p = buf + i * cd.bs;
+		int head = _maybe_head(p);
+		struct carved *c;
+		
+		if (!head && !(cd.all && _maybe_other(p, cd.bs)))
+			continue;
+		nent = _validate(p);
+		if ((nent < 0) || (!head && (nent == 0)))
+			continue;
+		
+		c = &local[nlocal++];
+		c->block = b + i;
+		c->ino = head ? _load32(p) : 0;
+		c->parent = head ? _load32(p + 12) : 0;
+		c->nentries = nent;
+		if (nlocal == 64)
+		{
+			_flush(local, nlocal);
+			nlocal = 0;
+		}
+	}
+	if (nlocal)
+		_flush(local, nlocal);
+}
+
+static int _block_cmp(const void *a, const void *b)
+{
+	const struct carved *ca = a, *cb = b;
+	
+	return (ca->block > cb->block) - (ca->block < cb->block);
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	struct scan_range range;
+	struct scan_stats stats;
+	uint8_t *block;
+	int opt;
+	int nthreads = 4;
+	int verbose = 0;
+	int i, nheads = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "j:av")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			cd.all = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((argc - optind) > 2)
+	{
+		printf("Usage: %s [-j threads] [-a] [-v] [start [count]]\n", argv[0]);
+		printf("-j sets how many threads read and sift through the disk (default 4)\n");
+		printf("-a also reports directory blocks that aren't a directory's first\n");
+		printf("-v lists the entries in every block found\n");
+		printf("Scans the whole filesystem, or count blocks from start.  Prints one line per\n");
+		printf("block found: block, directory inode, parent inode, and live entries; the\n");
+		printf("inodes are 0 for blocks that don't say which directory they belong to.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	cd.e3t = &e3t;
+	cd.bs = SB_BLOCK_SIZE(&e3t.sb);
+	cd.ninodes = e3t.sb.s_inodes_count;
+	pthread_mutex_init(&cd.lock, NULL);
+	
+	range.start = (argc - optind > 0) ? strtoull(argv[optind], NULL, 0) : 0;
+	range.count = (argc - optind > 1) ? strtoull(argv[optind + 1], NULL, 0) : (SB_BLOCKS_COUNT(&e3t.sb) - range.start);
+	scan_blocks(&e3t, &range, 1, nthreads, _carve, NULL, &stats);
+	
+	qsort(cd.found, cd.nfound, sizeof(*cd.found), _block_cmp);
+	block = malloc(cd.bs);
+	printf("# block\tinode\tparent\tentries\n");
+	for (i = 0; i < cd.nfound; i++)
+	{
+		struct carved *c = &cd.found[i];
+		
+		printf("%lld\t%u\t%u\t%d\n", (long long int)c->block, c->ino, c->parent, c->nentries);
+		nheads += (c->ino != 0);
+		if (verbose && block && (disk_read_block(&e3t, c->block, block) == 0))
+		{
+			struct dir_block_iter it;
+			struct dirent_view de;
+			
+			dir_block_iter_init(&it, block, cd.bs);
+			while (dir_block_iter_next(&it, &de))
+			{
+				printf("\t");
+				dir_entry_print(&de);
+			}
+		}
+	}
+	free(block);
+	
+	E3DEBUG(E3TOOLS_PFX "scanned %lld blocks (%lld unreadable); found %d directory blocks, %d of them first blocks\n",
+		(long long int)stats.scanned, (long long int)stats.bad, cd.nfound, nheads);
+	
+	free(cd.found);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
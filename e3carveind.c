@@ -0,0 +1,519 @@
+// e3carveind
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "diskio.h"
+#include "inode.h"
+#include "scan.h"
+
+/* When an inode is gone, its indirect blocks usually aren't, and they are
+ * easy enough to spot: a run of block numbers, every one of them on the
+ * disk, mostly going up (since that's how the allocator hands them out),
+ * and then nothing but zeroes to the end of the block.  We look at every
+ * block on the disk for that, then work out which of the ones we found
+ * point at other ones we found (those are double and triple indirect
+ * blocks), and put what's left back together into files.
+ *
+ * Assumptions:
+ *  - Files aren't sparse.  A hole in the middle of an indirect block looks
+ *    exactly like the end of one, so we take it as the end.
+ *  - An indirect block with fewer than -m entries (4, by default) isn't
+ *    worth the false positives on its own.  We keep those only if one of
+ *    the others points at them, or (double and triple indirect blocks
+ *    tend to be short) if they carry on from the file before them.  That
+ *    loses files of 13 to 15 blocks.
+ *  - When a file's indirect block is full, the allocator put its double
+ *    indirect block right after the last data block of it, and likewise
+ *    for the triple indirect block; that's how we know they go together.
+ *  - The 12 direct blocks came right before the indirect block, if the
+ *    indirect block's first entry comes right after it.  That's a guess,
+ *    and the output says so.
+ *  - Extent-mapped files have no indirect blocks, so we won't find those. */
+
+#define MIN_ENTRIES 4
+
+/* What we keep about each candidate; the block itself gets read again if
+ * we need to know more. */
+struct cand {
+	uint32_t block;
+	uint16_t k;		/* nonzero entries */
+	uint8_t level;		/* 1 for a plain indirect block, 2 for double, 3 for triple */
+	uint8_t referenced;	/* something else we found points here */
+	uint8_t weak;		/* fewer than -m entries */
+	uint32_t first, last;	/* first and last entries */
+	int child0, childn;	/* candidates at first and last, if level > 1 */
+};
+
+static struct {
+	e3tools_t *e3t;
+	int bs;
+	int perblk;
+	int minentries;
+	uint32_t lo, hi;	/* entries have to be in [lo, hi) */
+	pthread_mutex_t lock;
+	struct cand *cands;
+	int ncands, alloc;
+} ci;
+
+/* The pieces of _classify() that go an entry at a time.  Without SSE2
+ * they're all of it; with it, they finish off what the vectors leave. */
+
+/* Carries the nonzero prefix on from entry i, where everything before i
+ * is in range and its descents are counted, up to and including the one
+ * from entry i - 1 to entry i.  Returns where the prefix ends, or -1 if an
+ * entry is out of range. */
+static int _prefix_scalar(const uint32_t *e, int n, int i, int *descents)
+{
+	int k;
+	
+	for (k = i; (k < n) && e[k]; k++)
+	{
+		if ((e[k] < ci.lo) || (e[k] >= ci.hi))
+			return -1;
+		if ((k > i) && (e[k] < e[k - 1]))
+			(*descents)++;
+	}
+	return k;
+}
+
+/* Are entries i up to n all zero? */
+static int _zero_scalar(const uint32_t *e, int i, int n)
+{
+	for (; i < n; i++)
+		if (e[i])
+			return 0;
+	return 1;
+}
+
+/* A prefix of k entries that goes down more than one time in eight isn't
+ * a file's blocks. */
+static int _verdict(int k, int descents)
+{
+	if ((k <= 0) || (descents * 8 > k))
+		return -1;
+	return k;
+}
+
+#ifdef __SSE2__
+/* Looks at one block as an array of n block numbers.  Returns how many of
+ * them there are before the zero padding starts, or -1 if it doesn't look
+ * like an indirect block.
+ *
+ * This goes four entries at a time.  SSE2 only compares signed 32-bit
+ * values, so everything gets its top bit flipped first; that turns the
+ * unsigned order into the signed one.  The vector with the first zero in
+ * it, and the few entries that don't fill a vector, are left to the
+ * scalar code. */
+static int _classify(const uint32_t *e, int n)
+{
+	const __m128i flip = _mm_set1_epi32(0x80000000);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo = _mm_set1_epi32(ci.lo ^ 0x80000000);
+	const __m128i hi = _mm_set1_epi32((ci.hi - 1) ^ 0x80000000);
+	__m128i v, w, bad, nz;
+	int i, k, descents = 0;
+	
+	/* The nonzero prefix: in range, and count the places where it goes
+	 * down.  w is v shifted along by one, so it always has one entry
+	 * that's past the vector; stopping a vector short of the end keeps
+	 * that inside the block. */
+	for (i = 0; i + 4 < n; i += 4)
+	{
+		v = _mm_loadu_si128((const __m128i *)(e + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)))
+			break;
+		w = _mm_loadu_si128((const __m128i *)(e + i + 1));
+		v = _mm_xor_si128(v, flip);
+		bad = _mm_or_si128(_mm_cmplt_epi32(v, lo), _mm_cmpgt_epi32(v, hi));
+		if (_mm_movemask_epi8(bad))
+			return -1;
+		/* A zero after the last entry is the padding, not a descent. */
+		nz = _mm_cmpeq_epi32(w, zero);
+		w = _mm_xor_si128(w, flip);
+		descents += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(nz, _mm_cmpgt_epi32(v, w)))));
+	}
+	
+	/* Finish off the prefix, and the vector it ends in. */
+	k = _prefix_scalar(e, n, i, &descents);
+	if (k < 0)
+		return -1;
+	
+	/* The padding. */
+	i = (k + 3) & ~3;
+	if (!_zero_scalar(e, k, (i < n) ? i : n))
+		return -1;
+	for (nz = zero; i + 4 <= n; i += 4)
+		nz = _mm_or_si128(nz, _mm_loadu_si128((const __m128i *)(e + i)));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(nz, zero)) != 0xFFFF)
+		return -1;
+	if (!_zero_scalar(e, i, n))
+		return -1;
+	
+	return _verdict(k, descents);
+}
+#else
+static int _classify(const uint32_t *e, int n)
+{
+	int k, descents = 0;
+	
+	k = _prefix_scalar(e, n, 0, &descents);
+	if ((k < 0) || !_zero_scalar(e, k, n))
+		return -1;
+	return _verdict(k, descents);
+}
+#endif
+
+/* Moves a thread's finds into the shared list, so the lock is taken once
+ * every few dozen blocks found rather than once for each. */
+static void _flush(struct cand *local, int nlocal)
+{
+	pthread_mutex_lock(&ci.lock);
+	if (ci.ncands + nlocal > ci.alloc)
+	{
+		ci.alloc = (ci.alloc + nlocal) * 2;
+		ci.cands = realloc(ci.cands, ci.alloc * sizeof(*ci.cands));
+		if (!ci.cands)
+		{
+			perror("e3carveind: realloc");
+			exit(1);
+		}
+	}
+	memcpy(ci.cands + ci.ncands, local, nlocal * sizeof(*local));
+	ci.ncands += nlocal;
+	pthread_mutex_unlock(&ci.lock);
+}
+
+static void _carve(void *arg, block_t b, int n, const uint8_t *buf)
+{
+	struct cand local[64];
+	int nlocal = 0;
+	int i, k;
+	
+	(void) arg;
+	for (i = 0; i < n; i++)
+	{
+		const uint32_t *e = (const uint32_t *)(buf + i * ci.bs);
+		struct cand *c;
+		
+		/* Almost every block fails on its first entry or two. */
+		if (!e[0] || (e[0] < ci.lo) || (e[0] >= ci.hi))
+			continue;
+		k = _classify(e, ci.perblk);
+		if (k < 0)
+			continue;
+		
+		c = &local[nlocal++];
+		memset(c, 0, sizeof(*c));
+		c->block = b + i;
+		c->k = k;
+		c->level = 1;
+		c->weak = (k < ci.minentries);
+		c->first = e[0];
+		c->last = e[k - 1];
+		c->child0 = c->childn = -1;
+		if (nlocal == 64)
+		{
+			_flush(local, nlocal);
+			nlocal = 0;
+		}
+	}
+	if (nlocal)
+		_flush(local, nlocal);
+}
+
+static int _cand_cmp(const void *a, const void *b)
+{
+	const struct cand *ca = a, *cb = b;
+	
+	return (ca->block > cb->block) - (ca->block < cb->block);
+}
+
+static int _find(uint32_t b)
+{
+	int lo = 0, hi = ci.ncands;
+	
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		
+		if (ci.cands[mid].block < b)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ((lo < ci.ncands) && (ci.cands[lo].block == b)) ? lo : -1;
+}
+
+/* Works out which candidates are double or triple indirect blocks: the
+ * ones whose every entry is itself a candidate.  The ones that nothing
+ * points to are where files start. */
+static void _link(void)
+{
+	uint32_t *e = malloc(ci.bs);
+	int i, j, x;
+	
+	for (i = 0; e && (i < ci.ncands); i++)
+	{
+		struct cand *c = &ci.cands[i];
+		
+		if ((_find(c->first) < 0) || (_find(c->last) < 0))
+			continue;
+		if (disk_read_block(ci.e3t, c->block, (uint8_t *)e) < 0)
+			continue;
+		for (j = 0; j < c->k; j++)
+			if (_find(e[j]) < 0)
+				break;
+		if (j < c->k)
+			continue;
+		for (j = 0; j < c->k; j++)
+		{
+			x = _find(e[j]);
+			ci.cands[x].referenced = 1;
+		}
+		c->child0 = _find(c->first);
+		c->childn = _find(c->last);
+	}
+	free(e);
+	
+	/* Only levels 1 to 3 exist; anything that looks deeper is garbage
+	 * that happens to point at itself, and gets cut off at 3. */
+	for (i = 0; i < ci.ncands; i++)
+		for (x = ci.cands[i].child0; (x >= 0) && (ci.cands[i].level < 3); x = ci.cands[x].child0)
+			ci.cands[i].level++;
+}
+
+/* The last data block under candidate i, and whether it's full all the
+ * way down. */
+static uint32_t _lastdata(int i)
+{
+	int level;
+	
+	for (level = ci.cands[i].level; level > 1; level--)
+		i = ci.cands[i].childn;
+	return ci.cands[i].last;
+}
+
+static int _full(int i)
+{
+	int level;
+	
+	for (level = ci.cands[i].level; level > 1; level--)
+	{
+		if (ci.cands[i].k != ci.perblk)
+			return 0;
+		i = ci.cands[i].childn;
+	}
+	return ci.cands[i].k == ci.perblk;
+}
+
+/* A list of runs on their way out, in e3dumpblock -l's format. */
+struct runlist {
+	FILE *fp[2];
+	block_t start, count;
+	block_t total;
+};
+
+static void _run_flush(struct runlist *rl)
+{
+	int i;
+	
+	if (!rl->count)
+		return;
+	for (i = 0; i < 2; i++)
+		if (rl->fp[i])
+			fprintf(rl->fp[i], "%lld %lld\n", (long long int)rl->start, (long long int)rl->count);
+	rl->count = 0;
+}
+
+static void _run_add(struct runlist *rl, block_t b, block_t n)
+{
+	if (rl->count && (rl->start + rl->count == b))
+	{
+		rl->count += n;
+	} else {
+		_run_flush(rl);
+		rl->start = b;
+		rl->count = n;
+	}
+	rl->total += n;
+}
+
+static void _run_comment(struct runlist *rl, const char *s)
+{
+	int i;
+	
+	_run_flush(rl);
+	for (i = 0; i < 2; i++)
+		if (rl->fp[i])
+			fprintf(rl->fp[i], "# %s\n", s);
+}
+
+/* Puts every data block under candidate i, taken to be at the given
+ * level, on the list. */
+static void _emit_tree(struct runlist *rl, int i, int level)
+{
+	struct cand *c = &ci.cands[i];
+	uint32_t *e;
+	int j, x;
+	
+	e = malloc(ci.bs);
+	if (!e || (disk_read_block(ci.e3t, c->block, (uint8_t *)e) < 0))
+	{
+		fprintf(stderr, "e3carveind: couldn't read block %u again; leaving it out\n", c->block);
+		free(e);
+		return;
+	}
+	for (j = 0; j < c->k; j++)
+	{
+		if (level == 1)
+			_run_add(rl, e[j], 1);
+		else if ((x = _find(e[j])) >= 0)
+			_emit_tree(rl, x, level - 1);
+	}
+	free(e);
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	struct scan_range range;
+	struct scan_stats stats;
+	struct runlist rl;
+	char *outdir = NULL;
+	char path[1024], note[128];
+	int opt, i, r;
+	int nthreads = 4;
+	int nfiles = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	ci.minentries = MIN_ENTRIES;
+	while ((opt = getopt(argc, argv, "j:m:d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			ci.minentries = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			outdir = optarg;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((argc - optind) > 2)
+	{
+		printf("Usage: %s [-j threads] [-m entries] [-d dir] [start [count]]\n", argv[0]);
+		printf("-j sets how many threads read and sift through the disk (default 4)\n");
+		printf("-m sets how few entries an indirect block can have and still count (default %d)\n", MIN_ENTRIES);
+		printf("-d also writes each file's blocks to dir/<indirect block>.list\n");
+		printf("Looks for indirect blocks on the whole filesystem, or count blocks from start,\n");
+		printf("and puts them back together into files.  Prints a block list for each file,\n");
+		printf("in the format that e3dumpblock -l takes.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	ci.e3t = &e3t;
+	ci.bs = SB_BLOCK_SIZE(&e3t.sb);
+	ci.perblk = ci.bs / sizeof(uint32_t);
+	ci.lo = e3t.sb.s_first_data_block + 1;
+	ci.hi = (SB_BLOCKS_COUNT(&e3t.sb) > 0xFFFFFFFFULL) ? 0xFFFFFFFFU : SB_BLOCKS_COUNT(&e3t.sb);
+	if (ci.minentries < 1)
+		ci.minentries = 1;
+	pthread_mutex_init(&ci.lock, NULL);
+	
+	range.start = (argc - optind > 0) ? strtoull(argv[optind], NULL, 0) : 0;
+	range.count = (argc - optind > 1) ? strtoull(argv[optind + 1], NULL, 0) : (SB_BLOCKS_COUNT(&e3t.sb) - range.start);
+	scan_blocks(&e3t, &range, 1, nthreads, _carve, NULL, &stats);
+	
+	qsort(ci.cands, ci.ncands, sizeof(*ci.cands), _cand_cmp);
+	_link();
+	
+	/* Every candidate that nothing points to starts a file, unless it's
+	 * the double or triple indirect block of the file before it. */
+	for (i = 0; i < ci.ncands; )
+	{
+		struct cand *c = &ci.cands[i];
+		int tail;
+		
+		if (c->referenced || c->weak)
+		{
+			i++;
+			continue;
+		}
+		
+		memset(&rl, 0, sizeof(rl));
+		rl.fp[0] = stdout;
+		if (outdir)
+		{
+			snprintf(path, sizeof(path), "%s/%u.list", outdir, c->block);
+			rl.fp[1] = fopen(path, "w");
+			if (!rl.fp[1])
+				perror(path);
+		}
+		
+		snprintf(note, sizeof(note), "file %d: level %d indirect block %u", ++nfiles, c->level, c->block);
+		_run_comment(&rl, note);
+		if ((c->level == 1) && (c->first == c->block + 1) && (c->block >= ci.lo + INODE_INDIRECT1))
+		{
+			_run_comment(&rl, "direct blocks guessed from where the indirect block is");
+			_run_add(&rl, c->block - INODE_INDIRECT1, INODE_INDIRECT1);
+		} else {
+			_run_comment(&rl, "direct blocks unknown; the list starts at logical block 12");
+		}
+		_emit_tree(&rl, i, c->level);
+		
+		/* Pick up its double and triple indirect blocks. */
+		for (tail = i, r = i + 1; r < ci.ncands; r++)
+		{
+			if (ci.cands[r].referenced)
+				continue;
+			if ((ci.cands[r].level != ci.cands[tail].level + 1) || !_full(tail) ||
+			    (ci.cands[r].block != _lastdata(tail) + 1))
+				break;
+			snprintf(note, sizeof(note), "level %d indirect block %u", ci.cands[r].level, ci.cands[r].block);
+			_run_comment(&rl, note);
+			_emit_tree(&rl, r, ci.cands[r].level);
+			tail = r;
+		}
+		_run_flush(&rl);
+		snprintf(note, sizeof(note), "%lld blocks", (long long int)rl.total);
+		_run_comment(&rl, note);
+		printf("\n");
+		
+		if (rl.fp[1])
+			fclose(rl.fp[1]);
+		i = r;
+	}
+	
+	E3DEBUG(E3TOOLS_PFX "scanned %lld blocks (%lld unreadable); found %d indirect blocks, making %d files\n",
+		(long long int)stats.scanned, (long long int)stats.bad, ci.ncands, nfiles);
+	
+	free(ci.cands);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
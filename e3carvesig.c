@@ -0,0 +1,609 @@
+// e3carvesig
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "diskio.h"
+#include "scan.h"
+#include "bitmap.h"
+
+/* Deleted files whose inodes and indirect blocks are long gone can still
+ * be found by what they look like.  We go through the free blocks (or all
+ * of them, with -a) looking for the first few bytes of file formats that
+ * are worth having back, then read on from each one until the format says
+ * the file is over, and write out what we get.
+ *
+ * Assumptions:
+ *  - Files start at the start of a block, since that's where ext2/3/4
+ *    puts them.  So we only ever look at the first few bytes of each
+ *    block, and which formats could start there is a table lookup on the
+ *    first byte; that's all the matching it takes.
+ *  - A file we find this way was written in one piece.  If it wasn't,
+ *    what we write out is the start of it and then whatever came after it
+ *    on the disk.
+ *  - A file that doesn't say how long it is (gzip), or whose end we
+ *    haven't found yet, ends at the first block that's all zeroes or
+ *    starts another file.  That doesn't hold for zip and SQLite files,
+ *    which can have both inside them, but those do say how long they are.
+ *  - The slack after the end of a file in its last block is zeroes.  For
+ *    PDFs, which can have a "%%EOF" partway through, that's how we tell
+ *    the last one. */
+
+#define CARVE_STEP (1024 * 1024)	/* read this much more at a time while looking for the end */
+
+/* Each end() looks at the first len bytes of a candidate and returns how
+ * long the file is, 0 if it needs to see more, or -1 if it isn't one of
+ * these after all.  *pos and *state are its own, to pick up where it left
+ * off the next time, when there's more to see. */
+typedef int64_t (*sig_end_fn)(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state);
+
+struct sig {
+	const char *name;	/* also what carved files get as an extension */
+	const char *magic;
+	int magiclen;
+	uint64_t maxsize;
+	int stop_at_gap;	/* a zero block or another header means we've gone too far */
+	int (*ok)(const uint8_t *p);	/* anything past the magic that has to hold */
+	sig_end_fn end;		/* NULL if there's no telling */
+};
+
+struct hit {
+	block_t block;
+	int sig;
+	int64_t len;		/* what got carved, once it has */
+	const char *status;
+	const char *ext;
+};
+
+static struct {
+	e3tools_t *e3t;
+	int bs;
+	block_t nblocks;
+	char *outdir;
+	uint8_t byfirst[256];	/* which signatures (bit n for sigs[n]) start with each byte */
+	pthread_mutex_t lock;
+	struct hit *hits;
+	int nhits, alloc;
+	int next;		/* next hit to carve */
+} cs;
+
+#define BE16(p) (((uint32_t)(p)[0] << 8) | (p)[1])
+#define BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (p)[3])
+#define LE16(p) (((uint32_t)(p)[1] << 8) | (p)[0])
+#define LE32(p) (((uint32_t)(p)[3] << 24) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[1] << 8) | (p)[0])
+
+static const uint8_t *_search(const uint8_t *buf, uint64_t len, const char *pat, int patlen)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	
+	while ((p = memchr(p, pat[0], end - p)) && (p + patlen <= end))
+	{
+		if (memcmp(p, pat, patlen) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/* JPEG: marker segments, each with its length, up to the start of scan;
+ * then entropy coded data, in which an 0xFF is always followed by a 0x00
+ * or a restart marker, until the next real marker.  Going by the segment
+ * lengths steps over the thumbnail in the EXIF data, with its own end of
+ * image marker. */
+static int _jpeg_ok(const uint8_t *p)
+{
+	return p[3] >= 0xC0;
+}
+
+static int64_t _jpeg_end(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state)
+{
+	uint64_t p = *pos ? *pos : 2;
+	const uint8_t *q;
+	int m;
+	
+	for (;;)
+	{
+		if (*state == 0)
+		{
+			if (p + 4 > len)
+				break;
+			if (buf[p] != 0xFF)
+				return -1;
+			m = buf[p + 1];
+			if (m == 0xFF)
+			{
+				p++;
+			} else if (m == 0xD9) {
+				return p + 2;
+			} else if (((m >= 0xD0) && (m <= 0xD7)) || (m == 0x01)) {
+				p += 2;
+			} else if ((m == 0x00) || (m == 0xD8) || (BE16(buf + p + 2) < 2)) {
+				return -1;
+			} else {
+				p += 2 + BE16(buf + p + 2);
+				if (m == 0xDA)
+					*state = 1;
+			}
+		} else {
+			if (p >= len)
+				break;
+			q = memchr(buf + p, 0xFF, len - p);
+			if (!q || (q + 1 >= buf + len))
+			{
+				p = q ? (uint64_t)(q - buf) : len;
+				break;
+			}
+			p = q - buf;
+			m = buf[p + 1];
+			if ((m == 0x00) || ((m >= 0xD0) && (m <= 0xD7)))
+				p += 2;
+			else if (m == 0xFF)
+				p++;
+			else if (m == 0xD9)
+				return p + 2;
+			else
+				*state = 0;	/* more tables and another scan, in a progressive JPEG */
+		}
+	}
+	*pos = p;
+	return 0;
+}
+
+/* PNG: chunks, each with its length, up to IEND. */
+static int64_t _png_end(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state)
+{
+	uint64_t p = *pos ? *pos : 8;
+	int i;
+	
+	(void) state;
+	while (p + 12 <= len)
+	{
+		if (BE32(buf + p) > 0x7FFFFFFF)
+			return -1;
+		for (i = 4; i < 8; i++)
+			if (((buf[p + i] | 0x20) < 'a') || ((buf[p + i] | 0x20) > 'z'))
+				return -1;
+		if (memcmp(buf + p + 4, "IEND", 4) == 0)
+			return p + 12;
+		p += 12 + BE32(buf + p);
+	}
+	*pos = p;
+	return 0;
+}
+
+/* PDF: the "%%EOF" that has nothing but zeroes after it to the end of its
+ * block.  An updated or linearized PDF has others further in. */
+static int64_t _pdf_end(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state)
+{
+	uint64_t p = *pos ? *pos : 5;
+	uint64_t e, blockend;
+	const uint8_t *q;
+	
+	(void) state;
+	for (;;)
+	{
+		q = _search(buf + p, len - p, "%%EOF", 5);
+		if (!q)
+		{
+			*pos = (len - p > 4) ? len - 4 : p;
+			return 0;
+		}
+		e = (q - buf) + 5;
+		blockend = (e + cs.bs - 1) / cs.bs * cs.bs;
+		if (blockend > len)
+		{
+			*pos = q - buf;
+			return 0;
+		}
+		while ((e < blockend) && ((buf[e] == '\r') || (buf[e] == '\n')))
+			e++;
+		for (p = e; (p < blockend) && !buf[p]; p++)
+			;
+		if (p == blockend)
+			return e;
+		p = e;
+	}
+}
+
+/* Zip (and so OOXML): the end of central directory record, which says
+ * where the central directory started and how long it is; that has to
+ * bring us to the record itself, relative to where the file started. */
+static int64_t _zip_end(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state)
+{
+	uint64_t p = *pos ? *pos : 4;
+	uint64_t f, end;
+	const uint8_t *q;
+	
+	(void) state;
+	for (;;)
+	{
+		q = _search(buf + p, len - p, "PK\5\6", 4);
+		if (!q)
+		{
+			*pos = (len - p > 3) ? len - 3 : p;
+			return 0;
+		}
+		f = q - buf;
+		if (f + 22 > len)
+		{
+			*pos = f;
+			return 0;
+		}
+		/* With zip64, the offsets are all ones, and the real ones are
+		 * elsewhere; we take it on trust. */
+		if ((LE32(buf + f + 16) == 0xFFFFFFFF) || (U64(LE32(buf + f + 16)) + LE32(buf + f + 12) == f))
+		{
+			end = f + 22 + LE16(buf + f + 20);
+			if (end > len)
+			{
+				*pos = f;
+				return 0;
+			}
+			return end;
+		}
+		p = f + 4;
+	}
+}
+
+/* SQLite: the header says how big a page is and how many there are (if
+ * the count was written by a version that keeps it up to date). */
+static int64_t _sqlite_end(const uint8_t *buf, uint64_t len, uint64_t *pos, int *state)
+{
+	uint64_t pagesz, size;
+	
+	(void) pos;
+	(void) state;
+	if (len < 100)
+		return 0;
+	pagesz = (BE16(buf + 16) == 1) ? 65536 : BE16(buf + 16);
+	if ((pagesz < 512) || (pagesz & (pagesz - 1)))
+		return -1;
+	if (!BE32(buf + 28) || (BE32(buf + 92) != BE32(buf + 24)))
+		return -1;
+	size = pagesz * BE32(buf + 28);
+	return (size <= len) ? (int64_t)size : 0;
+}
+
+static int _gzip_ok(const uint8_t *p)
+{
+	return (p[3] & 0xE0) == 0;
+}
+
+static const struct sig sigs[] = {
+	{ "jpg",    "\xFF\xD8\xFF",        3,  32 * 1024 * 1024, 1, _jpeg_ok, _jpeg_end },
+	{ "png",    "\x89PNG\r\n\x1A\n",   8,  64 * 1024 * 1024, 1, NULL, _png_end },
+	{ "pdf",    "%PDF-",               5,  64 * 1024 * 1024, 1, NULL, _pdf_end },
+	{ "zip",    "PK\3\4",              4, 256 * 1024 * 1024, 0, NULL, _zip_end },
+	{ "sqlite", "SQLite format 3",    16, 256 * 1024 * 1024, 0, NULL, _sqlite_end },
+	{ "gz",     "\x1F\x8B\x08",        3,  64 * 1024 * 1024, 1, _gzip_ok, NULL },
+};
+#define NSIGS (int)(sizeof(sigs) / sizeof(sigs[0]))
+
+/* Which signature, if any, the block at p starts with. */
+static int _sig_at(const uint8_t *p)
+{
+	int m = cs.byfirst[p[0]];
+	int i;
+	
+	for (i = 0; m; i++, m >>= 1)
+		if ((m & 1) && (memcmp(p, sigs[i].magic, sigs[i].magiclen) == 0) && (!sigs[i].ok || sigs[i].ok(p)))
+			return i;
+	return -1;
+}
+
+/* An OOXML file is a zip with "[Content_Types].xml" in it; which kind it
+ * is goes by the directory that the document itself is in. */
+static const char *_zip_kind(const uint8_t *buf, uint64_t len)
+{
+	if (!_search(buf, len, "[Content_Types].xml", 19))
+		return "zip";
+	if (_search(buf, len, "word/", 5))
+		return "docx";
+	if (_search(buf, len, "xl/", 3))
+		return "xlsx";
+	if (_search(buf, len, "ppt/", 4))
+		return "pptx";
+	return "zip";
+}
+
+/* Moves a thread's finds into the shared list, so the lock is taken once
+ * every few dozen headers found rather than once for each. */
+static void _flush(struct hit *local, int nlocal)
+{
+	pthread_mutex_lock(&cs.lock);
+	if (cs.nhits + nlocal > cs.alloc)
+	{
+		cs.alloc = (cs.alloc + nlocal) * 2;
+		cs.hits = realloc(cs.hits, cs.alloc * sizeof(*cs.hits));
+		if (!cs.hits)
+		{
+			perror("e3carvesig: realloc");
+			exit(1);
+		}
+	}
+	memcpy(cs.hits + cs.nhits, local, nlocal * sizeof(*local));
+	cs.nhits += nlocal;
+	pthread_mutex_unlock(&cs.lock);
+}
+
+static void _scan(void *arg, block_t b, int n, const uint8_t *buf)
+{
+	struct hit local[64];
+	int nlocal = 0;
+	int i, s;
+	
+	(void) arg;
+	for (i = 0; i < n; i++)
+	{
+		if ((s = _sig_at(buf + i * cs.bs)) < 0)
+			continue;
+		
+		memset(&local[nlocal], 0, sizeof(local[nlocal]));
+		local[nlocal].block = b + i;
+		local[nlocal].sig = s;
+		if (++nlocal == 64)
+		{
+			_flush(local, nlocal);
+			nlocal = 0;
+		}
+	}
+	if (nlocal)
+		_flush(local, nlocal);
+}
+
+/* Is the block at p one that a file we're carving can't run into? */
+static int _gap(const uint8_t *p)
+{
+	int i;
+	
+	if (_sig_at(p) >= 0)
+		return 1;
+	for (i = 0; i < cs.bs; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static int _write_out(struct hit *h, const uint8_t *buf)
+{
+	char path[1024];
+	FILE *fp;
+	
+	snprintf(path, sizeof(path), "%s/%lld.%s", cs.outdir, (long long int)h->block, h->ext);
+	fp = fopen(path, "w");
+	if (!fp)
+	{
+		perror(path);
+		return -1;
+	}
+	if (fwrite(buf, 1, h->len, fp) != (size_t)h->len)
+		perror(path);
+	fclose(fp);
+	return 0;
+}
+
+/* Reads on from a header until the file's end turns up, or we run into
+ * something that can't be part of it, or it's as big as we'll believe. */
+static void _carve_one(struct hit *h)
+{
+	const struct sig *s = &sigs[h->sig];
+	uint8_t *buf = NULL, *nbuf;
+	uint64_t have = 0, limit, pos = 0;
+	int64_t end = 0;
+	int state = 0;
+	int n, i, step = CARVE_STEP / cs.bs;
+	
+	limit = (cs.nblocks - h->block) * cs.bs;
+	if (limit > s->maxsize)
+		limit = s->maxsize;
+	
+	while (!end && (have < limit))
+	{
+		n = ((limit - have) / cs.bs < U64(step)) ? (int)((limit - have + cs.bs - 1) / cs.bs) : step;
+		nbuf = realloc(buf, have + n * cs.bs);
+		if (!nbuf)
+		{
+			perror("e3carvesig: realloc");
+			break;
+		}
+		buf = nbuf;
+		
+		if (disk_read_blocks(cs.e3t, h->block + have / cs.bs, n, buf + have) < 0)
+		{
+			for (i = 0; i < n; i++)
+				if (disk_read_block(cs.e3t, h->block + have / cs.bs + i, buf + have + i * cs.bs) < 0)
+					break;
+			if (i < n)
+			{
+				E3DEBUG(E3TOOLS_PFX "couldn't read block %lld; stopping the %s at %lld there\n",
+					(long long int)(h->block + have / cs.bs + i), s->name, (long long int)h->block);
+				n = i;
+				limit = have + n * cs.bs;
+			}
+		}
+		if (s->stop_at_gap)
+		{
+			for (i = (have == 0) ? 1 : 0; i < n; i++)
+			{
+				if (_gap(buf + have + i * cs.bs))
+				{
+					n = i;
+					limit = have + n * cs.bs;
+					break;
+				}
+			}
+		}
+		have = (have + n * cs.bs > limit) ? limit : have + n * cs.bs;
+		if (s->end)
+			end = s->end(buf, have, &pos, &state);
+	}
+	
+	h->ext = s->name;
+	if (end < 0)
+	{
+		h->status = "not one after all";
+		h->len = 0;
+	} else if (end > 0) {
+		h->status = "complete";
+		h->len = end;
+	} else {
+		h->status = s->end ? "truncated" : "size guessed";
+		h->len = have;
+	}
+	if ((end > 0) && (s->end == _zip_end))
+		h->ext = _zip_kind(buf, end);
+	
+	if (cs.outdir && (h->len > 0))
+		_write_out(h, buf);
+	free(buf);
+}
+
+static void *_carve_worker(void *arg)
+{
+	int i;
+	
+	(void) arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&cs.lock);
+		i = cs.next++;
+		pthread_mutex_unlock(&cs.lock);
+		if (i >= cs.nhits)
+			break;
+		_carve_one(&cs.hits[i]);
+	}
+	return NULL;
+}
+
+static int _hit_cmp(const void *a, const void *b)
+{
+	const struct hit *ha = a, *hb = b;
+	
+	return (ha->block > hb->block) - (ha->block < hb->block);
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	struct scan_range whole, *ranges = &whole;
+	struct scan_stats stats;
+	pthread_t *threads;
+	char *types = NULL;
+	int nranges = 1;
+	int opt, i, j, started = 0;
+	int all = 0;
+	int nthreads = 4;
+	int ncarved = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "aj:o:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			all = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			cs.outdir = optarg;
+			break;
+		case 't':
+			types = optarg;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc)
+	{
+		printf("Usage: %s [-a] [-j threads] [-t types] [-o dir]\n", argv[0]);
+		printf("-a looks through every block, not just the ones the bitmaps say are free\n");
+		printf("-j sets how many threads read and carve (default 4)\n");
+		printf("-t only looks for some kinds of file, i.e. 'jpg,png' (default: all of");
+		for (i = 0; i < NSIGS; i++)
+			printf(" %s", sigs[i].name);
+		printf(")\n");
+		printf("-o writes what's carved out to dir/<block>.<type>; otherwise, just lists it\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	cs.e3t = &e3t;
+	cs.bs = SB_BLOCK_SIZE(&e3t.sb);
+	cs.nblocks = SB_BLOCKS_COUNT(&e3t.sb);
+	pthread_mutex_init(&cs.lock, NULL);
+	for (i = 0; i < NSIGS; i++)
+	{
+		if (types)
+		{
+			const char *p = strstr(types, sigs[i].name);
+			int len = strlen(sigs[i].name);
+			
+			if (!p || ((p != types) && (p[-1] != ',')) || (p[len] && (p[len] != ',')))
+				continue;
+		}
+		cs.byfirst[(uint8_t)sigs[i].magic[0]] |= 1 << i;
+	}
+	
+	whole.start = 0;
+	whole.count = cs.nblocks;
+	if (!all && (bitmap_free_ranges(&e3t, &ranges, &nranges) < 0))
+	{
+		printf("e3carvesig: couldn't make sense of the block bitmaps; looking through every block instead\n");
+		ranges = &whole;
+		nranges = 1;
+	}
+	scan_blocks(&e3t, ranges, nranges, nthreads, _scan, NULL, &stats);
+	if (ranges != &whole)
+		free(ranges);
+	
+	/* The headers are few and far between, so carving them gets a pool
+	 * of its own, taking them in order of where they are on the disk. */
+	qsort(cs.hits, cs.nhits, sizeof(*cs.hits), _hit_cmp);
+	threads = (nthreads > 1) ? malloc(nthreads * sizeof(pthread_t)) : NULL;
+	for (i = 0; threads && (i < nthreads); i++)
+	{
+		if (pthread_create(&threads[i], NULL, _carve_worker, NULL) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		_carve_worker(NULL);
+	for (j = 0; j < started; j++)
+		pthread_join(threads[j], NULL);
+	free(threads);
+	
+	printf("# block\ttype\tbytes\tstatus\n");
+	for (i = 0; i < cs.nhits; i++)
+	{
+		struct hit *h = &cs.hits[i];
+		
+		printf("%lld\t%s\t%lld\t%s\n", (long long int)h->block, h->ext, (long long int)h->len, h->status);
+		ncarved += (h->len > 0);
+	}
+	
+	E3DEBUG(E3TOOLS_PFX "looked at %lld blocks (%lld unreadable); found %d headers, carved %d files\n",
+		(long long int)stats.scanned, (long long int)stats.bad, cs.nhits, ncarved);
+	
+	free(cs.hits);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
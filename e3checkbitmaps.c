@@ -0,0 +1,126 @@
+// e3checkbitmaps
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "bitmap.h"
+
+/* Counts what every group's block and inode bitmaps say is free, and
+ * checks that against the free counts in the group descriptors and the
+ * superblock.  A descriptor that disagrees with its bitmap means one of
+ * them got written and the other didn't -- or one of them is garbage.
+ *
+ * Assumptions:
+ *  - The kernel only brings the superblock's totals up to date now and
+ *    then, so a mounted or uncleanly unmounted filesystem can be a little
+ *    off there without anything being wrong; the descriptors it keeps
+ *    exact. */
+
+struct totals {
+	uint64_t bitmaps, descs;
+	int bad;		/* groups where they disagree */
+	int unreadable;
+};
+
+static void _check_group(e3tools_t *e3t, const struct bitmap_set *set, int bg, uint32_t descfree, struct totals *t, int verbose)
+{
+	const char *what = (set->which == BITMAP_BLOCKS) ? "block" : "inode";
+	uint64_t free;
+	
+	t->descs += descfree;
+	if (set->status[bg] < 0)
+	{
+		printf("group %d: couldn't read the %s bitmap; the descriptor says %u free\n", bg, what, descfree);
+		t->unreadable++;
+		return;
+	}
+	free = bitmap_count_free(e3t, set, bg);
+	t->bitmaps += free;
+	if (free != descfree)
+	{
+		printf("group %d: %s bitmap%s has %llu free, the descriptor says %u\n", bg, what,
+		       set->status[bg] ? " (never initialized)" : "", (unsigned long long)free, descfree);
+		t->bad++;
+	} else if (verbose) {
+		printf("group %d: %s bitmap%s has %llu free\n", bg, what,
+		       set->status[bg] ? " (never initialized)" : "", (unsigned long long)free);
+	}
+}
+
+static void _summary(const char *what, const struct totals *t, uint64_t sbfree)
+{
+	printf("%s: bitmaps have %llu free, descriptors add up to %llu, superblock says %llu",
+	       what, (unsigned long long)t->bitmaps, (unsigned long long)t->descs, (unsigned long long)sbfree);
+	if ((t->bitmaps != t->descs) || (t->descs != sbfree))
+		printf(" -- mismatch");
+	printf("; %d groups disagree", t->bad);
+	if (t->unreadable)
+		printf(", %d unreadable", t->unreadable);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	struct bitmap_set blocks, inodes;
+	struct totals bt = {0}, it = {0};
+	const uint8_t *gdt;
+	struct e3_group_desc gd;
+	int opt, bg;
+	int verbose = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "v")) != -1)
+	{
+		switch (opt)
+		{
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	gdt = block_group_desc_table(&e3t);
+	if ((optind != argc) || !e3t.geom || !gdt)
+	{
+		printf("Usage: %s [-v]\n", argv[0]);
+		printf("-v lists every group, not just the ones whose counts are off\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	if ((bitmap_load(&e3t, BITMAP_BLOCKS, &blocks) < 0) || (bitmap_load(&e3t, BITMAP_INODES, &inodes) < 0))
+	{
+		printf("Couldn't load the bitmaps\n");
+		exit(1);
+	}
+	
+	for (bg = 0; bg < e3t.ngroups; bg++)
+	{
+		block_group_desc_decode(&e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&e3t.sb), &gd);
+		_check_group(&e3t, &blocks, bg, gd.free_blocks_count, &bt, verbose);
+		_check_group(&e3t, &inodes, bg, gd.free_inodes_count, &it, verbose);
+	}
+	_summary("blocks", &bt, SB_FREE_BLOCKS_COUNT(&e3t.sb));
+	_summary("inodes", &it, e3t.sb.s_free_inodes_count);
+	
+	bitmap_set_free(&blocks);
+	bitmap_set_free(&inodes);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
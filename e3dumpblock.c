@@ -6,16 +6,243 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
 
 #include "e3tools.h"
 #include "superblock.h"
 #include "diskio.h"
+#include "bufpool.h"
+
+/* Blocks are read straight into one big buffer, as many at a time as the
+ * request allows, and go out in one write per buffer-full; that keeps
+ * imaging a big stretch of disk down to a few large requests each way,
+ * instead of a process, a read and a write per block. */
+#define DUMP_BUFSZ (4 * 1024 * 1024)
+
+static struct {
+	int fd;
+	int hex;
+	int elide;		/* -z */
+	int seekable;		/* can we leave holes in the output? */
+	uint8_t *buf;
+	int bufblocks;
+	int bs;
+	int zeroes_pending;	/* for the hex dump: are we in a run of zero blocks? */
+	int nbad;
+} d;
+
+static int _out(const void *p, size_t len)
+{
+	const uint8_t *buf = p;
+	
+	while (len)
+	{
+		ssize_t rv = write(d.fd, buf, len);
+		
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			return -1;
+		}
+		buf += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
+static int _is_zero(const uint8_t *p, int len)
+{
+	const uint64_t *q = (const uint64_t *)p;
+	int i;
+	
+	for (i = 0; i < len / 8; i++)
+		if (q[i])
+			return 0;
+	return 1;
+}
+
+static int _hexdump(block_t b, const uint8_t *p)
+{
+	char line[E3TOOLS_HEXDUMP_LINE];
+	uint64_t addr = U64(b) * d.bs;
+	int ofs, n;
+	
+	if (d.elide && _is_zero(p, d.bs))
+	{
+		if (!d.zeroes_pending)
+		{
+			n = snprintf(line, sizeof(line), "%012llx  (block %lld) all zeroes\n*\n", (unsigned long long)addr, (long long int)b);
+			if (_out(line, n) < 0)
+				return -1;
+		}
+		d.zeroes_pending = 1;
+		return 0;
+	}
+	d.zeroes_pending = 0;
+	
+	for (ofs = 0; ofs < d.bs; ofs += 16)
+	{
+		n = e3tools_hexdump_line(line, addr + ofs, p + ofs);
+		if (_out(line, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Hands n blocks sitting in d.buf, the first of which is b, to the
+ * output. */
+static int _emit(block_t b, int n)
+{
+	int i, start;
+	
+	if (d.hex)
+	{
+		for (i = 0; i < n; i++)
+			if (_hexdump(b + i, d.buf + i * d.bs) < 0)
+				return -1;
+		return 0;
+	}
+	
+	if (!d.elide || !d.seekable)
+		return _out(d.buf, n * d.bs);
+	
+	/* Runs of zero blocks turn into holes in the output. */
+	for (i = 0; i < n; )
+	{
+		if (_is_zero(d.buf + i * d.bs, d.bs))
+		{
+			for (start = i; (i < n) && _is_zero(d.buf + i * d.bs, d.bs); i++)
+				;
+			if (lseek(d.fd, (off_t)(i - start) * d.bs, SEEK_CUR) < 0)
+			{
+				perror("lseek");
+				return -1;
+			}
+		} else {
+			for (start = i; (i < n) && !_is_zero(d.buf + i * d.bs, d.bs); i++)
+				;
+			if (_out(d.buf + start * d.bs, (i - start) * d.bs) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Dumps count blocks starting at b, a buffer-full at a time.  If a read
+ * fails, we go back over that buffer-full a block at a time, so that only
+ * the blocks that are really bad come out as zeroes. */
+static int _dump_range(e3tools_t *e3t, block_t b, block_t count)
+{
+	int n, i;
+	
+	while (count)
+	{
+		n = (count > U64(d.bufblocks)) ? d.bufblocks : (int)count;
+		
+		if (disk_read_blocks(e3t, b, n, d.buf) < 0)
+		{
+			for (i = 0; i < n; i++)
+			{
+				if (disk_read_block(e3t, b + i, d.buf + i * d.bs) >= 0)
+					continue;
+				fprintf(stderr, "WARNING: couldn't read block %lld; dumping zeroes in its place\n", (long long int)(b + i));
+				memset(d.buf + i * d.bs, 0, d.bs);
+				d.nbad++;
+			}
+		}
+		if (_emit(b, n) < 0)
+			return -1;
+		
+		b += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/* Each line of a list is a block, or a block and a count; blank lines and
+ * anything after a '#' are ignored.  Neighbouring blocks get merged into
+ * one range, so a list of consecutive blocks costs no more than a range.
+ * Returns -1 if the list couldn't be read, a line made no sense, or the
+ * output couldn't be written. */
+static int _dump_list(e3tools_t *e3t, const char *fname)
+{
+	FILE *fp;
+	char line[256];
+	block_t start = 0, count = 0;
+	int lineno = 0;
+	int rv = 0;
+	
+	fp = strcmp(fname, "-") ? fopen(fname, "r") : stdin;
+	if (!fp)
+	{
+		perror(fname);
+		return -1;
+	}
+	
+	while (fgets(line, sizeof(line), fp))
+	{
+		char *p = line, *end;
+		block_t b, n = 1;
+		
+		lineno++;
+		if (strchr(p, '#'))
+			*strchr(p, '#') = '\0';
+		b = strtoull(p, &end, 0);
+		if (end == p)
+		{
+			for (; *p && strchr(" \t\r\n", *p); p++)
+				;
+			if (*p)
+			{
+				fprintf(stderr, "%s:%d: can't make sense of this line; skipping it\n", fname, lineno);
+				rv = -1;
+			}
+			continue;
+		}
+		p = end;
+		n = strtoull(p, &end, 0);
+		if (end == p)
+			n = 1;
+		
+		if (count && (start + count == b))
+		{
+			count += n;
+			continue;
+		}
+		if (count && (_dump_range(e3t, start, count) < 0))
+		{
+			count = 0;
+			rv = -1;
+			break;
+		}
+		start = b;
+		count = n;
+	}
+	if (ferror(fp))
+	{
+		perror(fname);
+		rv = -1;
+	} else if (count && (_dump_range(e3t, start, count) < 0)) {
+		rv = -1;
+	}
+	
+	if (fp != stdin)
+		fclose(fp);
+	return rv;
+}
 
 int main(int argc, char **argv)
 {
 	e3tools_t e3t;
-	block_t b;
-	void *block;
+	int opt;
+	char *listfile = NULL;
+	char *outfile = NULL;
+	block_t b, count = 1;
+	int rv;
 	
 	if (e3tools_init(&e3t, &argc, &argv) < 0)
 	{
@@ -23,25 +250,84 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	
-	if (argc != 2)
+	while ((opt = getopt(argc, argv, "l:o:xz")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l':
+			listfile = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'x':
+			d.hex = 1;
+			break;
+		case 'z':
+			d.elide = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	
+	if (listfile ? (optind != argc) : (((argc - optind) < 1) || ((argc - optind) > 2)))
 	{
-		printf("Usage: %s e3tools_options\n", argv[0]);
+		printf("Usage: %s [-o outfile] [-x] [-z] block [count]\n", argv[0]);
+		printf("       %s [-o outfile] [-x] [-z] -l listfile\n", argv[0]);
+		printf("-o writes to outfile instead of standard output\n");
+		printf("-x writes a hex dump instead of the raw blocks\n");
+		printf("-z skips blocks that are all zeroes (leaving holes in outfile, or a '*' in a hex dump)\n");
+		printf("-l dumps the blocks listed in listfile ('-' for standard input), one block\n");
+		printf("   or 'block count' per line\n");
 		e3tools_usage();
 		exit(1);
 	}
 	
-	block = alloca(SB_BLOCK_SIZE(&e3t.sb));
-	b = strtoll(argv[1], NULL, 0);
-	
-	if (disk_read_block(&e3t, b, (uint8_t *)block) < 0)
+	d.bs = SB_BLOCK_SIZE(&e3t.sb);
+	d.bufblocks = DUMP_BUFSZ / d.bs;
+	if (posix_memalign((void **)&d.buf, BUFPOOL_ALIGN, d.bufblocks * d.bs) != 0)
 	{
-		perror("disk_read_block");
+		perror("posix_memalign");
 		return 1;
 	}
 	
-	write(1, block, SB_BLOCK_SIZE(&e3t.sb));
+	d.fd = 1;
+	if (outfile)
+	{
+		d.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (d.fd < 0)
+		{
+			perror(outfile);
+			return 1;
+		}
+	}
+	d.seekable = (lseek(d.fd, 0, SEEK_CUR) >= 0);
+	
+	if (listfile)
+	{
+		rv = _dump_list(&e3t, listfile);
+	} else {
+		b = strtoll(argv[optind], NULL, 0);
+		if ((argc - optind) == 2)
+			count = strtoll(argv[optind + 1], NULL, 0);
+		rv = _dump_range(&e3t, b, count);
+	}
+	
+	/* If we finished on a hole, it has to be made part of the file. */
+	if (d.seekable && !d.hex && d.elide)
+	{
+		off_t end = lseek(d.fd, 0, SEEK_CUR);
+		
+		if ((end >= 0) && (ftruncate(d.fd, end) < 0) && outfile)
+			perror("ftruncate");
+	}
+	if (outfile)
+		close(d.fd);
+	free(d.buf);
 	
 	e3tools_close(&e3t);
 	
-	return 0;
+	return ((rv < 0) || d.nbad) ? 1 : 0;
 }
@@ -0,0 +1,894 @@
+// e3extract
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "e3tools.h"
+#include "diskio.h"
+#include "inode.h"
+#include "dir.h"
+#include "namei.h"
+#include "bufpool.h"
+
+/* Copying a tree out goes through three stages, all running at once:
+ * readers take jobs off a stack -- listing a directory (which is where the
+ * metadata reads happen) or reading a file's data -- and writers take the
+ * data that the readers have read and put it on the host.  A fixed pool of
+ * chunk buffers sits between the two, so a slow host disk holds up the
+ * readers rather than eating all of memory.
+ *
+ * Files are written to "name.e3part" and renamed once they're complete, so
+ * if we get killed partway through, running again with the same arguments
+ * picks up where we left off: anything that is already there, with the
+ * right size and modification time, gets skipped.
+ *
+ * With -o, file data isn't read as the walk comes across it.  The walk
+ * just notes down where every file's runs are, and once it is over, the
+ * readers go through all of them in order of where they are on the disk,
+ * so that a spinning disk sweeps across the volume once instead of seeking
+ * back and forth between files.  Files then get written out of order,
+ * which is fine, since every chunk knows where in its file it goes. */
+
+#define CHUNK_BYTES (1024 * 1024)
+#define PART_SUFFIX ".e3part"
+
+/* A file on its way out.  The reader hands its chunks to the writers as it
+ * goes; whoever finishes with the last piece of it sets its size, mode and
+ * times and moves it into place. */
+struct xfile {
+	char *path;
+	char *tmppath;
+	int fd;			/* -1 if we open it for each write (with -o, there are too many) */
+	struct ext2_inode inode;
+	int pending;		/* chunks (or planned pieces) still to be written, plus one while the reader is at it */
+	int damaged;
+};
+
+struct xchunk {
+	struct xfile *f;
+	uint64_t offset;
+	int len;
+	uint8_t *buf;
+	struct xchunk *next;
+};
+
+/* A run of blocks that -o will read later on. */
+struct xpiece {
+	struct xfile *f;
+	block_t disk;
+	block_t lblk;
+	int n;
+};
+
+/* A directory to list or a file to copy. */
+struct xjob {
+	int ino;
+	char *path;
+	struct ext2_inode inode;
+	struct xjob *next;
+};
+
+static struct {
+	e3tools_t *e3t;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a job went onto the stack, or the last one finished */
+	pthread_cond_t wwork;	/* a chunk went onto the write queue */
+	pthread_cond_t bufs;	/* a chunk buffer came back */
+	struct xjob *jobs;	/* a stack, so that the walk stays more or less depth first */
+	int busy;		/* readers partway through a job */
+	struct xchunk *whead, *wtail;
+	struct xchunk *freebufs;
+	int nwriters;
+	int readers_done;
+	int chunk;		/* bytes per chunk; a whole number of blocks */
+	int ordered;		/* -o */
+	struct xpiece *pieces;
+	size_t npieces, piecealloc;
+	size_t nextpiece;	/* next one for a reader to take */
+	uint8_t *visited;	/* one bit per inode */
+	int ninodes;
+	int verbose;
+	int nfiles, ndirs, nlinks, nskipped, nerrors;
+	uint64_t nbytes;
+} x;
+
+static char *_join(const char *dir, const char *name, int len)
+{
+	int dlen = strlen(dir);
+	char *p = malloc(dlen + len + 2);
+	int i;
+	
+	if (!p)
+	{
+		perror("_join: malloc");
+		exit(1);
+	}
+	memcpy(p, dir, dlen);
+	p[dlen] = '/';
+	for (i = 0; i < len; i++)	/* The host won't take these in a name. */
+		p[dlen + 1 + i] = ((name[i] == '/') || (name[i] == '\0')) ? '_' : name[i];
+	p[dlen + 1 + len] = '\0';
+	return p;
+}
+
+static void _count(int *counter)
+{
+	pthread_mutex_lock(&x.lock);
+	(*counter)++;
+	pthread_mutex_unlock(&x.lock);
+}
+
+static void _push_job(int ino, char *path, struct ext2_inode *inode)
+{
+	struct xjob *j = malloc(sizeof(*j));
+	
+	if (!j)
+	{
+		perror("_push_job: malloc");
+		exit(1);
+	}
+	j->ino = ino;
+	j->path = path;
+	j->inode = *inode;
+	
+	pthread_mutex_lock(&x.lock);
+	j->next = x.jobs;
+	x.jobs = j;
+	pthread_cond_signal(&x.work);
+	pthread_mutex_unlock(&x.lock);
+}
+
+static struct xchunk *_get_chunk(void)
+{
+	struct xchunk *c;
+	
+	pthread_mutex_lock(&x.lock);
+	while (!x.freebufs)
+		pthread_cond_wait(&x.bufs, &x.lock);
+	c = x.freebufs;
+	x.freebufs = c->next;
+	pthread_mutex_unlock(&x.lock);
+	
+	return c;
+}
+
+static void _finish_file(struct xfile *f)
+{
+	uint64_t size = INODE_FILE_SIZE(&f->inode);
+	struct timespec times[2];
+	int err = f->damaged;
+	
+	if ((f->fd < 0) && ((f->fd = open(f->tmppath, O_WRONLY)) < 0))
+	{
+		perror(f->tmppath);
+		err = 1;
+	}
+	
+	/* Holes at the end never got written, so this is what makes them. */
+	if (ftruncate(f->fd, size) < 0)
+	{
+		perror(f->tmppath);
+		err = 1;
+	}
+	fchmod(f->fd, f->inode.i_mode & 07777);
+	times[0].tv_sec = f->inode.i_atime;
+	times[0].tv_nsec = 0;
+	times[1].tv_sec = f->inode.i_mtime;
+	times[1].tv_nsec = 0;
+	futimens(f->fd, times);
+	if (close(f->fd) < 0)
+	{
+		perror(f->tmppath);
+		err = 1;
+	}
+	if (rename(f->tmppath, f->path) < 0)
+	{
+		perror(f->path);
+		err = 1;
+	}
+	
+	if (x.verbose)
+		printf("%s%s\n", f->path, f->damaged ? " (damaged)" : "");
+	
+	pthread_mutex_lock(&x.lock);
+	x.nfiles++;
+	x.nbytes += size;
+	x.nerrors += err;
+	pthread_mutex_unlock(&x.lock);
+	
+	free(f->path);
+	free(f->tmppath);
+	free(f);
+}
+
+static void _put_file(struct xfile *f)
+{
+	int last;
+	
+	pthread_mutex_lock(&x.lock);
+	last = (--f->pending == 0);
+	pthread_mutex_unlock(&x.lock);
+	
+	if (last)
+		_finish_file(f);
+}
+
+static void _write_chunk(struct xchunk *c)
+{
+	struct xfile *f = c->f;
+	int fd = f->fd;
+	int done = 0;
+	
+	if ((fd < 0) && ((fd = open(f->tmppath, O_WRONLY)) < 0))
+	{
+		perror(f->tmppath);
+		f->damaged = 1;
+		done = c->len;
+	}
+	while (done < c->len)
+	{
+		ssize_t rv = pwrite(fd, c->buf + done, c->len - done, c->offset + done);
+		
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror(f->tmppath);
+			f->damaged = 1;
+			break;
+		}
+		done += rv;
+	}
+	if ((f->fd < 0) && (fd >= 0))
+		close(fd);
+	
+	pthread_mutex_lock(&x.lock);
+	c->next = x.freebufs;
+	x.freebufs = c;
+	pthread_cond_signal(&x.bufs);
+	pthread_mutex_unlock(&x.lock);
+	
+	_put_file(f);
+}
+
+static void _queue_chunk(struct xchunk *c)
+{
+	pthread_mutex_lock(&x.lock);
+	c->f->pending++;
+	if (x.nwriters == 0)
+	{
+		pthread_mutex_unlock(&x.lock);
+		_write_chunk(c);
+		return;
+	}
+	c->next = NULL;
+	if (x.wtail)
+		x.wtail->next = c;
+	else
+		x.whead = c;
+	x.wtail = c;
+	pthread_cond_signal(&x.wwork);
+	pthread_mutex_unlock(&x.lock);
+}
+
+/* A ranged read failed somewhere; go back over it a block at a time, so
+ * that we lose only the blocks that are actually bad. */
+static void _read_slow(struct xfile *f, block_t disk, block_t lblk, int n, uint8_t *buf)
+{
+	int bs = SB_BLOCK_SIZE(&x.e3t->sb);
+	int i;
+	
+	for (i = 0; i < n; i++)
+	{
+		if (disk_read_block(x.e3t, disk + i, buf + i * bs) >= 0)
+			continue;
+		printf("WARNING: %s: couldn't read block %lld (block %lld of the file); leaving it zeroed\n",
+			f->path, (long long int)(disk + i), (long long int)(lblk + i));
+		memset(buf + i * bs, 0, bs);
+		f->damaged = 1;
+	}
+}
+
+/* Reads n blocks of f, starting at logical block lblk, which are at disk
+ * block disk, and passes them on to be written. */
+static void _read_piece(struct xfile *f, block_t disk, block_t lblk, int n)
+{
+	struct xchunk *c = _get_chunk();
+	int bs = SB_BLOCK_SIZE(&x.e3t->sb);
+	uint64_t size = INODE_FILE_SIZE(&f->inode);
+	
+	if (disk_read_blocks(x.e3t, disk, n, c->buf) < 0)
+		_read_slow(f, disk, lblk, n, c->buf);
+	c->f = f;
+	c->offset = U64(lblk) * bs;
+	c->len = n * bs;
+	if (c->offset + c->len > size)
+		c->len = size - c->offset;
+	_queue_chunk(c);
+}
+
+static void _plan_piece(struct xfile *f, block_t disk, block_t lblk, int n)
+{
+	struct xpiece *p;
+	
+	pthread_mutex_lock(&x.lock);
+	if (x.npieces == x.piecealloc)
+	{
+		x.piecealloc = x.piecealloc ? (x.piecealloc * 2) : 1024;
+		x.pieces = realloc(x.pieces, x.piecealloc * sizeof(*x.pieces));
+		if (!x.pieces)
+		{
+			perror("_plan_piece: realloc");
+			exit(1);
+		}
+	}
+	p = &x.pieces[x.npieces++];
+	p->f = f;
+	p->disk = disk;
+	p->lblk = lblk;
+	p->n = n;
+	f->pending++;
+	pthread_mutex_unlock(&x.lock);
+}
+
+static void _extract_file(struct xjob *j)
+{
+	struct xfile *f;
+	struct stat st;
+	int bs = SB_BLOCK_SIZE(&x.e3t->sb);
+	uint64_t size = INODE_FILE_SIZE(&j->inode);
+	block_t nblocks = (size + bs - 1) / bs;
+	block_t lblk = 0;
+	
+	if ((stat(j->path, &st) == 0) && S_ISREG(st.st_mode) &&
+	    (U64(st.st_size) == size) && (st.st_mtime == (time_t)j->inode.i_mtime))
+	{
+		_count(&x.nskipped);
+		free(j->path);
+		return;
+	}
+	
+	f = calloc(1, sizeof(*f));
+	if (!f)
+	{
+		perror("_extract_file: calloc");
+		exit(1);
+	}
+	f->path = j->path;
+	f->tmppath = malloc(strlen(j->path) + sizeof(PART_SUFFIX));
+	if (!f->tmppath)
+	{
+		perror("_extract_file: malloc");
+		exit(1);
+	}
+	strcpy(f->tmppath, j->path);
+	strcat(f->tmppath, PART_SUFFIX);
+	f->inode = j->inode;
+	f->pending = 1;
+	f->fd = open(f->tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (f->fd < 0)
+	{
+		perror(f->tmppath);
+		_count(&x.nerrors);
+		free(f->tmppath);
+		free(f->path);
+		free(f);
+		return;
+	}
+	
+	while (lblk < nblocks)
+	{
+		block_t run;
+		block_t disk = inode_map_block(x.e3t, &f->inode, lblk, &run);
+		
+		if (disk == IBLOCK_ERROR)
+		{
+			printf("WARNING: %s: couldn't map block %lld of the file; the rest of it is lost -- inode on fire?\n",
+				f->path, (long long int)lblk);
+			f->damaged = 1;
+			break;
+		}
+		if ((run == 0) || (run > nblocks - lblk))
+			run = nblocks - lblk;
+		if (disk == 0)	/* A hole, which stays a hole on the host. */
+		{
+			lblk += run;
+			continue;
+		}
+		
+		while (run)
+		{
+			int n = (run > U64(x.chunk / bs)) ? (x.chunk / bs) : (int)run;
+			
+			if (x.ordered)
+				_plan_piece(f, disk, lblk, n);
+			else
+				_read_piece(f, disk, lblk, n);
+			
+			disk += n;
+			lblk += n;
+			run -= n;
+		}
+	}
+	
+	/* We might have tens of thousands of these waiting on the plan. */
+	if (x.ordered)
+	{
+		close(f->fd);
+		f->fd = -1;
+	}
+	_put_file(f);
+}
+
+static void _extract_symlink(struct xjob *j)
+{
+	uint64_t size = INODE_FILE_SIZE(&j->inode);
+	char target[4096];
+	struct stat st;
+	
+	if (lstat(j->path, &st) == 0)
+	{
+		_count(&x.nskipped);
+		return;
+	}
+	
+	if (size >= sizeof(target))
+	{
+		printf("WARNING: %s: symlink target is %lld bytes long -- inode on fire?\n", j->path, (long long int)size);
+		_count(&x.nerrors);
+		return;
+	}
+	
+	/* Short targets live in the inode itself, where the block map
+	 * would be. */
+	if (inode_is_fast_symlink(x.e3t, &j->inode))
+	{
+		memcpy(target, j->inode.i_block, size);
+	} else {
+		struct ifile *ifp = ifile_open(x.e3t, j->ino);
+		int rv = ifp ? ifile_read(ifp, target, size) : -1;
+		
+		if (ifp)
+			ifile_close(ifp);
+		if (rv != (int)size)
+		{
+			printf("WARNING: %s: couldn't read symlink target -- inode on fire?\n", j->path);
+			_count(&x.nerrors);
+			return;
+		}
+	}
+	target[size] = '\0';
+	
+	if (symlink(target, j->path) < 0)
+	{
+		perror(j->path);
+		_count(&x.nerrors);
+		return;
+	}
+	if (x.verbose)
+		printf("%s -> %s\n", j->path, target);
+	_count(&x.nlinks);
+}
+
+static int _test_and_set_visited(int ino)
+{
+	int was;
+	
+	pthread_mutex_lock(&x.lock);
+	was = x.visited[ino / 8] & (1 << (ino % 8));
+	x.visited[ino / 8] |= 1 << (ino % 8);
+	pthread_mutex_unlock(&x.lock);
+	return was;
+}
+
+/* A directory's entries get their inodes looked up this many at a time,
+ * so that a big directory's inodes come off the disk in table order with
+ * a few big reads, rather than one read apiece. */
+#define DIR_BATCH 256
+
+struct dirbatch {
+	int inos[DIR_BATCH];
+	int rvs[DIR_BATCH];
+	struct ext2_inode inodes[DIR_BATCH];
+	uint8_t lens[DIR_BATCH];
+	char names[DIR_BATCH][255];
+	int n;
+};
+
+static void _extract_batch(struct xjob *j, struct dirbatch *b)
+{
+	int i;
+	
+	inode_find_many(x.e3t, b->inos, b->n, b->inodes, b->rvs);
+	for (i = 0; i < b->n; i++)
+	{
+		if (b->rvs[i] < 0)
+		{
+			printf("WARNING: %s: entry %.*s: couldn't read inode %d\n", j->path, b->lens[i], b->names[i], b->inos[i]);
+			_count(&x.nerrors);
+			continue;
+		}
+		if (((b->inodes[i].i_mode & 0xF000) == 0x4000) && _test_and_set_visited(b->inos[i]))
+		{
+			printf("WARNING: %s: directory inode %d was already extracted (loop?) -- not descending\n", j->path, b->inos[i]);
+			continue;
+		}
+		
+		_push_job(b->inos[i], _join(j->path, b->names[i], b->lens[i]), &b->inodes[i]);
+	}
+	b->n = 0;
+}
+
+static void _extract_dir(struct xjob *j)
+{
+	struct dir *dp;
+	struct dirent_view de;
+	struct dirbatch *b;
+	int rv;
+	
+	if ((mkdir(j->path, 0755) < 0) && (errno != EEXIST))
+	{
+		perror(j->path);
+		_count(&x.nerrors);
+		return;
+	}
+	if (x.verbose)
+		printf("%s/\n", j->path);
+	_count(&x.ndirs);
+	
+	b = malloc(sizeof(*b));
+	dp = dir_open(x.e3t, j->ino);
+	if (!b || !dp)
+	{
+		printf("WARNING: %s: directory inode %d open failure -- inode on fire?\n", j->path, j->ino);
+		_count(&x.nerrors);
+		if (dp)
+			dir_close(dp);
+		free(b);
+		return;
+	}
+	b->n = 0;
+	
+	while ((rv = dir_next(dp, &de)) > 0)
+	{
+		if (!de.inode || !de.name_len || DIRENT_IS_DOT(&de) || DIRENT_IS_DOTDOT(&de))
+			continue;
+		if (de.inode > (uint32_t)x.ninodes)
+		{
+			printf("WARNING: %s: entry %.*s points at inode %d, which is out of range\n", j->path, de.name_len, de.name, de.inode);
+			_count(&x.nerrors);
+			continue;
+		}
+		b->inos[b->n] = de.inode;
+		b->lens[b->n] = de.name_len;
+		memcpy(b->names[b->n], de.name, de.name_len);
+		if (++b->n == DIR_BATCH)
+			_extract_batch(j, b);
+	}
+	if (b->n)
+		_extract_batch(j, b);
+	free(b);
+	if (rv < 0)
+	{
+		printf("WARNING: %s: directory inode %d read failure -- inode on fire?\n", j->path, j->ino);
+		_count(&x.nerrors);
+	}
+	dir_close(dp);
+}
+
+static void _do_job(struct xjob *j)
+{
+	switch (j->inode.i_mode & 0xF000)
+	{
+	case 0x4000:
+		_extract_dir(j);
+		free(j->path);
+		break;
+	case 0x8000:
+		_extract_file(j);	/* which takes over j->path */
+		break;
+	case 0xA000:
+		_extract_symlink(j);
+		free(j->path);
+		break;
+	default:
+		printf("%s: skipping inode %d, which is neither file, directory nor symlink (mode %06o)\n", j->path, j->ino, j->inode.i_mode);
+		free(j->path);
+		break;
+	}
+	free(j);
+}
+
+static void *_reader(void *arg)
+{
+	struct xjob *j;
+	
+	(void) arg;
+	pthread_mutex_lock(&x.lock);
+	for (;;)
+	{
+		while (!x.jobs && x.busy)
+			pthread_cond_wait(&x.work, &x.lock);
+		if (!x.jobs)
+			break;	/* Nothing to do, and nobody left to make more. */
+		
+		j = x.jobs;
+		x.jobs = j->next;
+		x.busy++;
+		pthread_mutex_unlock(&x.lock);
+		
+		_do_job(j);
+		
+		pthread_mutex_lock(&x.lock);
+		if (--x.busy == 0)
+			pthread_cond_broadcast(&x.work);
+	}
+	pthread_mutex_unlock(&x.lock);
+	
+	return NULL;
+}
+
+/* The second half of -o: work through the plan, in disk order. */
+static void *_piece_reader(void *arg)
+{
+	struct xpiece *p;
+	
+	(void) arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&x.lock);
+		p = (x.nextpiece < x.npieces) ? &x.pieces[x.nextpiece++] : NULL;
+		pthread_mutex_unlock(&x.lock);
+		if (!p)
+			break;
+		
+		_read_piece(p->f, p->disk, p->lblk, p->n);
+		_put_file(p->f);	/* the plan's hold on it */
+	}
+	
+	return NULL;
+}
+
+static int _piece_cmp(const void *a, const void *b)
+{
+	const struct xpiece *pa = a, *pb = b;
+	
+	if (pa->disk != pb->disk)
+		return (pa->disk < pb->disk) ? -1 : 1;
+	return 0;
+}
+
+static void *_writer(void *arg)
+{
+	struct xchunk *c;
+	
+	(void) arg;
+	pthread_mutex_lock(&x.lock);
+	for (;;)
+	{
+		while (!x.whead && !x.readers_done)
+			pthread_cond_wait(&x.wwork, &x.lock);
+		if (!x.whead)
+			break;
+		
+		c = x.whead;
+		x.whead = c->next;
+		if (!x.whead)
+			x.wtail = NULL;
+		pthread_mutex_unlock(&x.lock);
+		
+		_write_chunk(c);
+		
+		pthread_mutex_lock(&x.lock);
+	}
+	pthread_mutex_unlock(&x.lock);
+	
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	int opt;
+	int nreaders = 4;
+	int nwriters = 2;
+	int ino, i, src;
+	int nsrcs, njobs = 0;
+	char *dest, *path;
+	struct ext2_inode inode;
+	pthread_t *threads;
+	int nthreads = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "j:w:ov")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			nreaders = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			nwriters = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			x.ordered = 1;
+			break;
+		case 'v':
+			x.verbose = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((argc - optind) < 2)
+	{
+		printf("Usage: %s [-j readers] [-w writers] [-o] [-v] inode-or-path... destdir\n", argv[0]);
+		printf("-j sets how many threads read metadata and file data (default 4)\n");
+		printf("-w sets how many threads write to the host (default 2; 0 makes the readers do it)\n");
+		printf("-o reads everything in the order that it is on the disk, instead of file by file\n");
+		printf("-v prints every file as it is finished\n");
+		printf("With one directory to extract, destdir becomes a copy of it; anything else\n");
+		printf("goes inside destdir, under its own name, or its inode number if it was given\n");
+		printf("as one.  Files already in destdir with the right size and time are skipped, so an\n");
+		printf("interrupted extraction can be picked up by running it again.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	if (nreaders < 1)
+		nreaders = 1;
+	if (nwriters < 0)
+		nwriters = 0;
+	
+	nsrcs = argc - optind - 1;
+	dest = argv[argc - 1];
+	
+	x.e3t = &e3t;
+	pthread_mutex_init(&x.lock, NULL);
+	pthread_cond_init(&x.work, NULL);
+	pthread_cond_init(&x.wwork, NULL);
+	pthread_cond_init(&x.bufs, NULL);
+	x.nwriters = nwriters;
+	x.chunk = CHUNK_BYTES - CHUNK_BYTES % SB_BLOCK_SIZE(&e3t.sb);
+	if (x.chunk == 0)
+		x.chunk = SB_BLOCK_SIZE(&e3t.sb);
+	x.ninodes = e3t.sb.s_inodes_count;
+	x.visited = calloc(x.ninodes / 8 + 1, 1);
+	if (!x.visited)
+	{
+		perror("calloc(visited)");
+		return 1;
+	}
+	
+	/* Enough buffers that every reader can have one on the go while the
+	 * writers have a couple each queued up behind them. */
+	for (i = 0; i < nreaders + 2 * nwriters + 1; i++)
+	{
+		struct xchunk *c = malloc(sizeof(*c));
+		
+		if (!c || (posix_memalign((void **)&c->buf, BUFPOOL_ALIGN, x.chunk) != 0))
+		{
+			perror("malloc(chunk)");
+			return 1;
+		}
+		c->next = x.freebufs;
+		x.freebufs = c;
+	}
+	
+	/* A directory on its own comes out as destdir itself; anything else
+	 * goes inside it, under its own name if we were given a path, or its
+	 * inode number if not. */
+	for (src = optind; src < argc - 1; src++)
+	{
+		ino = namei_arg(&e3t, argv[src]);
+		if (ino <= 0)
+			continue;
+		if (inode_find(&e3t, ino, &inode) < 0)
+		{
+			printf("Couldn't read inode %d\n", ino);
+			continue;
+		}
+		
+		if (((inode.i_mode & 0xF000) == 0x4000) && (nsrcs == 1))
+		{
+			path = strdup(dest);
+		} else {
+			const char *name = strrchr(argv[src], '/');
+			char num[16];
+			
+			if (!name || !name[1])
+			{
+				snprintf(num, sizeof(num), "%d", ino);
+				name = num;
+			} else {
+				name++;
+			}
+			if ((mkdir(dest, 0755) < 0) && (errno != EEXIST))
+			{
+				perror(dest);
+				return 1;
+			}
+			path = _join(dest, name, strlen(name));
+		}
+		if (((inode.i_mode & 0xF000) == 0x4000) && (ino > 0) && (ino <= x.ninodes))
+			_test_and_set_visited(ino);
+		_push_job(ino, path, &inode);
+		njobs++;
+	}
+	if (njobs == 0)
+		return 1;
+	
+	threads = malloc((nreaders + nwriters) * sizeof(pthread_t));
+	if (!threads)
+	{
+		perror("malloc(threads)");
+		return 1;
+	}
+	for (i = 0; i < nwriters; i++)
+		if (pthread_create(&threads[nthreads], NULL, _writer, NULL) == 0)
+			nthreads++;
+	x.nwriters = nthreads;	/* ... which might be fewer than we asked for */
+	for (i = 0; i < nreaders; i++)
+		if (pthread_create(&threads[nthreads], NULL, _reader, NULL) == 0)
+			nthreads++;
+	if (nthreads == x.nwriters)
+		_reader(NULL);	/* Couldn't start any; do it ourselves. */
+	
+	for (i = x.nwriters; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	
+	if (x.ordered)
+	{
+		qsort(x.pieces, x.npieces, sizeof(*x.pieces), _piece_cmp);
+		if (x.verbose)
+			printf("Planned %lld reads; starting in on them\n", (long long int)x.npieces);
+		
+		nthreads = x.nwriters;
+		for (i = 0; i < nreaders; i++)
+			if (pthread_create(&threads[nthreads], NULL, _piece_reader, NULL) == 0)
+				nthreads++;
+		if (nthreads == x.nwriters)
+			_piece_reader(NULL);
+		for (i = x.nwriters; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_lock(&x.lock);
+	x.readers_done = 1;
+	pthread_cond_broadcast(&x.wwork);
+	pthread_mutex_unlock(&x.lock);
+	for (i = 0; i < x.nwriters; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	
+	printf("Extracted %d files (%lld bytes), %d directories and %d symlinks; skipped %d already there; %d errors\n",
+		x.nfiles, (long long int)x.nbytes, x.ndirs, x.nlinks, x.nskipped, x.nerrors);
+	
+	while (x.freebufs)
+	{
+		struct xchunk *c = x.freebufs;
+		
+		x.freebufs = c->next;
+		free(c->buf);
+		free(c);
+	}
+	free(x.pieces);
+	free(x.visited);
+	e3tools_close(&e3t);
+	
+	return x.nerrors ? 2 : 0;
+}
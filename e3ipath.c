@@ -0,0 +1,86 @@
+// e3ipath
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include "e3tools.h"
+#include "ipath.h"
+
+/* Names inodes: for every inode number on the command line (or on
+ * standard input, one per line, so that e3lsdel -q and friends can be
+ * piped in), prints a path to it.  The first run reads every directory;
+ * with --index or --cowfile, later runs get the answers from the index
+ * file instead. */
+
+static void _show(e3tools_t *e3t, uint32_t ino)
+{
+	char path[4096];
+	int rv = ipath_path(e3t, ino, path, sizeof(path));
+	
+	if (rv < 0)
+		printf("%u\t(no path)\n", ino);
+	else
+		printf("%u\t%s\n", ino, path);
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	char line[64];
+	int opt, i;
+	int nthreads = 4;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((optind > argc) || !e3t.geom)
+	{
+		printf("Usage: %s [-j threads] [inode...]\n", argv[0]);
+		printf("-j sets how many threads read directories (default 4)\n");
+		printf("Prints a path for each inode, or for each inode number read from standard\n");
+		printf("input if none are given.  A path that starts with <inode> got as far back\n");
+		printf("as that directory, which no directory we could read has in it.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	if (ipath_build(&e3t, nthreads) < 0)
+	{
+		printf("Couldn't build the path index\n");
+		exit(1);
+	}
+	
+	if (optind < argc)
+	{
+		for (i = optind; i < argc; i++)
+			_show(&e3t, strtoul(argv[i], NULL, 0));
+	} else {
+		while (fgets(line, sizeof(line), stdin))
+			if ((*line >= '0') && (*line <= '9'))
+				_show(&e3t, strtoul(line, NULL, 0));
+	}
+	
+	e3tools_close(&e3t);
+	
+	return 0;
+}
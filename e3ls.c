@@ -9,103 +9,434 @@
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
-#include <alloca.h>
+#include <pthread.h>
 
 #include "e3tools.h"
 #include "diskio.h"
 #include "inode.h"
+#include "dir.h"
+#include "namei.h"
+#include "index.h"
 
-#define EXT3_LL_MAX_NAME 256
-typedef struct ext3_lldir {		/* XXX */
-	uint32_t inode;
-	uint16_t rec_len;
-	unsigned char name_len;
-	char file_type;
-	char name[EXT3_LL_MAX_NAME];
-} ext3_lldir_t;
+/* One directory's worth of listing.  Workers (or the main thread, if
+ * there are none) slurp the whole thing in; the main thread prints it once
+ * the depth-first walk gets to it, so output comes out in the same order no
+ * matter how many workers there are. */
+struct lsdir {
+	int ino;
+	int state;
+	int openfail;
+	int readfail;
+	uint8_t *data;		/* every block of the directory, back to back */
+	int *blklens;		/* how much of each block ifile_read gave us */
+	int nblocks;
+	struct lsdir *qnext;
+};
 
-static void _print_entry(e3tools_t *e3t, ext3_lldir_t *lld)
+#define LSDIR_QUEUED  0
+#define LSDIR_RUNNING 1
+#define LSDIR_DONE    2
+
+/* Where the walk has got to in a directory that it is partway through
+ * printing.  The stack of these replaces what used to be recursion. */
+struct lsframe {
+	struct lsdir *dir;
+	int depth;
+	int blk;		/* block being printed */
+	int started;		/* have we set up it for this block yet? */
+	struct dir_block_iter it;
+	int *kids;		/* subdirectories we will descend into, in order */
+	struct lsdir **kidjobs;	/* ... and their prefetches, if any */
+	int nkids;
+	int nextkid;		/* next kid that printing will descend into */
+	int nextpf;		/* next kid to prefetch */
+};
+
+static struct {
+	e3tools_t *e3t;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* something went onto the queue */
+	pthread_cond_t done;	/* something finished loading */
+	struct lsdir *qhead, *qtail;
+	int nworkers;
+	int window;		/* how many siblings to keep prefetched */
+	int quit;
+	uint8_t *visited;	/* one bit per inode */
+	int ninodes;
+} ls;
+
+static void _load_dir(e3tools_t *e3t, struct lsdir *d)
 {
-	char fname[EXT3_LL_MAX_NAME];
-	char *type;
-	
-	strncpy(fname, lld->name, lld->name_len);
-	fname[lld->name_len] = 0;
+	struct ifile *ifp;
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int alloc = 0;
+	int blklen;
 	
-	if (lld->file_type == 0)
+	ifp = ifile_open(e3t, d->ino);
+	if (!ifp)
 	{
-		printf("%d bytes padding\n", lld->rec_len);
+		d->openfail = 1;
 		return;
 	}
 	
-	if (lld->inode == 0)
-		printf("DELETED ");
+	for (;;)
+	{
+		if (d->nblocks == alloc)
+		{
+			alloc = alloc ? (alloc * 2) : 4;
+			d->data = realloc(d->data, alloc * bs);
+			d->blklens = realloc(d->blklens, alloc * sizeof(int));
+			if (!d->data || !d->blklens)
+			{
+				perror("_load_dir: realloc");
+				d->readfail = 1;
+				break;
+			}
+		}
+		blklen = ifile_read(ifp, (char *)d->data + d->nblocks * bs, bs);
+		if (blklen <= 0)
+		{
+			d->readfail = (blklen < 0);
+			break;
+		}
+		d->blklens[d->nblocks++] = blklen;
+	}
+	
+	ifile_close(ifp);
+}
+
+static void *_worker(void *arg)
+{
+	struct lsdir *d;
 	
-	switch (lld->file_type)
+	(void) arg;
+	pthread_mutex_lock(&ls.lock);
+	for (;;)
 	{
-	case 1: type = "FIL"; break;
-	case 2: type = "DIR"; break;
-	case 3: type = "CHR"; break;
-	case 4: type = "BLK"; break;
-	case 5: type = "FIF"; break;
-	case 6: type = "SCK"; break;
-	case 7: type = "SYM"; break;
-	default: type = "???"; break;
+		while (!ls.qhead && !ls.quit)
+			pthread_cond_wait(&ls.work, &ls.lock);
+		if (ls.quit)
+			break;
+		
+		d = ls.qhead;
+		ls.qhead = d->qnext;
+		if (!ls.qhead)
+			ls.qtail = NULL;
+		d->state = LSDIR_RUNNING;
+		pthread_mutex_unlock(&ls.lock);
+		
+		_load_dir(ls.e3t, d);
+		
+		pthread_mutex_lock(&ls.lock);
+		d->state = LSDIR_DONE;
+		pthread_cond_broadcast(&ls.done);
 	}
+	pthread_mutex_unlock(&ls.lock);
 	
-	printf("[%s@%d, %d] %s\n", type, lld->inode, lld->rec_len, fname);
+	return NULL;
 }
 
-static void _do_ls(e3tools_t *e3t, int ino, int recdepth)
+static struct lsdir *_submit(int ino)
 {
-	struct ifile *ifp;
-	ext3_lldir_t *lld;
-	int blkpos = 0;
-	int blklen;
-	void *block = alloca(SB_BLOCK_SIZE(&e3t->sb));
+	struct lsdir *d = calloc(1, sizeof(*d));
 	
-	ifp = ifile_open(e3t, ino);
-	if (!ifp)
+	if (!d)
 	{
-		printf("Directory inode %d open failure!\n", ino);
+		perror("_submit: calloc");
+		exit(1);
+	}
+	d->ino = ino;
+	d->state = LSDIR_QUEUED;
+	
+	if (ls.nworkers == 0)
+		return d;	/* _wait_dir will load it when it's wanted */
+	
+	pthread_mutex_lock(&ls.lock);
+	if (ls.qtail)
+		ls.qtail->qnext = d;
+	else
+		ls.qhead = d;
+	ls.qtail = d;
+	pthread_cond_signal(&ls.work);
+	pthread_mutex_unlock(&ls.lock);
+	
+	return d;
+}
+
+/* Takes d off the work queue, if no worker has picked it up yet.  Call
+ * with ls.lock held. */
+static int _dequeue(struct lsdir *d)
+{
+	struct lsdir **dp;
+	
+	if (d->state != LSDIR_QUEUED)
+		return 0;
+	
+	for (dp = &ls.qhead; *dp != d; dp = &(*dp)->qnext)
+		;
+	*dp = d->qnext;
+	if (ls.qtail == d)
+		for (ls.qtail = ls.qhead; ls.qtail && ls.qtail->qnext; ls.qtail = ls.qtail->qnext)
+			;
+	return 1;
+}
+
+/* Makes sure that d is loaded.  If no worker has got to it yet, we pull it
+ * off the queue and do it ourselves rather than sit and wait behind
+ * everything queued ahead of it. */
+static void _wait_dir(struct lsdir *d)
+{
+	if (ls.nworkers == 0)
+	{
+		if (d->state != LSDIR_DONE)
+			_load_dir(ls.e3t, d);
+		d->state = LSDIR_DONE;
 		return;
 	}
 	
-	while ((blklen = ifile_read(ifp, block, SB_BLOCK_SIZE(&e3t->sb))) > 0)
+	pthread_mutex_lock(&ls.lock);
+	if (_dequeue(d))
 	{
-		blkpos = 0;
-		if (blklen != SB_BLOCK_SIZE(&e3t->sb))
-			printf("WARNING: directory inode %d short read (%d bytes) -- inode on fire?\n", ino, blklen);
+		d->state = LSDIR_RUNNING;
+		pthread_mutex_unlock(&ls.lock);
+		
+		_load_dir(ls.e3t, d);
+		
+		pthread_mutex_lock(&ls.lock);
+		d->state = LSDIR_DONE;
+	}
+	while (d->state != LSDIR_DONE)
+		pthread_cond_wait(&ls.done, &ls.lock);
+	pthread_mutex_unlock(&ls.lock);
+}
+
+static void _free_dir(struct lsdir *d)
+{
+	if (ls.nworkers)
+	{
+		/* A worker might still be scribbling on it. */
+		pthread_mutex_lock(&ls.lock);
+		if (!_dequeue(d))
+			while (d->state != LSDIR_DONE)
+				pthread_cond_wait(&ls.done, &ls.lock);
+		pthread_mutex_unlock(&ls.lock);
+	}
+	free(d->data);
+	free(d->blklens);
+	free(d);
+}
 
-		while (blkpos < blklen)
+static int _should_descend(struct dirent_view *de)
+{
+	return (de->file_type == DIR_FT_DIR) && !DIRENT_IS_DOT(de) && !DIRENT_IS_DOTDOT(de) && de->inode;
+}
+
+/* Walks to the next record of the directory in f, printing any complaints
+ * about the directory's structure along the way, just as a single pass
+ * over it would.  Returns 0 when the directory is done with. */
+static int _next_entry(e3tools_t *e3t, struct lsframe *f, struct dirent_view *de, int quiet)
+{
+	struct lsdir *d = f->dir;
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int i;
+	
+	while (f->blk < d->nblocks)
+	{
+		int blklen = d->blklens[f->blk];
+		
+		if (!f->started)
+		{
+			f->started = 1;
+			dir_block_iter_init(&f->it, d->data + f->blk * bs, blklen);
+			if ((blklen != bs) && !quiet)
+				printf("WARNING: directory inode %d short read (%d bytes) -- inode on fire?\n", d->ino, blklen);
+		}
+		
+		if (dir_block_iter_next(&f->it, de))
+		{
+			if (!quiet)
+				for (i = 0; i < f->depth; i++)	/* Disambiguate directory levels. */
+					printf("  ");
+			return 1;
+		}
+		
+		if (!quiet)
 		{
-			int i;
-			
-			for (i = 0; i < recdepth; i++)	/* Disambiguate directory levels. */
-				printf("  ");
-			
-			lld = (ext3_lldir_t *)(block + blkpos);
-			blkpos += lld->rec_len;
-			
-			if (lld->rec_len == 0)
+			switch (f->it.status)
 			{
-				printf("WARNING: directory inode %d has a record where rec_len = 0 -- inode on fire?\n", ino);
-				goto bailout;
+			case DIR_BLOCK_ZERO_RECLEN:
+				for (i = 0; i < f->depth; i++)
+					printf("  ");
+				printf("WARNING: directory inode %d has a record where rec_len = 0 -- inode on fire?\n", d->ino);
+				break;
+			case DIR_BLOCK_OVERRUN:
+				printf("WARNING: directory inode %d padding overran a single block -- inode on fire?\n", d->ino);
+				break;
+			case DIR_BLOCK_BADREC:
+				printf("WARNING: directory inode %d has a mangled record at offset %d of block %d -- inode on fire?\n", d->ino, f->it.end, f->blk);
+				break;
 			}
-			
-			_print_entry(e3t, lld);
-			if ((lld->file_type == 2 /* directory */) && (recdepth >= 0) && strncmp(lld->name, ".", 2) && strncmp(lld->name, "..", 2) && lld->inode)
-				_do_ls(e3t, lld->inode, recdepth + 1);
 		}
-		
-		if (blkpos != blklen)
-			printf("WARNING: directory inode %d padding overran a single block -- inode on fire?\n", ino);
+		if (f->it.status == DIR_BLOCK_ZERO_RECLEN)
+		{
+			f->blk = d->nblocks + 1;	/* bail out, without a read failure warning */
+			return 0;
+		}
+		f->blk++;
+		f->started = 0;
 	}
-	if (blklen < 0)
-		printf("WARNING: directory inode %d read failure -- inode on fire?\n", ino);
+	
+	if ((f->blk == d->nblocks) && d->readfail && !quiet)
+		printf("WARNING: directory inode %d read failure -- inode on fire?\n", d->ino);
+	return 0;
+}
 
-bailout:
-	ifile_close(ifp);
+/* Sets up a frame for d, once it has loaded; if we're recursing, a quick
+ * silent pass over it finds the subdirectories that we'll want next. */
+static int _push(e3tools_t *e3t, struct lsframe *f, struct lsdir *d, int depth)
+{
+	struct lsframe scan;
+	struct dirent_view de;
+	int alloc = 0;
+	
+	_wait_dir(d);
+	if (d->openfail)
+	{
+		printf("Directory inode %d open failure!\n", d->ino);
+		_free_dir(d);
+		return -1;
+	}
+	
+	memset(f, 0, sizeof(*f));
+	f->dir = d;
+	f->depth = depth;
+	if (depth < 0)
+		return 0;
+	
+	scan = *f;
+	while (_next_entry(e3t, &scan, &de, 1))
+	{
+		if (!_should_descend(&de))
+			continue;
+		if (f->nkids == alloc)
+		{
+			alloc = alloc ? (alloc * 2) : 16;
+			f->kids = realloc(f->kids, alloc * sizeof(int));
+			f->kidjobs = realloc(f->kidjobs, alloc * sizeof(struct lsdir *));
+			if (!f->kids || !f->kidjobs)
+			{
+				perror("_push: realloc");
+				exit(1);
+			}
+		}
+		f->kids[f->nkids] = de.inode;
+		f->kidjobs[f->nkids] = NULL;
+		f->nkids++;
+	}
+	
+	return 0;
+}
+
+static void _pop(struct lsframe *f)
+{
+	/* Anything prefetched but never descended into (we bailed out
+	 * early) still has to be reaped. */
+	for (; f->nextkid < f->nextpf; f->nextkid++)
+		_free_dir(f->kidjobs[f->nextkid]);
+	_free_dir(f->dir);
+	free(f->kids);
+	free(f->kidjobs);
+}
+
+static int _test_and_set_visited(int ino)
+{
+	int was = ls.visited[ino / 8] & (1 << (ino % 8));
+	
+	ls.visited[ino / 8] |= 1 << (ino % 8);
+	return was;
+}
+
+static void _do_ls(e3tools_t *e3t, int ino, int recursive)
+{
+	struct lsframe *stack = NULL;
+	int sp = 0, stackalloc = 0;
+	struct dirent_view de;
+	
+	if (recursive)
+	{
+		memset(ls.visited, 0, ls.ninodes / 8 + 1);
+		if ((ino > 0) && (ino <= ls.ninodes))
+			_test_and_set_visited(ino);
+	}
+	
+	stackalloc = 16;
+	stack = malloc(stackalloc * sizeof(*stack));
+	if (!stack)
+	{
+		perror("_do_ls: malloc");
+		return;
+	}
+	if (_push(e3t, &stack[0], _submit(ino), recursive ? 0 : -1) < 0)
+	{
+		free(stack);
+		return;
+	}
+	sp = 1;
+	
+	while (sp > 0)
+	{
+		struct lsframe *f = &stack[sp - 1];
+		struct lsdir *kid;
+		int kidino;
+		
+		/* Keep the next few subdirectories in flight while we print. */
+		if (ls.nworkers)
+			for (; (f->nextpf < f->nkids) && (f->nextpf < f->nextkid + ls.window); f->nextpf++)
+				f->kidjobs[f->nextpf] = _submit(f->kids[f->nextpf]);
+		
+		if (!_next_entry(e3t, f, &de, 0))
+		{
+			_pop(f);
+			sp--;
+			continue;
+		}
+		
+		dir_entry_print(&de);
+		if (DIRENT_IS_DOTDOT(&de))
+			index_note_parent(e3t, f->dir->ino, de.inode);
+		if ((f->depth < 0) || !_should_descend(&de))
+			continue;
+		
+		kidino = f->kids[f->nextkid];
+		kid = (f->nextkid < f->nextpf) ? f->kidjobs[f->nextkid] : NULL;
+		f->nextkid++;
+		if ((kidino <= 0) || (kidino > ls.ninodes) || _test_and_set_visited(kidino))
+		{
+			printf("WARNING: directory inode %d %s -- not descending\n", kidino,
+				((kidino <= 0) || (kidino > ls.ninodes)) ? "is out of range" : "was already listed (loop?)");
+			if (kid)
+				_free_dir(kid);
+			continue;
+		}
+		if (!kid)
+			kid = _submit(kidino);
+		
+		if (sp == stackalloc)
+		{
+			stackalloc *= 2;
+			stack = realloc(stack, stackalloc * sizeof(*stack));
+			if (!stack)
+			{
+				perror("_do_ls: realloc");
+				exit(1);
+			}
+			f = &stack[sp - 1];
+		}
+		if (_push(e3t, &stack[sp], kid, f->depth + 1) == 0)
+			sp++;
+	}
+	
+	free(stack);
 }
 
 int main(int argc, char **argv)
@@ -115,6 +446,9 @@ int main(int argc, char **argv)
 	int arg;
 	int ls_inode;
 	int ls_recursive = 0;
+	int ls_jobs = 0;
+	pthread_t *workers = NULL;
+	int i;
 	
 	if (e3tools_init(&e3t, &argc, &argv) < 0)
 	{
@@ -122,29 +456,71 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	
-	while ((opt = getopt(argc, argv, "R")) != -1)
+	while ((opt = getopt(argc, argv, "Rj:")) != -1)
 	{
 		switch (opt)
 		{
 		case 'R':
 			ls_recursive = 1;
 			break;
+		case 'j':
+			ls_jobs = strtol(optarg, NULL, 0);
+			break;
 		default:
-			printf("Usage: %s [-R] inodes...\n", argv[0]);
+			printf("Usage: %s [-R] [-j jobs] inodes-or-paths...\n", argv[0]);
 			printf("-R enables recursive behavior\n");
+			printf("-j reads up to that many directories at once while recursing\n");
 			e3tools_usage();
 			exit(1);
 		}
 	}
 	
+	ls.e3t = &e3t;
+	pthread_mutex_init(&ls.lock, NULL);
+	pthread_cond_init(&ls.work, NULL);
+	pthread_cond_init(&ls.done, NULL);
+	ls.window = 2 * ls_jobs;
+	ls.ninodes = e3t.sb.s_inodes_count;
+	if (ls_recursive)
+	{
+		ls.visited = calloc(ls.ninodes / 8 + 1, 1);
+		if (!ls.visited)
+		{
+			perror("calloc(visited)");
+			return 1;
+		}
+	}
+	
+	if (ls_recursive && (ls_jobs > 1))
+	{
+		workers = malloc(ls_jobs * sizeof(pthread_t));
+		for (i = 0; workers && (i < ls_jobs); i++)
+		{
+			if (pthread_create(&workers[i], NULL, _worker, NULL) != 0)
+				break;
+			ls.nworkers++;
+		}
+	}
+	
 	for (arg = optind; arg < argc; arg++)
 	{
-		ls_inode = strtoll(argv[arg], NULL, 0);
+		ls_inode = namei_arg(&e3t, argv[arg]);
+		if (ls_inode < 0)
+			continue;
 		
 		printf("Directory listing for inode %d:\n", ls_inode);
-		_do_ls(&e3t, ls_inode, ls_recursive ? 0 : -1);
+		_do_ls(&e3t, ls_inode, ls_recursive);
 	}
 	
+	pthread_mutex_lock(&ls.lock);
+	ls.quit = 1;
+	pthread_cond_broadcast(&ls.work);
+	pthread_mutex_unlock(&ls.lock);
+	for (i = 0; i < ls.nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	free(ls.visited);
+	
 	e3tools_close(&e3t);
 	
 	return 0;
@@ -0,0 +1,315 @@
+// e3lsdel
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "inode.h"
+#include "bitmap.h"
+
+/* Finds deleted inodes: ones with a deletion time.  Every inode table gets
+ * read, by a pool of threads taking a group each, and what turns up can be
+ * sorted and cut down by when it was deleted, how big it was or what it
+ * was, and fed to e3extract by inode number.
+ *
+ * Assumptions:
+ *  - An inode on the orphan list has an inode number in i_dtime, not a
+ *    time; a deletion time is never earlier than the inode's ctime, since
+ *    deleting it is the last thing that changed it, so that tells the two
+ *    apart.
+ *  - A deleted inode whose block map is gone (ext3 and ext4 zero it) is
+ *    no use to e3extract, so we leave those out unless asked (-a). */
+
+struct deleted {
+	int ino;
+	uint32_t dtime;
+	uint16_t mode;
+	uint64_t size;
+	int intact;		/* the block map still points somewhere */
+};
+
+static struct {
+	e3tools_t *e3t;
+	int all;
+	time_t since, until;
+	pthread_mutex_t lock;
+	int nextgroup;
+	struct deleted *found;
+	int nfound, alloc;
+} ld;
+
+static const char *_type(uint16_t mode)
+{
+	switch (mode & 0xF000)
+	{
+	case 0x8000: return "file";
+	case 0x4000: return "dir";
+	case 0xA000: return "symlink";
+	case 0x2000: return "chardev";
+	case 0x6000: return "blockdev";
+	case 0x1000: return "fifo";
+	case 0xC000: return "socket";
+	default:     return "?";
+	}
+}
+
+/* Inodes come in a group at a time, so the shared list only gets locked
+ * once a group. */
+struct groupfinds {
+	struct deleted *found;
+	int nfound, alloc;
+};
+
+static void _check(void *arg, int ino, struct ext2_inode *inode)
+{
+	struct groupfinds *gf = arg;
+	struct deleted *d;
+	
+	if (!inode->i_dtime || (inode->i_dtime < inode->i_ctime) || (*_type(inode->i_mode) == '?'))
+		return;
+	if ((ld.since && (inode->i_dtime < ld.since)) || (ld.until && (inode->i_dtime > ld.until)))
+		return;
+	
+	if (gf->nfound == gf->alloc)
+	{
+		gf->alloc = gf->alloc ? gf->alloc * 2 : 64;
+		gf->found = realloc(gf->found, gf->alloc * sizeof(*gf->found));
+		if (!gf->found)
+		{
+			perror("e3lsdel: realloc");
+			exit(1);
+		}
+	}
+	d = &gf->found[gf->nfound];
+	d->ino = ino;
+	d->dtime = inode->i_dtime;
+	d->mode = inode->i_mode;
+	d->size = INODE_FILE_SIZE(inode);
+	d->intact = inode_map_plausible(ld.e3t, inode);
+	if (d->intact || ld.all)
+		gf->nfound++;
+}
+
+static void *_worker(void *arg)
+{
+	const uint8_t *gdt = block_group_desc_table(ld.e3t);
+	struct groupfinds gf;
+	struct e3_group_desc gd;
+	int bg;
+	
+	(void) arg;
+	memset(&gf, 0, sizeof(gf));
+	for (;;)
+	{
+		pthread_mutex_lock(&ld.lock);
+		bg = ld.nextgroup++;
+		pthread_mutex_unlock(&ld.lock);
+		if (bg >= ld.e3t->ngroups)
+			break;
+		
+		/* A group that has never had an inode in it has nothing
+		 * deleted in it either, and its table may be garbage. */
+		if (gdt)
+		{
+			block_group_desc_decode(ld.e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&ld.e3t->sb), &gd);
+			if (gd.flags & BG_INODE_UNINIT)
+				continue;
+		}
+		
+		gf.nfound = 0;
+		if (inode_table_scan(ld.e3t, bg, _check, &gf) < 0)
+			E3DEBUG(E3TOOLS_PFX "couldn't find group %d's inode table; skipping it\n", bg);
+		if (!gf.nfound)
+			continue;
+		
+		pthread_mutex_lock(&ld.lock);
+		if (ld.nfound + gf.nfound > ld.alloc)
+		{
+			ld.alloc = (ld.alloc + gf.nfound) * 2;
+			ld.found = realloc(ld.found, ld.alloc * sizeof(*ld.found));
+			if (!ld.found)
+			{
+				perror("e3lsdel: realloc");
+				exit(1);
+			}
+		}
+		memcpy(ld.found + ld.nfound, gf.found, gf.nfound * sizeof(*gf.found));
+		ld.nfound += gf.nfound;
+		pthread_mutex_unlock(&ld.lock);
+	}
+	free(gf.found);
+	
+	return NULL;
+}
+
+static int _by_ino(const void *a, const void *b)
+{
+	const struct deleted *da = a, *db = b;
+	
+	return da->ino - db->ino;
+}
+
+static int _by_dtime(const void *a, const void *b)
+{
+	const struct deleted *da = a, *db = b;
+	
+	return (da->dtime != db->dtime) ? ((da->dtime > db->dtime) - (da->dtime < db->dtime)) : _by_ino(a, b);
+}
+
+static int _by_size(const void *a, const void *b)
+{
+	const struct deleted *da = a, *db = b;
+	
+	return (da->size != db->size) ? ((da->size > db->size) - (da->size < db->size)) : _by_ino(a, b);
+}
+
+static int _by_type(const void *a, const void *b)
+{
+	const struct deleted *da = a, *db = b;
+	int rv = strcmp(_type(da->mode), _type(db->mode));
+	
+	return rv ? rv : _by_dtime(a, b);
+}
+
+/* A time on the command line: seconds since the epoch, so long ago ("36h",
+ * "2d"), or a local date and time ("2024-05-01" or "2024-05-01 13:30"). */
+static time_t _parse_time(const char *s)
+{
+	struct tm tm;
+	char *end;
+	long long n;
+	
+	n = strtoll(s, &end, 10);
+	if ((end != s) && !*end)
+		return n;
+	if ((end != s) && !end[1] && strchr("smhd", *end))
+		return time(NULL) - n * ((*end == 's') ? 1 : (*end == 'm') ? 60 : (*end == 'h') ? 3600 : 86400);
+	
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(s, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) >= 3)
+	{
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		return mktime(&tm);
+	}
+	printf("e3lsdel: can't make sense of the time '%s'\n", s);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	int (*cmp)(const void *, const void *) = _by_dtime;
+	pthread_t *threads;
+	int opt, i, started = 0;
+	int nthreads = 4;
+	int reverse = 0;
+	int quiet = 0;
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	while ((opt = getopt(argc, argv, "aj:s:rt:u:q")) != -1)
+	{
+		switch (opt)
+		{
+		case 'a':
+			ld.all = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			if (!strcmp(optarg, "dtime"))
+				cmp = _by_dtime;
+			else if (!strcmp(optarg, "size"))
+				cmp = _by_size;
+			else if (!strcmp(optarg, "type"))
+				cmp = _by_type;
+			else if (!strcmp(optarg, "ino"))
+				cmp = _by_ino;
+			else
+				optind = argc + 1;
+			break;
+		case 'r':
+			reverse = 1;
+			break;
+		case 't':
+			ld.since = _parse_time(optarg);
+			break;
+		case 'u':
+			ld.until = _parse_time(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ((optind != argc) || !e3t.geom)
+	{
+		printf("Usage: %s [-a] [-j threads] [-s dtime|size|type|ino] [-r] [-t since] [-u until] [-q]\n", argv[0]);
+		printf("-a also lists deleted inodes whose block maps are gone\n");
+		printf("-j sets how many threads read inode tables (default 4)\n");
+		printf("-s sorts by deletion time (the default), size, type, or inode number\n");
+		printf("-r reverses the order\n");
+		printf("-t and -u only list what was deleted since and until a time: seconds since\n");
+		printf("   the epoch, so long ago ('36h', '2d'), or 'YYYY-MM-DD [HH:MM[:SS]]'\n");
+		printf("-q prints just the inode numbers, to hand to e3extract\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	ld.e3t = &e3t;
+	pthread_mutex_init(&ld.lock, NULL);
+	threads = (nthreads > 1) ? malloc(nthreads * sizeof(pthread_t)) : NULL;
+	for (i = 0; threads && (i < nthreads); i++)
+	{
+		if (pthread_create(&threads[i], NULL, _worker, NULL) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		_worker(NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	
+	qsort(ld.found, ld.nfound, sizeof(*ld.found), cmp);
+	if (!quiet)
+		printf("# inode\tdeleted\t\t\ttype\tsize\tblock map\n");
+	for (i = 0; i < ld.nfound; i++)
+	{
+		struct deleted *d = &ld.found[reverse ? ld.nfound - 1 - i : i];
+		time_t t = d->dtime;
+		char when[32];
+		
+		if (quiet)
+		{
+			printf("%d\n", d->ino);
+			continue;
+		}
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%d\t%s\t%s\t%llu\t%s\n", d->ino, when, _type(d->mode), (unsigned long long)d->size, d->intact ? "intact" : "gone");
+	}
+	
+	free(ld.found);
+	e3tools_close(&e3t);
+	
+	return 0;
+}
@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <getopt.h>
 
 #include "e3tools.h"
 #include "superblock.h"
@@ -13,6 +14,8 @@
 int main(int argc, char **argv)
 {
 	e3tools_t e3t;
+	int opt;
+	int dryrun = 0;
 	
 	if (e3tools_init(&e3t, &argc, &argv) < 0)
 	{
@@ -20,14 +23,27 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	
-	if (argc > 1)
+	while ((opt = getopt(argc, argv, "d")) != -1)
 	{
-		printf("Usage: %s e3tools_options\n", argv[0]);
+		switch (opt)
+		{
+		case 'd':
+			dryrun = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc)
+	{
+		printf("Usage: %s e3tools_options [-d]\n", argv[0]);
+		printf("-d shows what would be repaired, without writing anything\n");
 		e3tools_usage();
 		exit(1);
 	}
 	
-	block_group_desc_table_repair(&e3t);
+	block_group_desc_table_repair(&e3t, dryrun);
 	
 	e3tools_close(&e3t);
 	
@@ -0,0 +1,442 @@
+// e3sh
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "diskio.h"
+#include "diskcow.h"
+#include "inode.h"
+#include "dir.h"
+#include "namei.h"
+#include "index.h"
+
+/* Every other tool opens the volume, imports the COW file, does one thing,
+ * and exports the COW file again; when poking around a damaged disk by hand,
+ * that startup is most of what you wait for.  e3sh opens the volume once and
+ * then takes commands, one per line, against it, so the dentry cache, the
+ * descriptor table and everything else that the library keeps around stay
+ * warm from one command to the next. */
+
+#define MAXARGS 32
+
+static struct {
+	e3tools_t *e3t;
+	int cwd;
+	int interactive;
+} sh;
+
+/* A number is an inode number; anything else is a path, relative to the
+ * current directory unless it starts with a slash.  (To get at a file
+ * whose name is all digits, say ./123.) */
+static int _resolve(const char *arg)
+{
+	const char *p;
+	int ino;
+	
+	for (p = arg; isdigit((unsigned char)*p); p++)
+		;
+	if ((p != arg) && !*p)
+	{
+		ino = strtol(arg, NULL, 10);
+		if ((ino < 1) || ((uint32_t)ino > sh.e3t->sb.s_inodes_count))
+		{
+			printf("%s: no such inode\n", arg);
+			return -1;
+		}
+		return ino;
+	}
+	
+	ino = namei_at(sh.e3t, sh.cwd, arg);
+	if (ino < 0)
+		printf("%s: no such path\n", arg);
+	return ino;
+}
+
+static int _is_dir(int ino)
+{
+	struct ext2_inode inode;
+	
+	if (inode_find(sh.e3t, ino, &inode) < 0)
+	{
+		printf("Error reading inode %d\n", ino);
+		return 0;
+	}
+	return (inode.i_mode & 0xF000) == 0x4000;
+}
+
+/* Things that were worked out from what the disk used to say have to be
+ * forgotten when what it says might have changed.  (A descriptor table
+ * that was voted on is kept; the library keeps it up to date.) */
+static void _forget(e3tools_t *e3t)
+{
+	block_group_desc_table_invalidate(e3t);
+	dcache_free(e3t);
+	index_invalidate(e3t);
+}
+
+static void _ls_one(int ino)
+{
+	struct dir *dp;
+	struct dirent_view de;
+	
+	dp = dir_open(sh.e3t, ino);
+	if (!dp)
+	{
+		printf("Directory inode %d open failure!\n", ino);
+		return;
+	}
+	while (dir_next(dp, &de) > 0)
+		dir_entry_print(&de);
+	dir_close(dp);
+}
+
+static int cmd_ls(int argc, char **argv)
+{
+	int i, ino;
+	
+	if (argc == 1)
+	{
+		_ls_one(sh.cwd);
+		return 0;
+	}
+	for (i = 1; i < argc; i++)
+	{
+		ino = _resolve(argv[i]);
+		if (ino < 0)
+			continue;
+		if (argc > 2)
+			printf("Directory listing for inode %d:\n", ino);
+		_ls_one(ino);
+	}
+	return 0;
+}
+
+static int cmd_cd(int argc, char **argv)
+{
+	int ino;
+	
+	if (argc > 2)
+		return -1;
+	ino = (argc == 1) ? ROOT_INO : _resolve(argv[1]);
+	if (ino < 0)
+		return 0;
+	if (!_is_dir(ino))
+	{
+		printf("%s: not a directory\n", argv[1]);
+		return 0;
+	}
+	sh.cwd = ino;
+	return 0;
+}
+
+static int cmd_pwd(int argc, char **argv)
+{
+	char path[4096];
+	
+	(void) argv;
+	if (argc != 1)
+		return -1;
+	if (namei_path(sh.e3t, sh.cwd, path, sizeof(path)) == 0)
+		printf("%s\n", path);
+	else
+		printf("(directory inode %d, which we can't find a path to)\n", sh.cwd);
+	return 0;
+}
+
+static int cmd_stat(int argc, char **argv)
+{
+	struct ext2_inode inode;
+	char path[4096];
+	int i, ino;
+	
+	if (argc < 2)
+		return -1;
+	for (i = 1; i < argc; i++)
+	{
+		ino = _resolve(argv[i]);
+		if (ino < 0)
+			continue;
+		if (inode_find(sh.e3t, ino, &inode) < 0)
+		{
+			printf("Error reading inode %d\n", ino);
+			continue;
+		}
+		inode_print(sh.e3t, &inode, ino);
+		if (((inode.i_mode & 0xF000) == 0x4000) && (namei_path(sh.e3t, ino, path, sizeof(path)) == 0))
+			printf("\t\tPath       : %s\n", path);
+	}
+	return 0;
+}
+
+static int cmd_cat(int argc, char **argv)
+{
+	struct ifile *ifp;
+	char buf[65536];
+	int i, ino, n;
+	
+	if (argc < 2)
+		return -1;
+	for (i = 1; i < argc; i++)
+	{
+		ino = _resolve(argv[i]);
+		if (ino < 0)
+			continue;
+		ifp = ifile_open(sh.e3t, ino);
+		if (!ifp)
+		{
+			printf("Error opening inode %d\n", ino);
+			continue;
+		}
+		while ((n = ifile_read(ifp, buf, sizeof(buf))) > 0)
+			fwrite(buf, 1, n, stdout);
+		if (n < 0)
+			printf("\nWARNING: inode %d read failure -- inode on fire?\n", ino);
+		ifile_close(ifp);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static void _hexdump(block_t b, const uint8_t *p, int bs)
+{
+	char line[E3TOOLS_HEXDUMP_LINE];
+	uint64_t addr = U64(b) * bs;
+	int ofs;
+	
+	for (ofs = 0; ofs < bs; ofs += 16)
+	{
+		e3tools_hexdump_line(line, addr + ofs, p + ofs);
+		fputs(line, stdout);
+	}
+}
+
+static int cmd_dumpblock(int argc, char **argv)
+{
+	int bs = SB_BLOCK_SIZE(&sh.e3t->sb);
+	uint8_t *buf;
+	block_t b, count, i;
+	int n;
+	
+	if ((argc < 2) || (argc > 3))
+		return -1;
+	b = strtoull(argv[1], NULL, 0);
+	count = (argc == 3) ? strtoull(argv[2], NULL, 0) : 1;
+	
+	buf = malloc(64 * bs);
+	if (!buf)
+	{
+		perror("dumpblock: malloc");
+		return 0;
+	}
+	for (; count; b += n, count -= n)
+	{
+		n = (count > 64) ? 64 : count;
+		if (disk_read_blocks(sh.e3t, b, n, buf) < 0)
+			for (i = 0; i < U64(n); i++)
+				if (disk_read_block(sh.e3t, b + i, buf + i * bs) < 0)
+				{
+					printf("WARNING: couldn't read block %lld; showing zeroes in its place\n", (long long int)(b + i));
+					memset(buf + i * bs, 0, bs);
+				}
+		for (i = 0; i < U64(n); i++)
+			_hexdump(b + i, buf + i * bs, bs);
+	}
+	free(buf);
+	return 0;
+}
+
+static int cmd_checkitables(int argc, char **argv)
+{
+	int ngroups = SB_GROUPS(&sh.e3t->sb);
+	int i, bg;
+	
+	if (argc == 1)
+	{
+		for (bg = 0; bg < ngroups; bg++)
+			inode_table_check(sh.e3t, bg);
+		return 0;
+	}
+	for (i = 1; i < argc; i++)
+	{
+		bg = strtol(argv[i], NULL, 0);
+		if ((bg < 0) || (bg >= ngroups))
+		{
+			printf("%s: no such block group\n", argv[i]);
+			continue;
+		}
+		inode_table_check(sh.e3t, bg);
+	}
+	return 0;
+}
+
+static int cmd_lame(int argc, char **argv)
+{
+	int i;
+	
+	if (argc < 2)
+		return -1;
+	for (i = 1; i < argc; i++)
+		if (disk_lame_sector(sh.e3t, strtoull(argv[i], NULL, 0)) < 0)
+			printf("WARNING: sector %s can't be worked around\n", argv[i]);
+	_forget(sh.e3t);
+	return 0;
+}
+
+static int cmd_repair(int argc, char **argv)
+{
+	int dryrun = (argc == 2) && !strcmp(argv[1], "-d");
+	
+	if (argc != 1 + dryrun)
+		return -1;
+	block_group_desc_table_repair(sh.e3t, dryrun);
+	if (!dryrun)
+		_forget(sh.e3t);
+	return 0;
+}
+
+/* Saves the COW data now, rather than waiting for the shell to exit. */
+static int cmd_sync(int argc, char **argv)
+{
+	(void) argv;
+	if (argc != 1)
+		return -1;
+	if (!sh.e3t->cowfile)
+		printf("No --cowfile to save to; changes will be lost on exit\n");
+	else
+		diskcow_export(sh.e3t, sh.e3t->cowfile);
+	return 0;
+}
+
+static int cmd_help(int argc, char **argv);
+
+static int cmd_quit(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+	return 1;
+}
+
+static const struct {
+	const char *name;
+	int (*fn)(int argc, char **argv);
+	const char *usage;
+} cmds[] = {
+	{ "ls", cmd_ls, "ls [dir...]" },
+	{ "cd", cmd_cd, "cd [dir]" },
+	{ "pwd", cmd_pwd, "pwd" },
+	{ "stat", cmd_stat, "stat file..." },
+	{ "cat", cmd_cat, "cat file..." },
+	{ "dumpblock", cmd_dumpblock, "dumpblock block [count]" },
+	{ "checkitables", cmd_checkitables, "checkitables [group...]" },
+	{ "lame", cmd_lame, "lame sector..." },
+	{ "repair", cmd_repair, "repair [-d]" },
+	{ "sync", cmd_sync, "sync" },
+	{ "help", cmd_help, "help" },
+	{ "quit", cmd_quit, "quit" },
+	{ "exit", cmd_quit, "exit" },
+};
+#define NCMDS (sizeof(cmds) / sizeof(cmds[0]))
+
+static int cmd_help(int argc, char **argv)
+{
+	unsigned int i;
+	
+	(void) argc;
+	(void) argv;
+	printf("Commands:\n");
+	for (i = 0; i < NCMDS; i++)
+		printf("  %s\n", cmds[i].usage);
+	printf("Files and directories are paths (relative to the current directory unless\n");
+	printf("they start with a slash) or inode numbers.\n");
+	return 0;
+}
+
+/* Runs one line; returns 1 if it was time to go. */
+static int _run(char *line)
+{
+	char *argv[MAXARGS];
+	int argc = 0;
+	char *p;
+	unsigned int i;
+	int rv;
+	
+	if (strchr(line, '#'))
+		*strchr(line, '#') = '\0';
+	for (p = strtok(line, " \t\r\n"); p; p = strtok(NULL, " \t\r\n"))
+	{
+		if (argc == MAXARGS - 1)
+		{
+			printf("Too many arguments\n");
+			return 0;
+		}
+		argv[argc++] = p;
+	}
+	argv[argc] = NULL;
+	if (argc == 0)
+		return 0;
+	
+	for (i = 0; i < NCMDS; i++)
+		if (!strcmp(argv[0], cmds[i].name))
+			break;
+	if (i == NCMDS)
+	{
+		printf("%s: unknown command; try help\n", argv[0]);
+		return 0;
+	}
+	
+	rv = cmds[i].fn(argc, argv);
+	if (rv < 0)
+		printf("Usage: %s\n", cmds[i].usage);
+	return rv > 0;
+}
+
+int main(int argc, char **argv)
+{
+	e3tools_t e3t;
+	char line[4096];
+	
+	if (e3tools_init(&e3t, &argc, &argv) < 0)
+	{
+		printf("e3tools initialization failed -- bailing out\n");
+		return 1;
+	}
+	
+	if (argc > 1)
+	{
+		printf("Usage: %s e3tools_options\n", argv[0]);
+		printf("Reads commands from standard input; type 'help' for a list.\n");
+		e3tools_usage();
+		exit(1);
+	}
+	
+	sh.e3t = &e3t;
+	sh.cwd = ROOT_INO;
+	sh.interactive = isatty(0);
+	
+	for (;;)
+	{
+		if (sh.interactive)
+		{
+			printf("e3sh> ");
+			fflush(stdout);
+		}
+		if (!fgets(line, sizeof(line), stdin))
+			break;
+		if (_run(line))
+			break;
+		fflush(stdout);
+	}
+	
+	e3tools_close(&e3t);
+	
+	return 0;
+}
@@ -9,13 +9,16 @@
 
 #include "e3tools.h"
 #include "superblock.h"
+#include "inode.h"
+#include "namei.h"
 
 int main(int argc, char **argv)
 {
 	e3tools_t e3t;
-	struct ext2_inode inode;
-	int inum;
-	int arg;
+	struct ext2_inode *inodes;
+	char path[4096];
+	int *inums, *rvs;
+	int arg, n;
 	
 	if (e3tools_init(&e3t, &argc, &argv) < 0)
 	{
@@ -25,22 +28,44 @@ int main(int argc, char **argv)
 	
 	if (argc < 2)
 	{
-		printf("Usage: %s e3tools_options inode_number\n", argv[0]);
+		printf("Usage: %s e3tools_options inode_number_or_path...\n", argv[0]);
 		e3tools_usage();
 		exit(1);
 	}
 	
+	/* Read them all in one go, in the order they are on disk, and then
+	 * print them in the order we were given them. */
+	n = argc - 1;
+	inums = malloc(n * sizeof(*inums));
+	rvs = malloc(n * sizeof(*rvs));
+	inodes = malloc(n * sizeof(*inodes));
+	if (!inums || !rvs || !inodes)
+	{
+		perror("malloc");
+		exit(1);
+	}
 	for (arg = 1; arg < argc; arg++)
 	{
-		inum = strtoll(argv[arg], NULL, 0);
-		
-		if (inode_find(&e3t, inum, &inode) < 0)
+		inums[arg - 1] = namei_arg(&e3t, argv[arg]);
+		if (inums[arg - 1] < 0)
+			exit(1);
+	}
+	inode_find_many(&e3t, inums, n, inodes, rvs);
+	
+	for (arg = 0; arg < n; arg++)
+	{
+		if (rvs[arg] < 0)
 		{
-			printf("Error reading inode %d\n", inum);
+			printf("Error reading inode %d\n", inums[arg]);
 			exit(1);
 		}
-		inode_print(&e3t, &inode, inum);
+		inode_print(&e3t, &inodes[arg], inums[arg]);
+		if (((inodes[arg].i_mode & 0xF000) == 0x4000) && (namei_path(&e3t, inums[arg], path, sizeof(path)) == 0))
+			printf("\t\tPath       : %s\n", path);
 	}
+	free(inums);
+	free(rvs);
+	free(inodes);
 	
 	e3tools_close(&e3t);
 	
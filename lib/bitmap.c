@@ -0,0 +1,353 @@
+// e3tools block bitmap utilities
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "e3bits.h"
+#include "blockgroup.h"
+#include "diskio.h"
+#include "bitmap.h"
+#include "bufpool.h"
+
+/* Where group bg's block or inode bitmap is, or 0 if the group says it was
+ * never initialized.  If the descriptor's idea of where the bitmap is isn't
+ * even in the right part of the disk, we go with where mke2fs would have
+ * put it. */
+static block_t _locate(e3tools_t *e3t, int bg, int which)
+{
+	const uint8_t *gdt = block_group_desc_table(e3t);
+	struct e3_group_desc gd;
+	block_t b, want;
+	
+	b = (which == BITMAP_BLOCKS) ? e3_block_group_expected_block_bitmap(e3t, bg) : e3_block_group_expected_inode_bitmap(e3t, bg);
+	if (!gdt)
+		return b;
+	
+	block_group_desc_decode(e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&e3t->sb), &gd);
+	if (gd.flags & ((which == BITMAP_BLOCKS) ? BG_BLOCK_UNINIT : BG_INODE_UNINIT))
+		return 0;
+	want = (which == BITMAP_BLOCKS) ? gd.block_bitmap : gd.inode_bitmap;
+	if (e3_block_is_plausible_for_group(e3t, want, bg))
+		return want;
+	E3DEBUG(E3TOOLS_PFX "group %d's %s bitmap is at %lld? that can't be right; trying %lld -- inode on fire?\n",
+		bg, (which == BITMAP_BLOCKS) ? "block" : "inode", (long long int)want, (long long int)b);
+	return b;
+}
+
+/* What the kernel makes of a block bitmap that was never written: the
+ * group's superblock and descriptor copies are in use, and so are its own
+ * bitmaps and inode table if they're in the group at all (with flex_bg
+ * they're usually off in the flex group's first group).  The rest is
+ * free. */
+static void _uninit_block_bitmap(e3tools_t *e3t, int bg, uint8_t *buf)
+{
+	struct e3_group_geom *g = &e3t->geom[bg];
+	const uint8_t *gdt = block_group_desc_table(e3t);
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	block_t itable_blocks = (U64(e3t->sb.s_inodes_per_group) * e3t->sb.s_inode_size + bs - 1) / bs;
+	block_t i, n;
+	struct e3_group_desc gd;
+	
+	memset(buf, 0, bs);
+	n = (g->has_sb ? 1 : 0) + g->gdt_blocks + g->rsv_gdt_blocks;
+	for (i = 0; (i < n) && (i < U64(bs) * 8); i++)
+		buf[i / 8] |= 1 << (i % 8);
+	
+	gd.block_bitmap = g->block_bitmap;
+	gd.inode_bitmap = g->inode_bitmap;
+	gd.inode_table = g->inode_table;
+	if (gdt)
+		block_group_desc_decode(e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&e3t->sb), &gd);
+	if (e3_block_is_in_block_group(&e3t->sb, gd.block_bitmap, bg))
+		buf[(gd.block_bitmap - g->start) / 8] |= 1 << ((gd.block_bitmap - g->start) % 8);
+	if (e3_block_is_in_block_group(&e3t->sb, gd.inode_bitmap, bg))
+		buf[(gd.inode_bitmap - g->start) / 8] |= 1 << ((gd.inode_bitmap - g->start) % 8);
+	for (i = 0; i < itable_blocks; i++)
+		if (e3_block_is_in_block_group(&e3t->sb, gd.inode_table + i, bg))
+			buf[(gd.inode_table + i - g->start) / 8] |= 1 << ((gd.inode_table + i - g->start) % 8);
+}
+
+/* Reads group bg's block bitmap into buf (one block).  Returns 0, or 1 if
+ * the group says its bitmap was never initialized (buf comes back with
+ * just the group's own metadata marked), or -1 if there's no bitmap to be
+ * had. */
+int bitmap_read_block_bitmap(e3tools_t *e3t, int bg, uint8_t *buf)
+{
+	block_t b;
+	
+	if (!e3t->geom || (bg < 0) || (bg >= e3t->ngroups))
+		return -1;
+	
+	b = _locate(e3t, bg, BITMAP_BLOCKS);
+	if (!b)
+	{
+		_uninit_block_bitmap(e3t, bg, buf);
+		return 1;
+	}
+	if (disk_read_block(e3t, b, buf) < 0)
+	{
+		perror("bitmap_read_block_bitmap: disk_read_block");
+		return -1;
+	}
+	return 0;
+}
+
+static int _add_range(struct scan_range **ranges, int *nranges, int *alloc, block_t start, block_t count)
+{
+	struct scan_range *r;
+	
+	/* Free space runs straight on from one group into the next more
+	 * often than not. */
+	if (*nranges && ((*ranges)[*nranges - 1].start + (*ranges)[*nranges - 1].count == start))
+	{
+		(*ranges)[*nranges - 1].count += count;
+		return 0;
+	}
+	if (*nranges == *alloc)
+	{
+		*alloc = *alloc ? *alloc * 2 : 256;
+		r = realloc(*ranges, *alloc * sizeof(*r));
+		if (!r)
+		{
+			perror("bitmap_free_ranges: realloc");
+			return -1;
+		}
+		*ranges = r;
+	}
+	(*ranges)[*nranges].start = start;
+	(*ranges)[*nranges].count = count;
+	(*nranges)++;
+	return 0;
+}
+
+/* Makes a list of every run of blocks that the bitmaps say is free, in
+ * order.  A group whose bitmap can't be read is taken to be all free: the
+ * callers want somewhere to look for lost data, and would rather look at
+ * too much than too little. */
+int bitmap_free_ranges(e3tools_t *e3t, struct scan_range **ranges, int *nranges)
+{
+	uint8_t *bits;
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int alloc = 0;
+	int bg;
+	block_t i, start;
+	
+	*ranges = NULL;
+	*nranges = 0;
+	if (!e3t->geom)
+		return -1;
+	
+	bits = malloc(bs);
+	if (!bits)
+	{
+		perror("bitmap_free_ranges: malloc");
+		return -1;
+	}
+	
+	for (bg = 0; bg < e3t->ngroups; bg++)
+	{
+		struct e3_group_geom *g = &e3t->geom[bg];
+		
+		if (bitmap_read_block_bitmap(e3t, bg, bits) < 0)
+		{
+			E3DEBUG(E3TOOLS_PFX "no block bitmap for group %d; taking all of it to be free\n", bg);
+			memset(bits, 0, bs);
+		}
+		
+		for (i = 0; i < g->nblocks; )
+		{
+			/* Step over the used blocks a word at a time where we can. */
+			if (!(i & 63) && (i + 64 <= g->nblocks) && (((uint64_t *)bits)[i / 64] == ~0ULL))
+			{
+				i += 64;
+				continue;
+			}
+			if (bits[i / 8] & (1 << (i % 8)))
+			{
+				i++;
+				continue;
+			}
+			for (start = i; (i < g->nblocks) && !(bits[i / 8] & (1 << (i % 8))); i++)
+				;
+			if (_add_range(ranges, nranges, &alloc, g->start + start, i - start) < 0)
+			{
+				free(bits);
+				return -1;
+			}
+		}
+	}
+	
+	free(bits);
+	return 0;
+}
+
+/* How much bitmap bitmap_load() reads at once.  With flex_bg a flex
+ * group's bitmaps are all in a row, so this is a handful of reads for the
+ * whole disk instead of one per group. */
+#define BITMAP_BATCH_BYTES (1024 * 1024)
+
+struct located {
+	block_t block;
+	int bg;
+};
+
+static int _located_cmp(const void *a, const void *b)
+{
+	const struct located *la = a, *lb = b;
+	
+	if (la->block != lb->block)
+		return (la->block > lb->block) - (la->block < lb->block);
+	return la->bg - lb->bg;
+}
+
+/* Reads n bitmaps that sit in consecutive blocks into their groups'
+ * places in the set, falling back to a block at a time if the whole run
+ * can't be read. */
+static void _load_run(e3tools_t *e3t, struct bitmap_set *set, const struct located *loc, int n, uint8_t *buf)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int i;
+	
+	if (disk_read_blocks(e3t, loc[0].block, n, buf) == 0)
+	{
+		for (i = 0; i < n; i++)
+			memcpy(set->bits + U64(loc[i].bg) * set->nwords, buf + i * bs, bs);
+		return;
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (disk_read_block(e3t, loc[i].block, (uint8_t *)(set->bits + U64(loc[i].bg) * set->nwords)) == 0)
+			continue;
+		E3DEBUG(E3TOOLS_PFX "couldn't read group %d's %s bitmap at %lld\n", loc[i].bg,
+			(set->which == BITMAP_BLOCKS) ? "block" : "inode", (long long int)loc[i].block);
+		set->status[loc[i].bg] = -1;
+	}
+}
+
+/* Reads every group's block or inode bitmap into set.  Each group's
+ * bitmap gets a whole block's worth of 64-bit words, starting on a cache
+ * line, so the counting can go a word at a time.  The reads go out in
+ * disk order, with bitmaps that are next to each other on disk read
+ * together.  Returns 0, or -1 if there's nowhere to put them; a group
+ * whose bitmap can't be read is marked so in set->status and is all
+ * clear. */
+int bitmap_load(e3tools_t *e3t, int which, struct bitmap_set *set)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int batch = BITMAP_BATCH_BYTES / bs;
+	struct located *loc;
+	uint8_t *buf;
+	int bg, i, j, nloc = 0;
+	
+	memset(set, 0, sizeof(*set));
+	if (!e3t->geom)
+		return -1;
+	set->which = which;
+	set->ngroups = e3t->ngroups;
+	set->nwords = bs / 8;
+	set->status = calloc(e3t->ngroups, sizeof(*set->status));
+	loc = malloc(e3t->ngroups * sizeof(*loc));
+	if (posix_memalign((void **)&buf, BUFPOOL_ALIGN, BITMAP_BATCH_BYTES) != 0)
+		buf = NULL;
+	if (!set->status || !loc || !buf ||
+	    posix_memalign((void **)&set->bits, BUFPOOL_ALIGN, U64(e3t->ngroups) * bs) != 0)
+	{
+		perror("bitmap_load: malloc");
+		free(loc);
+		free(buf);
+		bitmap_set_free(set);
+		return -1;
+	}
+	memset(set->bits, 0, U64(e3t->ngroups) * bs);
+	
+	for (bg = 0; bg < e3t->ngroups; bg++)
+	{
+		loc[nloc].block = _locate(e3t, bg, which);
+		loc[nloc].bg = bg;
+		if (loc[nloc].block)
+		{
+			nloc++;
+			continue;
+		}
+		set->status[bg] = 1;
+		if (which == BITMAP_BLOCKS)
+			_uninit_block_bitmap(e3t, bg, (uint8_t *)(set->bits + U64(bg) * set->nwords));
+	}
+	
+	qsort(loc, nloc, sizeof(*loc), _located_cmp);
+	for (i = 0; i < nloc; i = j)
+	{
+		for (j = i + 1; (j < nloc) && (j - i < batch) && (loc[j].block == loc[j - 1].block + 1); j++)
+			;
+		_load_run(e3t, set, loc + i, j - i, buf);
+	}
+	
+	free(loc);
+	free(buf);
+	return 0;
+}
+
+void bitmap_set_free(struct bitmap_set *set)
+{
+	free(set->bits);
+	free(set->status);
+	set->bits = NULL;
+	set->status = NULL;
+}
+
+static uint64_t _count_generic(const uint64_t *w, int n)
+{
+	uint64_t count = 0;
+	int i;
+	
+	for (i = 0; i < n; i++)
+		count += __builtin_popcountll(w[i]);
+	return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The same thing, built to use the POPCNT instruction; the build doesn't
+ * assume the CPU has it, so we ask before using this. */
+__attribute__((target("popcnt")))
+static uint64_t _count_popcnt(const uint64_t *w, int n)
+{
+	uint64_t count = 0;
+	int i;
+	
+	for (i = 0; i < n; i++)
+		count += __builtin_popcountll(w[i]);
+	return count;
+}
+#endif
+
+static uint64_t _count_set(const uint64_t *w, int n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("popcnt"))
+		return _count_popcnt(w, n);
+#endif
+	return _count_generic(w, n);
+}
+
+/* How many blocks or inodes group bg's bitmap has clear.  Only the bits
+ * for blocks and inodes the group actually has count; the rest of the
+ * block is padding (all set, on a healthy filesystem). */
+uint64_t bitmap_count_free(e3tools_t *e3t, const struct bitmap_set *set, int bg)
+{
+	const uint64_t *w = set->bits + U64(bg) * set->nwords;
+	uint64_t nbits = (set->which == BITMAP_BLOCKS) ? e3t->geom[bg].nblocks : e3t->sb.s_inodes_per_group;
+	uint64_t used;
+	
+	if (nbits > U64(set->nwords) * 64)
+		nbits = U64(set->nwords) * 64;
+	used = _count_set(w, nbits / 64);
+	if (nbits % 64)
+		used += __builtin_popcountll(w[nbits / 64] & ((1ULL << (nbits % 64)) - 1));
+	return nbits - used;
+}
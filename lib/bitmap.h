@@ -0,0 +1,35 @@
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "blockgroup.h"
+#include "scan.h"
+
+/* bg_flags */
+#define BG_INODE_UNINIT 0x0001
+#define BG_BLOCK_UNINIT 0x0002	/* the block bitmap was never written; nothing in the group is in use */
+
+/* Which bitmap bitmap_load() reads. */
+#define BITMAP_BLOCKS 0
+#define BITMAP_INODES 1
+
+/* Every group's block or inode bitmap, one after another, each in a whole
+ * block's worth of words; bit i of group bg's is bit i % 64 of
+ * bits[bg * nwords + i / 64]. */
+struct bitmap_set {
+	int which;
+	int ngroups;
+	int nwords;		/* 64-bit words per group */
+	uint64_t *bits;
+	int8_t *status;		/* per group: 0 read, 1 never initialized, -1 unreadable */
+};
+
+extern int bitmap_read_block_bitmap(e3tools_t *e3t, int bg, uint8_t *buf);
+extern int bitmap_free_ranges(e3tools_t *e3t, struct scan_range **ranges, int *nranges);
+extern int bitmap_load(e3tools_t *e3t, int which, struct bitmap_set *set);
+extern void bitmap_set_free(struct bitmap_set *set);
+extern uint64_t bitmap_count_free(e3tools_t *e3t, const struct bitmap_set *set, int bg);
+
+#endif
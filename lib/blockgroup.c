@@ -8,155 +8,500 @@
 #include <linux/ext2_fs.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "e3bits.h"
 #include "blockgroup.h"
 #include "diskio.h"
+#include "index.h"
+
+/* Builds e3t->geom from the superblock: every group's start, whether it
+ * carries a superblock backup, how big its descriptor table and reserved
+ * GDT area are, and where mke2fs would have put its bitmaps and inode
+ * table.  Everything that asks "where should this be?" about a group reads
+ * the answer out of here instead of working it out again. */
+int block_group_geometry_init(e3tools_t *e3t)
+{
+	struct ext2_super_block *sb = &e3t->sb;
+	uint64_t ngroups;
+	block_t blocks = SB_BLOCKS_COUNT(sb);
+	int blocksz = SB_BLOCK_SIZE(sb);
+	int descs_per_block;
+	block_t gdt_blocks, itable_blocks;
+	int flexsz = 1;
+	int bg;
+	
+	free(e3t->geom);
+	e3t->geom = NULL;
+	e3t->ngroups = 0;
+	
+	/* Don't go allocating billions of groups on the say-so of a
+	 * superblock that is obviously garbage. */
+	if ((sb->s_log_block_size > 6) || (sb->s_blocks_per_group < 256) ||
+	    (sb->s_blocks_per_group > 8U * blocksz) || (blocks <= sb->s_first_data_block))
+	{
+		E3DEBUG(E3TOOLS_PFX "superblock geometry looks bogus (%lld blocks, %d per group); not building the group table\n",
+			(long long int)blocks, sb->s_blocks_per_group);
+		return -1;
+	}
+	if (!SB_DESC_SIZE_OK(sb))
+	{
+		E3DEBUG(E3TOOLS_PFX "superblock says descriptors are %d bytes, which they can't be; not building the group table\n",
+			SB_RAW_DESC_SIZE(sb));
+		return -1;
+	}
+	
+	ngroups = SB_GROUPS(sb);
+	e3t->geom = calloc(ngroups, sizeof(*e3t->geom));
+	if (!e3t->geom)
+	{
+		perror("block_group_geometry_init: calloc");
+		return -1;
+	}
+	e3t->ngroups = ngroups;
+	
+	descs_per_block = blocksz / SB_DESC_SIZE(sb);
+	gdt_blocks = e3_gdt_blocks(sb);
+	if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		gdt_blocks = sb->s_first_meta_bg;
+	itable_blocks = (U64(sb->s_inodes_per_group) * sb->s_inode_size + blocksz - 1) / blocksz;
+	if ((sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG) && (SB_LOG_GROUPS_PER_FLEX(sb) < 31))
+		flexsz = 1 << SB_LOG_GROUPS_PER_FLEX(sb);
+	
+	for (bg = 0; U64(bg) < ngroups; bg++)
+	{
+		struct e3_group_geom *g = &e3t->geom[bg];
+		uint64_t metagroup = bg / descs_per_block;
+		
+		g->start = U64(bg) * sb->s_blocks_per_group + sb->s_first_data_block;
+		g->nblocks = blocks - g->start;
+		if (g->nblocks > sb->s_blocks_per_group)
+			g->nblocks = sb->s_blocks_per_group;
+		g->has_sb = e3_block_group_has_sb(sb, bg);
+		
+		if ((sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG) && (metagroup >= sb->s_first_meta_bg))
+		{
+			/* meta_bg keeps one descriptor block per metagroup, in
+			 * its first, second and last groups. */
+			int pos = bg % descs_per_block;
+			g->gdt_blocks = ((pos == 0) || (pos == 1) || (pos == descs_per_block - 1)) ? 1 : 0;
+		} else if (g->has_sb) {
+			g->gdt_blocks = gdt_blocks;
+			if (sb->s_feature_compat & EXT3_FEATURE_COMPAT_RESIZE_INODE)
+				g->rsv_gdt_blocks = SB_RESERVED_GDT_BLOCKS(sb);
+		}
+		
+		if (flexsz > 1)
+		{
+			/* With flex_bg, mke2fs packs the bitmaps and inode
+			 * tables for the whole flex group into its first group:
+			 * all the block bitmaps, then all the inode bitmaps,
+			 * then all the inode tables.  A short last flex group is
+			 * packed as tightly as it has groups, unless it only has
+			 * the one (that's what ext2fs_allocate_group_table
+			 * does).  They can get pushed along if something is in
+			 * the way, so this is only what we would expect on a
+			 * fresh filesystem. */
+			int firstbg = bg - bg % flexsz;
+			struct e3_group_geom *first = &e3t->geom[firstbg];
+			int i = bg - firstbg;
+			int left = ngroups - firstbg;
+			int nflex = ((left < flexsz) && (left > 1)) ? left : flexsz;
+			block_t base = first->start + (first->has_sb ? 1 : 0) + first->gdt_blocks + first->rsv_gdt_blocks;
+			
+			g->block_bitmap = base + i;
+			g->inode_bitmap = base + nflex + i;
+			g->inode_table = base + 2 * nflex + i * itable_blocks;
+		} else {
+			g->block_bitmap = g->start + (g->has_sb ? 1 : 0) + g->gdt_blocks + g->rsv_gdt_blocks;
+			g->inode_bitmap = g->block_bitmap + 1;
+			g->inode_table = g->block_bitmap + 2;
+		}
+	}
+	
+	return 0;
+}
+
+#define GD_FIELD(raw, type, off) (*(type *)((raw) + (off)))
+
+void block_group_desc_decode(e3tools_t *e3t, uint8_t *raw, struct e3_group_desc *gd)
+{
+	struct ext2_group_desc *d = (struct ext2_group_desc *)raw;
+	
+	gd->block_bitmap = d->bg_block_bitmap;
+	gd->inode_bitmap = d->bg_inode_bitmap;
+	gd->inode_table = d->bg_inode_table;
+	gd->free_blocks_count = d->bg_free_blocks_count;
+	gd->free_inodes_count = d->bg_free_inodes_count;
+	gd->used_dirs_count = d->bg_used_dirs_count;
+	gd->flags = d->bg_pad;	/* bg_flags, in ext3 and later */
+	
+	if (SB_DESC_SIZE(&e3t->sb) < 64)
+		return;
+	
+	gd->block_bitmap |= U64(GD_FIELD(raw, uint32_t, 0x20)) << 32;
+	gd->inode_bitmap |= U64(GD_FIELD(raw, uint32_t, 0x24)) << 32;
+	gd->inode_table |= U64(GD_FIELD(raw, uint32_t, 0x28)) << 32;
+	gd->free_blocks_count |= (uint32_t)GD_FIELD(raw, uint16_t, 0x2C) << 16;
+	gd->free_inodes_count |= (uint32_t)GD_FIELD(raw, uint16_t, 0x2E) << 16;
+	gd->used_dirs_count |= (uint32_t)GD_FIELD(raw, uint16_t, 0x30) << 16;
+}
+
+void block_group_desc_encode(e3tools_t *e3t, struct e3_group_desc *gd, uint8_t *raw)
+{
+	struct ext2_group_desc *d = (struct ext2_group_desc *)raw;
+	
+	d->bg_block_bitmap = gd->block_bitmap;
+	d->bg_inode_bitmap = gd->inode_bitmap;
+	d->bg_inode_table = gd->inode_table;
+	d->bg_free_blocks_count = gd->free_blocks_count;
+	d->bg_free_inodes_count = gd->free_inodes_count;
+	d->bg_used_dirs_count = gd->used_dirs_count;
+	d->bg_pad = gd->flags;
+	
+	if (SB_DESC_SIZE(&e3t->sb) < 64)
+		return;
+	
+	GD_FIELD(raw, uint32_t, 0x20) = gd->block_bitmap >> 32;
+	GD_FIELD(raw, uint32_t, 0x24) = gd->inode_bitmap >> 32;
+	GD_FIELD(raw, uint32_t, 0x28) = gd->inode_table >> 32;
+	GD_FIELD(raw, uint16_t, 0x2C) = gd->free_blocks_count >> 16;
+	GD_FIELD(raw, uint16_t, 0x2E) = gd->free_inodes_count >> 16;
+	GD_FIELD(raw, uint16_t, 0x30) = gd->used_dirs_count >> 16;
+}
+
+static pthread_mutex_t gdt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The whole descriptor table, raw, read in one go (or fetched from the
+ * index) the first time anything wants it, rather than a sector at a time
+ * on every inode lookup.  NULL if it can't be read, in which case callers
+ * go back to reading descriptors one sector at a time. */
+const uint8_t *block_group_desc_table(e3tools_t *e3t)
+{
+	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
+	int len = e3t->ngroups * SB_DESC_SIZE(&e3t->sb);
+	int nsect = (len + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+	uint8_t *gdt = __atomic_load_n(&e3t->gdt, __ATOMIC_ACQUIRE);
+	
+	if (gdt || !e3t->geom)
+		return gdt;
+	
+	/* Worker threads get here at the same time; whoever takes the lock
+	 * first reads the table, and it's only published once it's whole. */
+	pthread_mutex_lock(&gdt_lock);
+	if (!e3t->gdt && (gdt = malloc(nsect * BYTES_PER_SECTOR)))
+	{
+		if (index_gdt_get(e3t, gdt, len) == 0)
+		{
+			__atomic_store_n(&e3t->gdt, gdt, __ATOMIC_RELEASE);
+		} else if (disk_read_sectors(e3t, SB_GDT_BLOCK(&e3t->sb) * (sector_t)sectors_per_block, nsect, gdt) == 0) {
+			__atomic_store_n(&e3t->gdt, gdt, __ATOMIC_RELEASE);
+			index_gdt_put(e3t);
+		} else {
+			free(gdt);
+		}
+	}
+	gdt = e3t->gdt;
+	pthread_mutex_unlock(&gdt_lock);
+	
+	return gdt;
+}
+
+/* Forgets the descriptor table, for when what's on the disk might have
+ * changed under it; it's read again the next time it's wanted.  Nothing
+ * may still be using the old one.  One that was voted on (--consensus) is
+ * kept, since reading it again would only get the primary copy; see
+ * block_group_desc_table_written() for how it's kept up to date. */
+void block_group_desc_table_invalidate(e3tools_t *e3t)
+{
+	uint8_t *gdt;
+	
+	if (e3t->consensus)
+		return;
+	pthread_mutex_lock(&gdt_lock);
+	gdt = e3t->gdt;
+	__atomic_store_n(&e3t->gdt, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&gdt_lock);
+	free(gdt);
+}
+
+/* Sectors have been written, and the descriptor table we have might be
+ * out of date.  One that was read from the disk is just read again when
+ * it's next wanted.  One that was voted on (--consensus) can't be, since
+ * that would only get the primary copy, with none of what the vote fixed;
+ * whatever was written over the primary copy is laid over it instead. */
+void block_group_desc_table_written(e3tools_t *e3t, const sector_t *sectors, int n, const uint8_t *buf)
+{
+	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
+	sector_t start = SB_GDT_BLOCK(&e3t->sb) * (sector_t)sectors_per_block;
+	int len = e3t->ngroups * SB_DESC_SIZE(&e3t->sb);
+	int i, ofs;
+	
+	if (!e3t->consensus)
+	{
+		block_group_desc_table_invalidate(e3t);
+		return;
+	}
+	
+	pthread_mutex_lock(&gdt_lock);
+	for (i = 0; e3t->gdt && (i < n); i++)
+	{
+		if ((sectors[i] < start) || ((sectors[i] - start) * BYTES_PER_SECTOR >= U64(len)))
+			continue;
+		ofs = (sectors[i] - start) * BYTES_PER_SECTOR;
+		memcpy(e3t->gdt + ofs, buf + i * BYTES_PER_SECTOR, (len - ofs < BYTES_PER_SECTOR) ? len - ofs : BYTES_PER_SECTOR);
+	}
+	pthread_mutex_unlock(&gdt_lock);
+}
 
 block_t block_group_inode_table_block(e3tools_t *e3t, int bg)
 {
 	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
-	sector_t sector = (e3t->sb.s_block_group_nr * e3t->sb.s_blocks_per_group + 1LL) * (sector_t)sectors_per_block;
-	struct ext2_group_desc sect[BYTES_PER_SECTOR / sizeof(struct ext2_group_desc)];
+	int descsz = SB_DESC_SIZE(&e3t->sb);
+	sector_t sector = SB_GDT_BLOCK(&e3t->sb) * (sector_t)sectors_per_block;
+	uint64_t ofs = U64(bg) * descsz;
+	uint8_t sect[BYTES_PER_SECTOR];
+	struct e3_group_desc gd;
+	const uint8_t *gdt = block_group_desc_table(e3t);
 	
-	sector += (bg * sizeof(struct ext2_group_desc)) / BYTES_PER_SECTOR;
+	if (gdt && (bg >= 0) && (bg < e3t->ngroups))
+	{
+		block_group_desc_decode(e3t, (uint8_t *)gdt + bg * descsz, &gd);
+		return gd.inode_table;
+	}
 	
-	if (disk_read_sector(e3t, sector, (uint8_t *)sect) < 0)
+	/* Descriptors are a power of two in size, so the fields we decode
+	 * (the first 64 bytes) never straddle a sector, however big the
+	 * descriptor is.  If the superblock says otherwise, it's wrong. */
+	if (!SB_DESC_SIZE_OK(&e3t->sb))
+		return -1;
+	sector += ofs / BYTES_PER_SECTOR;
+	
+	if (disk_read_sector(e3t, sector, sect) < 0)
 	{
 		fflush(stdout);
 		perror("read_sector");
 		return -1;
 	}
 	
-	return sect[bg % (BYTES_PER_SECTOR / sizeof(struct ext2_group_desc))].bg_inode_table;
+	block_group_desc_decode(e3t, sect + ofs % BYTES_PER_SECTOR, &gd);
+	return gd.inode_table;
 }
 
 void block_group_desc_table_show(e3tools_t *e3t)
 {
-	int bgs = e3t->sb.s_blocks_count / e3t->sb.s_blocks_per_group;
-	int bytes_per_block = 1024 << e3t->sb.s_log_block_size;
+	int bgs = e3t->ngroups;
 	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
+	int descsz = SB_DESC_SIZE(&e3t->sb);
 	int curbg;
-	sector_t sector;
-	struct ext2_group_desc sect[BYTES_PER_SECTOR / sizeof(struct ext2_group_desc)];
+	sector_t sector, cur = -1;
+	uint8_t sect[BYTES_PER_SECTOR];
+	
+	if (!e3t->geom)
+	{
+		printf("No block group geometry to check against -- is the superblock any good?\n");
+		return;
+	}
 	
 	printf("Block descriptor table from block group %d\n", e3t->sb.s_block_group_nr);
-	printf("Starts on block %d\n", e3t->sb.s_block_group_nr * e3t->sb.s_blocks_per_group + 1);
-	sector = (e3t->sb.s_block_group_nr * e3t->sb.s_blocks_per_group + 1LL) * (sector_t)sectors_per_block;
+	printf("Starts on block %lld\n", (long long int)SB_GDT_BLOCK(&e3t->sb));
+	sector = SB_GDT_BLOCK(&e3t->sb) * (sector_t)sectors_per_block;
 	printf("  ... or sector %lld\n", (long long int)sector);
 	printf("Expecting %d block groups\n", bgs);
-	printf("Expecting %lu bytes of block group\n", sizeof(struct ext2_group_desc) * (bgs));
-	printf("Expecting %lld sectors of block group\n", sizeof(struct ext2_group_desc) * (bgs) / BYTES_PER_SECTOR);
-	printf("Expecting %lu blocks of block group\n", sizeof(struct ext2_group_desc) * (bgs) / bytes_per_block);
+	printf("Expecting %d bytes per block group descriptor\n", descsz);
+	printf("Expecting %lld bytes of block group\n", (long long int)descsz * (bgs));
+	printf("Expecting %lld sectors of block group\n", descsz * (bgs) / BYTES_PER_SECTOR);
+	printf("Expecting %lld blocks of block group\n", (long long int)e3_gdt_blocks(&e3t->sb));
+	if (e3t->geom[0].rsv_gdt_blocks)
+		printf("  ... plus %lld reserved for resizing\n", (long long int)e3t->geom[0].rsv_gdt_blocks);
 	printf("OK, let's do this!\n");
 	printf("\n");
 	
 	for (curbg = 0; curbg < bgs; curbg++)
 	{
-		int pos = curbg % (BYTES_PER_SECTOR / sizeof(struct ext2_group_desc));
-		if (pos == 0)
+		uint64_t ofs = U64(curbg) * descsz;
+		struct e3_group_desc gd;
+		
+		/* A sector holds several descriptors, or the start of one big
+		 * one; either way, what we decode is in the sector it starts
+		 * in. */
+		if (sector + ofs / BYTES_PER_SECTOR != cur)
 		{
-			printf("Reading from new sector: %lld\n", (long long int)sector);
-			if (disk_read_sector(e3t, sector, (uint8_t *)sect) < 0)
+			cur = sector + ofs / BYTES_PER_SECTOR;
+			printf("Reading from new sector: %lld\n", (long long int)cur);
+			if (disk_read_sector(e3t, cur, sect) < 0)
 			{
 				fflush(stdout);
 				perror("read_sector");
 				return;
 			}
-			sector++;
 		}
+		block_group_desc_decode(e3t, sect + ofs % BYTES_PER_SECTOR, &gd);
+		
 		printf("\tBlock group %d\n", curbg);
-		if (e3_block_group_has_sb(&e3t->sb, curbg))
+		if (e3t->geom[curbg].has_sb)
 			printf("\t\tHas superblock\n");
 
-		printf("\t\tBitmap block : %12d (0x%08x)\n", sect[pos].bg_block_bitmap, sect[pos].bg_block_bitmap);
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_block_bitmap, curbg))
+		printf("\t\tBitmap block : %12lld (0x%08llx)\n", (long long int)gd.block_bitmap, (long long int)gd.block_bitmap);
+		if (!e3_block_is_plausible_for_group(e3t, gd.block_bitmap, curbg))
 			printf("\t\t               ...looks bad!\n");
-		if (sect[pos].bg_block_bitmap != e3_block_group_expected_block_bitmap(&e3t->sb, curbg))
-			printf("\t\t               ...but expected %08x!\n", e3_block_group_expected_block_bitmap(&e3t->sb, curbg));
+		if (gd.block_bitmap != e3_block_group_expected_block_bitmap(e3t, curbg))
+			printf("\t\t               ...but expected %08llx!\n", (long long int)e3_block_group_expected_block_bitmap(e3t, curbg));
 
-		printf("\t\tInode block  : %12d (0x%08x)\n", sect[pos].bg_inode_bitmap, sect[pos].bg_inode_bitmap);
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_inode_bitmap, curbg))
+		printf("\t\tInode block  : %12lld (0x%08llx)\n", (long long int)gd.inode_bitmap, (long long int)gd.inode_bitmap);
+		if (!e3_block_is_plausible_for_group(e3t, gd.inode_bitmap, curbg))
 			printf("\t\t               ...looks bad!\n");
-		if (sect[pos].bg_inode_bitmap != (e3_block_group_expected_block_bitmap(&e3t->sb, curbg) + 1))
-			printf("\t\t               ...but expected %08x!\n", e3_block_group_expected_block_bitmap(&e3t->sb, curbg) + 1);
+		if (gd.inode_bitmap != e3_block_group_expected_inode_bitmap(e3t, curbg))
+			printf("\t\t               ...but expected %08llx!\n", (long long int)e3_block_group_expected_inode_bitmap(e3t, curbg));
 
-		printf("\t\tInode table  : %12d (0x%08x)\n", sect[pos].bg_inode_table, sect[pos].bg_inode_table);
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_inode_table, curbg))
+		printf("\t\tInode table  : %12lld (0x%08llx)\n", (long long int)gd.inode_table, (long long int)gd.inode_table);
+		if (!e3_block_is_plausible_for_group(e3t, gd.inode_table, curbg))
 			printf("\t\t               ...looks bad!\n");
-		if (sect[pos].bg_inode_table != (e3_block_group_expected_block_bitmap(&e3t->sb, curbg) + 2))
-			printf("\t\t               ...but expected %08x!\n", e3_block_group_expected_block_bitmap(&e3t->sb, curbg) + 2);
+		if (gd.inode_table != e3_block_group_expected_inode_table(e3t, curbg))
+			printf("\t\t               ...but expected %08llx!\n", (long long int)e3_block_group_expected_inode_table(e3t, curbg));
 	}
 }
 
-void block_group_desc_table_repair(e3tools_t *e3t)
+/* Prints what a repair changed in one descriptor, field by field. */
+static void _repair_diff(e3tools_t *e3t, int bg, uint8_t *before, uint8_t *after)
 {
-	int bgs = e3t->sb.s_blocks_count / e3t->sb.s_blocks_per_group;
+	struct e3_group_desc o, n;
+	
+	block_group_desc_decode(e3t, before, &o);
+	block_group_desc_decode(e3t, after, &n);
+	if (o.block_bitmap != n.block_bitmap)
+		printf("\t\tblock group %d block bitmap : 0x%08llx -> 0x%08llx\n", bg, (long long int)o.block_bitmap, (long long int)n.block_bitmap);
+	if (o.inode_bitmap != n.inode_bitmap)
+		printf("\t\tblock group %d inode bitmap : 0x%08llx -> 0x%08llx\n", bg, (long long int)o.inode_bitmap, (long long int)n.inode_bitmap);
+	if (o.inode_table != n.inode_table)
+		printf("\t\tblock group %d inode table  : 0x%08llx -> 0x%08llx\n", bg, (long long int)o.inode_table, (long long int)n.inode_table);
+}
+
+/* Reads the whole descriptor table in one go, fixes it in memory, shows
+ * what changed a sector at a time, and then (unless this is a dry run)
+ * hands every changed sector to the COW store in one batch, so that a
+ * repair either all happens or doesn't. */
+void block_group_desc_table_repair(e3tools_t *e3t, int dryrun)
+{
+	int bgs = e3t->ngroups;
 	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
-	int curbg;
+	int descsz = SB_DESC_SIZE(&e3t->sb);
+	int nsect = (bgs * descsz + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+	int curbg, first, last, i, ndirty = 0;
 	sector_t sector;
-	struct ext2_group_desc sect[BYTES_PER_SECTOR / sizeof(struct ext2_group_desc)];
-	int dirty = 0;
+	uint8_t *table = NULL, *orig = NULL, *dirty = NULL;
+	sector_t *dirtysect = NULL;
+	
+	if (!e3t->geom)
+	{
+		printf("No block group geometry to repair against -- is the superblock any good?\n");
+		return;
+	}
+	
+	sector = SB_GDT_BLOCK(&e3t->sb) * (sector_t)sectors_per_block;
+	table = malloc(nsect * BYTES_PER_SECTOR);
+	orig = malloc(nsect * BYTES_PER_SECTOR);
+	if (!table || !orig)
+	{
+		perror("block_group_desc_table_repair: malloc");
+		goto out;
+	}
+	if (disk_read_sectors(e3t, sector, nsect, table) < 0)
+	{
+		fflush(stdout);
+		perror("read_sector");
+		goto out;
+	}
+	memcpy(orig, table, nsect * BYTES_PER_SECTOR);
 	
-	sector = (e3t->sb.s_block_group_nr * e3t->sb.s_blocks_per_group + 1LL) * (sector_t)sectors_per_block;
 	for (curbg = 0; curbg < bgs; curbg++)
 	{
-		int pos = curbg % (BYTES_PER_SECTOR / sizeof(struct ext2_group_desc));
-		if (pos == 0)
+		uint8_t *raw = table + curbg * descsz;
+		struct e3_group_desc gd;
+		
+		block_group_desc_decode(e3t, raw, &gd);
+		
+		if (!e3_block_is_plausible_for_group(e3t, gd.block_bitmap, curbg))
 		{
-			if (dirty)
-			{
-				sector--;
-				printf("Writing back to repaired sector: %lld (%d changes)\n", (long long int)sector, dirty);
-				if (disk_write_sector(e3t, sector, (uint8_t *)sect) < 0)
-				{
-					fflush(stdout);
-					perror("write_sector");
-					return;
-				}
-				sector++;
-				dirty = 0;
-			}
-			if (disk_read_sector(e3t, sector, (uint8_t *)sect) < 0)
-			{
-				fflush(stdout);
-				perror("read_sector");
-				return;
-			}
-			sector++;
+			printf("Block group %d block bitmap block (0x%08llx) appears not to be in block group!  Resetting to default (0x%08llx).\n",
+				curbg, (long long int)gd.block_bitmap, (long long int)e3_block_group_expected_block_bitmap(e3t, curbg));
+			gd.block_bitmap = e3_block_group_expected_block_bitmap(e3t, curbg);
 		}
+		if (gd.block_bitmap != e3_block_group_expected_block_bitmap(e3t, curbg))
+			printf("Block group %d block bitmap block is 0x%08llx, but expected %08llx! Looks plausible otherwise, though; not fixing.\n", 
+				curbg, (long long int)gd.block_bitmap, (long long int)e3_block_group_expected_block_bitmap(e3t, curbg));
 		
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_block_bitmap, curbg))
+		if (!e3_block_is_plausible_for_group(e3t, gd.inode_bitmap, curbg))
 		{
-			printf("Block group %d block bitmap block (0x%08x) appears not to be in block group!  Resetting to default (0x%08x).\n",
-				curbg, sect[pos].bg_block_bitmap, e3_block_group_expected_block_bitmap(&e3t->sb, curbg));
-			sect[pos].bg_block_bitmap = e3_block_group_expected_block_bitmap(&e3t->sb, curbg);
-			dirty++;
+			printf("Block group %d inode bitmap block (0x%08llx) appears not to be in block group!  Resetting to default (0x%08llx).\n",
+				curbg, (long long int)gd.inode_bitmap, (long long int)e3_block_group_expected_inode_bitmap(e3t, curbg));
+			gd.inode_bitmap = e3_block_group_expected_inode_bitmap(e3t, curbg);
 		}
-		if (sect[pos].bg_block_bitmap != e3_block_group_expected_block_bitmap(&e3t->sb, curbg))
-			printf("Block group %d block bitmap block is 0x%08x, but expected %08x! Looks plausible otherwise, though; not fixing.\n", 
-				curbg, sect[pos].bg_block_bitmap, e3_block_group_expected_block_bitmap(&e3t->sb, curbg));
+		if (gd.inode_bitmap != e3_block_group_expected_inode_bitmap(e3t, curbg))
+			printf("Block group %d inode bitmap block is 0x%08llx, but expected %08llx! Looks plausible otherwise, though; not fixing.\n", 
+				curbg, (long long int)gd.inode_bitmap, (long long int)e3_block_group_expected_inode_bitmap(e3t, curbg));
 		
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_inode_bitmap, curbg))
+		if (!e3_block_is_plausible_for_group(e3t, gd.inode_table, curbg))
 		{
-			printf("Block group %d inode bitmap block (0x%08x) appears not to be in block group!  Resetting to default (0x%08x).\n",
-				curbg, sect[pos].bg_inode_bitmap, e3_block_group_expected_inode_bitmap(&e3t->sb, curbg));
-			sect[pos].bg_inode_bitmap = e3_block_group_expected_inode_bitmap(&e3t->sb, curbg);
-			dirty++;
+			printf("Block group %d inode table start block (0x%08llx) appears not to be in block group!  Resetting to default (0x%08llx).\n",
+				curbg, (long long int)gd.inode_table, (long long int)e3_block_group_expected_inode_table(e3t, curbg));
+			gd.inode_table = e3_block_group_expected_inode_table(e3t, curbg);
 		}
-		if (sect[pos].bg_inode_bitmap != e3_block_group_expected_inode_bitmap(&e3t->sb, curbg))
-			printf("Block group %d inode bitmap block is 0x%08x, but expected %08x! Looks plausible otherwise, though; not fixing.\n", 
-				curbg, sect[pos].bg_inode_bitmap, e3_block_group_expected_inode_bitmap(&e3t->sb, curbg));
+		if (gd.inode_table != e3_block_group_expected_inode_table(e3t, curbg))
+			printf("Block group %d inode table start block is 0x%08llx, but expected %08llx! Looks plausible otherwise, though; not fixing.\n", 
+				curbg, (long long int)gd.inode_table, (long long int)e3_block_group_expected_inode_table(e3t, curbg));
 		
-		if (!e3_block_is_in_block_group(&e3t->sb, sect[pos].bg_inode_table, curbg))
+		block_group_desc_encode(e3t, &gd, raw);
+	}
+	
+	/* Gather up the sectors that changed, and say how. */
+	dirtysect = malloc(nsect * sizeof(sector_t));
+	dirty = malloc(nsect * BYTES_PER_SECTOR);
+	if (!dirtysect || !dirty)
+	{
+		perror("block_group_desc_table_repair: malloc");
+		goto out;
+	}
+	for (i = 0; i < nsect; i++)
+	{
+		if (!memcmp(table + i * BYTES_PER_SECTOR, orig + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR))
+			continue;
+		/* The groups with any part of their descriptor in this sector;
+		 * a descriptor bigger than a sector has the fields we change
+		 * in its first one. */
+		first = i * BYTES_PER_SECTOR / descsz;
+		last = ((i + 1) * BYTES_PER_SECTOR - 1) / descsz;
+		if (last >= bgs)
+			last = bgs - 1;
+		if (ndirty == 0)
+			printf("\nChanges to the descriptor table:\n");
+		printf("\tSector %lld (block groups %d to %d):\n", (long long int)(sector + i), first, last);
+		for (curbg = first; curbg <= last; curbg++)
+			_repair_diff(e3t, curbg, orig + curbg * descsz, table + curbg * descsz);
+		dirtysect[ndirty] = sector + i;
+		memcpy(dirty + ndirty * BYTES_PER_SECTOR, table + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		ndirty++;
+	}
+	
+	if (ndirty == 0)
+	{
+		printf("\nNothing in the descriptor table needs changing.\n");
+	} else if (dryrun) {
+		printf("\nDry run: not writing back %d repaired sector%s.\n", ndirty, (ndirty == 1) ? "" : "s");
+	} else {
+		printf("\nWriting back %d repaired sector%s.\n", ndirty, (ndirty == 1) ? "" : "s");
+		if (disk_write_sectors(e3t, dirtysect, ndirty, dirty) < 0)
 		{
-			printf("Block group %d inode table start block (0x%08x) appears not to be in block group!  Resetting to default (0x%08x).\n",
-				curbg, sect[pos].bg_inode_table, e3_block_group_expected_inode_table(&e3t->sb, curbg));
-			sect[pos].bg_inode_table = e3_block_group_expected_inode_table(&e3t->sb, curbg);
-			dirty++;
+			fflush(stdout);
+			perror("write_sector");
 		}
-		if (sect[pos].bg_inode_table != e3_block_group_expected_inode_table(&e3t->sb, curbg))
-			printf("Block group %d inode table start block is 0x%08x, but expected %08x! Looks plausible otherwise, though; not fixing.\n", 
-				curbg, sect[pos].bg_inode_table, e3_block_group_expected_inode_table(&e3t->sb, curbg));
 	}
+	
+out:
+	free(table);
+	free(orig);
+	free(dirty);
+	free(dirtysect);
 }
@@ -3,12 +3,43 @@
 
 #include <stdint.h>
 
-typedef uint32_t block_t;
+typedef uint64_t block_t;
 
 #include "e3tools.h"
 
+/* A block group descriptor, with the high halves that 64-bit ext4 keeps
+ * in the second 32 bytes of each descriptor folded in. */
+struct e3_group_desc {
+	block_t block_bitmap;
+	block_t inode_bitmap;
+	block_t inode_table;
+	uint32_t free_blocks_count;
+	uint32_t free_inodes_count;
+	uint32_t used_dirs_count;
+	uint16_t flags;
+};
+
+/* Where everything in a block group ought to live, worked out from the
+ * superblock alone by block_group_geometry_init(). */
+struct e3_group_geom {
+	block_t start;		/* first block of the group */
+	block_t nblocks;	/* the last group may come up short */
+	int has_sb;
+	block_t gdt_blocks;	/* descriptor table blocks after the superblock copy */
+	block_t rsv_gdt_blocks;	/* set aside for online resize */
+	block_t block_bitmap;
+	block_t inode_bitmap;
+	block_t inode_table;
+};
+
+extern int block_group_geometry_init(e3tools_t *e3t);
+extern void block_group_desc_decode(e3tools_t *e3t, uint8_t *raw, struct e3_group_desc *gd);
+extern void block_group_desc_encode(e3tools_t *e3t, struct e3_group_desc *gd, uint8_t *raw);
+extern const uint8_t *block_group_desc_table(e3tools_t *e3t);
+extern void block_group_desc_table_invalidate(e3tools_t *e3t);
+extern void block_group_desc_table_written(e3tools_t *e3t, const sector_t *sectors, int n, const uint8_t *buf);
 extern void block_group_desc_table_show(e3tools_t *sb);
-extern void block_group_desc_table_repair(e3tools_t *sb);
+extern void block_group_desc_table_repair(e3tools_t *sb, int dryrun);
 extern block_t block_group_inode_table_block(e3tools_t *sb, int bg);
 
 #endif
@@ -0,0 +1,346 @@
+// e3tools block ownership map
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#include <linux/ext2_fs.h>
+
+#include "e3bits.h"
+#include "blockgroup.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "blockmap.h"
+
+/* The owner of every block, four bytes a block, so that "who owns block
+ * N?" is one lookup.  The table is cut into leaves of 64k blocks that only
+ * get allocated once something in them is claimed, so the free parts of a
+ * big, mostly empty disk cost nothing.  Claims go in with a compare and
+ * swap, so every thread walking inodes can claim at once, and the first
+ * claim on a block wins; any later ones are cross-links. */
+
+#define LEAF_SHIFT 16
+#define LEAF_SIZE (1 << LEAF_SHIFT)
+
+#define RESIZE_INO 7
+
+struct blockmap {
+	e3tools_t *e3t;
+	block_t nblocks;
+	uint32_t **leaves;
+	uint64_t nleaves;
+	pthread_mutex_t lock;
+	struct blockmap_xlink *xl;
+	int nxl, xlalloc;
+	int errors;		/* inodes whose maps couldn't be followed all the way */
+	int nextgroup;
+};
+
+struct blockmap *blockmap_new(e3tools_t *e3t)
+{
+	struct blockmap *bm = calloc(1, sizeof(*bm));
+	
+	if (!bm)
+		return NULL;
+	bm->e3t = e3t;
+	bm->nblocks = SB_BLOCKS_COUNT(&e3t->sb);
+	bm->nleaves = (bm->nblocks + LEAF_SIZE - 1) >> LEAF_SHIFT;
+	bm->leaves = calloc(bm->nleaves, sizeof(*bm->leaves));
+	if (!bm->leaves)
+	{
+		perror("blockmap_new: calloc");
+		free(bm);
+		return NULL;
+	}
+	pthread_mutex_init(&bm->lock, NULL);
+	return bm;
+}
+
+void blockmap_free(struct blockmap *bm)
+{
+	uint64_t i;
+	
+	if (!bm)
+		return;
+	for (i = 0; i < bm->nleaves; i++)
+		free(bm->leaves[i]);
+	free(bm->leaves);
+	free(bm->xl);
+	pthread_mutex_destroy(&bm->lock);
+	free(bm);
+}
+
+static uint32_t *_leaf(struct blockmap *bm, block_t b, int create)
+{
+	uint32_t *leaf = __atomic_load_n(&bm->leaves[b >> LEAF_SHIFT], __ATOMIC_ACQUIRE);
+	
+	if (leaf || !create)
+		return leaf;
+	pthread_mutex_lock(&bm->lock);
+	leaf = bm->leaves[b >> LEAF_SHIFT];
+	if (!leaf)
+	{
+		leaf = calloc(LEAF_SIZE, sizeof(uint32_t));
+		if (!leaf)
+		{
+			perror("blockmap: calloc");
+			exit(1);
+		}
+		__atomic_store_n(&bm->leaves[b >> LEAF_SHIFT], leaf, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&bm->lock);
+	return leaf;
+}
+
+static void _xlink(struct blockmap *bm, block_t b, uint32_t owner, uint32_t other)
+{
+	pthread_mutex_lock(&bm->lock);
+	if (bm->nxl == bm->xlalloc)
+	{
+		bm->xlalloc = bm->xlalloc ? bm->xlalloc * 2 : 64;
+		bm->xl = realloc(bm->xl, bm->xlalloc * sizeof(*bm->xl));
+		if (!bm->xl)
+		{
+			perror("blockmap: realloc");
+			exit(1);
+		}
+	}
+	bm->xl[bm->nxl].block = b;
+	bm->xl[bm->nxl].lo = owner;	/* until _xlink_canon() */
+	bm->xl[bm->nxl].hi = other;
+	bm->nxl++;
+	pthread_mutex_unlock(&bm->lock);
+}
+
+/* Claims n blocks from b for owner.  A shareable claim (an extended
+ * attribute block, which inodes with the same attributes share) never
+ * counts as a cross-link; it just doesn't get the block if something else
+ * already has it. */
+void blockmap_claim(struct blockmap *bm, block_t b, block_t n, uint32_t owner, int shareable)
+{
+	uint32_t *leaf, prev;
+	
+	for (; n && (b < bm->nblocks); b++, n--)
+	{
+		leaf = _leaf(bm, b, 1);
+		prev = __sync_val_compare_and_swap(&leaf[b & (LEAF_SIZE - 1)], BLOCKMAP_FREE, owner);
+		if ((prev == BLOCKMAP_FREE) || shareable || ((prev == owner) && (owner == BLOCKMAP_METADATA)))
+			continue;
+		_xlink(bm, b, prev, owner);
+	}
+}
+
+uint32_t blockmap_owner(struct blockmap *bm, block_t b)
+{
+	uint32_t *leaf;
+	
+	if (b >= bm->nblocks)
+		return BLOCKMAP_FREE;
+	leaf = _leaf(bm, b, 0);
+	return leaf ? __atomic_load_n(&leaf[b & (LEAF_SIZE - 1)], __ATOMIC_RELAXED) : BLOCKMAP_FREE;
+}
+
+/* Everything that belongs to the filesystem itself rather than an inode:
+ * the boot block (with 1k blocks), the superblocks and descriptor tables
+ * and the space reserved for them to grow, and the bitmaps and inode
+ * tables, wherever the descriptors say they are. */
+static void _claim_metadata(struct blockmap *bm)
+{
+	e3tools_t *e3t = bm->e3t;
+	const uint8_t *gdt = block_group_desc_table(e3t);
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	block_t itable_blocks = (U64(e3t->sb.s_inodes_per_group) * e3t->sb.s_inode_size + bs - 1) / bs;
+	struct e3_group_desc gd;
+	int bg;
+	
+	blockmap_claim(bm, 0, e3t->sb.s_first_data_block + 1, BLOCKMAP_METADATA, 0);
+	for (bg = 0; bg < e3t->ngroups; bg++)
+	{
+		struct e3_group_geom *g = &e3t->geom[bg];
+		
+		blockmap_claim(bm, g->start, (g->has_sb ? 1 : 0) + g->gdt_blocks + g->rsv_gdt_blocks, BLOCKMAP_METADATA, 0);
+		
+		gd.block_bitmap = g->block_bitmap;
+		gd.inode_bitmap = g->inode_bitmap;
+		gd.inode_table = g->inode_table;
+		if (gdt)
+			block_group_desc_decode(e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&e3t->sb), &gd);
+		blockmap_claim(bm, e3_block_is_plausible_for_group(e3t, gd.block_bitmap, bg) ? gd.block_bitmap : g->block_bitmap, 1, BLOCKMAP_METADATA, 0);
+		blockmap_claim(bm, e3_block_is_plausible_for_group(e3t, gd.inode_bitmap, bg) ? gd.inode_bitmap : g->inode_bitmap, 1, BLOCKMAP_METADATA, 0);
+		blockmap_claim(bm, e3_block_is_plausible_for_group(e3t, gd.inode_table, bg) ? gd.inode_table : g->inode_table, itable_blocks, BLOCKMAP_METADATA, 0);
+	}
+}
+
+struct claimer {
+	struct blockmap *bm;
+	uint32_t owner;
+	int first_ino;
+};
+
+static int _claim_run(void *arg, block_t lblk, block_t pblk, block_t n, int what)
+{
+	struct claimer *c = arg;
+	
+	(void) lblk;
+	blockmap_claim(c->bm, pblk, n, c->owner, what == IWALK_XATTR);
+	return 0;
+}
+
+/* Which inodes own blocks: the ones in use, and the reserved ones that
+ * have blocks at all (the bad blocks inode has no mode and no links).  The
+ * resize inode's blocks are the reserved descriptor blocks and their
+ * backups, so they go down as the filesystem's.  An inode that has been
+ * deleted, or is on the orphan list on its way to being deleted, doesn't
+ * own anything. */
+static void _claim_inode(void *arg, int ino, struct ext2_inode *inode)
+{
+	struct claimer *c = arg;
+	
+	if (inode->i_dtime)
+		return;
+	if (ino < c->first_ino)
+	{
+		if (!inode->i_blocks)
+			return;
+	} else if (!inode->i_mode || !inode->i_links_count) {
+		return;
+	}
+	
+	c->owner = (ino == RESIZE_INO) ? BLOCKMAP_METADATA : (uint32_t)ino;
+	if (inode_block_walk(c->bm->e3t, inode, _claim_run, c))
+	{
+		E3DEBUG(E3TOOLS_PFX "couldn't follow all of inode %d's block map\n", ino);
+		__sync_fetch_and_add(&c->bm->errors, 1);
+	}
+}
+
+static void *_build_worker(void *arg)
+{
+	struct blockmap *bm = arg;
+	e3tools_t *e3t = bm->e3t;
+	const uint8_t *gdt = block_group_desc_table(e3t);
+	struct e3_group_desc gd;
+	struct claimer c;
+	int bg;
+	
+	c.bm = bm;
+	c.first_ino = (e3t->sb.s_rev_level == 0) ? 11 : e3t->sb.s_first_ino;
+	for (;;)
+	{
+		pthread_mutex_lock(&bm->lock);
+		bg = bm->nextgroup++;
+		pthread_mutex_unlock(&bm->lock);
+		if (bg >= e3t->ngroups)
+			break;
+		if (gdt)
+		{
+			block_group_desc_decode(e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&e3t->sb), &gd);
+			if (gd.flags & BG_INODE_UNINIT)
+				continue;
+		}
+		if (inode_table_scan(e3t, bg, _claim_inode, &c) < 0)
+			E3DEBUG(E3TOOLS_PFX "couldn't find group %d's inode table; its inodes' blocks will look unowned\n", bg);
+	}
+	return NULL;
+}
+
+static int _xlink_cmp(const void *a, const void *b)
+{
+	const struct blockmap_xlink *xa = a, *xb = b;
+	
+	if (xa->block != xb->block)
+		return (xa->block > xb->block) - (xa->block < xb->block);
+	if (xa->lo != xb->lo)
+		return (xa->lo > xb->lo) - (xa->lo < xb->lo);
+	return (xa->hi > xb->hi) - (xa->hi < xb->hi);
+}
+
+static int _u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	
+	return (x > y) - (x < y);
+}
+
+/* The threads got to the cross-links in no particular order, and which
+ * claimant of a block came first (the one every cross-link on it was
+ * recorded against) depends on that too.  So each block's claimants are
+ * gathered up and sorted, and the lowest paired with each of the others,
+ * which gives the same list every run. */
+static void _xlink_canon(struct blockmap *bm)
+{
+	uint32_t *ids;
+	int i, j, k, n;
+	
+	qsort(bm->xl, bm->nxl, sizeof(*bm->xl), _xlink_cmp);
+	ids = malloc((bm->nxl + 1) * sizeof(uint32_t));
+	if (!ids)
+	{
+		perror("blockmap: malloc");
+		exit(1);
+	}
+	for (i = 0; i < bm->nxl; i = j)
+	{
+		n = 0;
+		ids[n++] = bm->xl[i].lo;
+		for (j = i; (j < bm->nxl) && (bm->xl[j].block == bm->xl[i].block); j++)
+			ids[n++] = bm->xl[j].hi;
+		qsort(ids, n, sizeof(uint32_t), _u32_cmp);
+		for (k = i; k < j; k++)
+		{
+			bm->xl[k].lo = ids[0];
+			bm->xl[k].hi = ids[k - i + 1];
+		}
+	}
+	free(ids);
+}
+
+/* Fills the map in from the filesystem's own metadata and every inode
+ * that's in use, with nthreads threads taking a group's inode table each. */
+int blockmap_build(struct blockmap *bm, int nthreads)
+{
+	pthread_t *threads = NULL;
+	int i, started = 0;
+	
+	if (!bm->e3t->geom)
+		return -1;
+	_claim_metadata(bm);
+	
+	bm->nextgroup = 0;
+	if (nthreads > 1)
+	{
+		threads = malloc(nthreads * sizeof(pthread_t));
+		for (i = 0; threads && (i < nthreads); i++)
+		{
+			if (pthread_create(&threads[i], NULL, _build_worker, bm) != 0)
+				break;
+			started++;
+		}
+	}
+	if (started == 0)
+		_build_worker(bm);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	
+	if (bm->nxl)
+		_xlink_canon(bm);
+	return 0;
+}
+
+int blockmap_xlinks(struct blockmap *bm, const struct blockmap_xlink **xl)
+{
+	*xl = bm->xl;
+	return bm->nxl;
+}
+
+int blockmap_errors(struct blockmap *bm)
+{
+	return bm->errors;
+}
@@ -0,0 +1,34 @@
+#ifndef _BLOCKMAP_H
+#define _BLOCKMAP_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "blockgroup.h"
+
+/* Who owns each block: an inode number, or one of these. */
+#define BLOCKMAP_FREE 0
+#define BLOCKMAP_METADATA 0xFFFFFFFF	/* superblocks, descriptors, bitmaps, inode tables */
+
+/* A block that more than one owner claims.  Whichever claimed it first is
+ * the one that blockmap_owner() answers with, but that depends on how the
+ * threads ran; these don't.  A block with n claimants has n - 1 of them,
+ * each pairing the lowest numbered one (the metadata is the highest) with
+ * one of the others, in order. */
+struct blockmap_xlink {
+	block_t block;
+	uint32_t lo;
+	uint32_t hi;
+};
+
+struct blockmap;	// opaque; defined in blockmap.c
+
+extern struct blockmap *blockmap_new(e3tools_t *e3t);
+extern void blockmap_free(struct blockmap *bm);
+extern void blockmap_claim(struct blockmap *bm, block_t b, block_t n, uint32_t owner, int shareable);
+extern uint32_t blockmap_owner(struct blockmap *bm, block_t b);
+extern int blockmap_build(struct blockmap *bm, int nthreads);
+extern int blockmap_xlinks(struct blockmap *bm, const struct blockmap_xlink **xl);
+extern int blockmap_errors(struct blockmap *bm);
+
+#endif
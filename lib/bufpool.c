@@ -0,0 +1,227 @@
+// e3tools scratch buffers and small objects
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "bufpool.h"
+
+/* Nearly everything that reads metadata wants a block's worth of scratch
+ * space for a moment.  Taking it off the stack means a deep walk (an
+ * indirect map inside an extraction inside a directory walk) keeps a block
+ * per level on every thread's stack, and none of it is aligned well
+ * enough to hand to an O_DIRECT read.  So the buffers come from here
+ * instead: aligned, and kept on a free list once they're given back, so
+ * that after the first few, borrowing one is a lock and a pointer.  Only
+ * so many idle ones are kept; a burst of borrowing doesn't stay
+ * allocated.
+ *
+ * The small things we make and throw away by the thousand -- open inodes,
+ * COW sectors -- come out of slabs: big chunks cut up into objects of one
+ * size, with a free list of their own.  They all go away at once when the
+ * context is closed. */
+
+#define BUFPOOL_MAX_IDLE 64
+#define BUFPOOL_MAX_BLOCK (64 * 1024)	/* the biggest block size ext4 has */
+#define SLAB_CHUNK_BYTES (64 * 1024)
+
+struct freeobj {
+	struct freeobj *next;
+};
+
+struct slab {
+	size_t size;		/* 0 until the first allocation says */
+	struct freeobj *free;
+	uint8_t *chunk;		/* the chunk we're cutting new objects from ... */
+	size_t used;		/* ... and how much of it is gone */
+	void **chunks;		/* every chunk, to free at the end */
+	int nchunks, chunksalloc;
+};
+
+struct bufpool {
+	pthread_mutex_t lock;
+	size_t bufsize;		/* set by the first borrow; the superblock has to be in by then */
+	struct freeobj *idle;
+	int nidle;
+	struct slab slabs[NSLABS];
+};
+
+int bufpool_init(e3tools_t *e3t)
+{
+	struct bufpool *bp = calloc(1, sizeof(*bp));
+	
+	e3t->bufpool = bp;
+	if (!bp)
+		return -1;
+	pthread_mutex_init(&bp->lock, NULL);
+	return 0;
+}
+
+void bufpool_free(e3tools_t *e3t)
+{
+	struct bufpool *bp = e3t->bufpool;
+	struct freeobj *f, *next;
+	int i, j;
+	
+	if (!bp)
+		return;
+	for (f = bp->idle; f; f = next)
+	{
+		next = f->next;
+		free(f);
+	}
+	for (i = 0; i < NSLABS; i++)
+	{
+		for (j = 0; j < bp->slabs[i].nchunks; j++)
+			free(bp->slabs[i].chunks[j]);
+		free(bp->slabs[i].chunks);
+	}
+	pthread_mutex_destroy(&bp->lock);
+	free(bp);
+	e3t->bufpool = NULL;
+}
+
+/* Lends out a buffer of (at least) one block, aligned to BUFPOOL_ALIGN;
+ * give it back with buf_return().  NULL if there's no memory, or the
+ * superblock's block size is too silly to believe. */
+uint8_t *buf_borrow(e3tools_t *e3t)
+{
+	struct bufpool *bp = e3t->bufpool;
+	size_t bs = SB_BLOCK_SIZE(&e3t->sb);
+	void *buf = NULL;
+	
+	if ((e3t->sb.s_log_block_size > 6) || (bs > BUFPOOL_MAX_BLOCK))
+	{
+		E3DEBUG(E3TOOLS_PFX "block size %lu? not handing out buffers that big -- superblock on fire?\n", (unsigned long)bs);
+		return NULL;
+	}
+	bs = (bs + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+	
+	if (bp)
+	{
+		/* The block size shouldn't change under us, but if a
+		 * different superblock ever asks for bigger buffers, they
+		 * don't come off the list; and nothing smaller than the
+		 * first size ever goes on it. */
+		pthread_mutex_lock(&bp->lock);
+		if (!bp->bufsize)
+			bp->bufsize = bs;
+		if (bs < bp->bufsize)
+			bs = bp->bufsize;
+		if (bp->idle && (bs == bp->bufsize))
+		{
+			buf = bp->idle;
+			bp->idle = bp->idle->next;
+			bp->nidle--;
+		}
+		pthread_mutex_unlock(&bp->lock);
+		if (buf)
+			return buf;
+	}
+	
+	if (posix_memalign(&buf, BUFPOOL_ALIGN, bs) != 0)
+	{
+		perror("buf_borrow: posix_memalign");
+		return NULL;
+	}
+	return buf;
+}
+
+void buf_return(e3tools_t *e3t, uint8_t *buf)
+{
+	struct bufpool *bp = e3t->bufpool;
+	struct freeobj *f = (struct freeobj *)buf;
+	
+	if (!buf)
+		return;
+	if (bp)
+	{
+		pthread_mutex_lock(&bp->lock);
+		if (bp->nidle < BUFPOOL_MAX_IDLE)
+		{
+			f->next = bp->idle;
+			bp->idle = f;
+			bp->nidle++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&bp->lock);
+	}
+	free(buf);
+}
+
+/* One object of size bytes from slab; every allocation from a slab has to
+ * be the same size. */
+void *slab_alloc(e3tools_t *e3t, int slab, size_t size)
+{
+	struct bufpool *bp = e3t->bufpool;
+	struct slab *s;
+	void *obj;
+	
+	if (!bp)
+		return malloc(size);
+	s = &bp->slabs[slab];
+	
+	pthread_mutex_lock(&bp->lock);
+	if (!s->size)
+		s->size = (size < sizeof(struct freeobj)) ? sizeof(struct freeobj) : (size + 15) & ~(size_t)15;
+	if (s->free)
+	{
+		obj = s->free;
+		s->free = s->free->next;
+		pthread_mutex_unlock(&bp->lock);
+		return obj;
+	}
+	if (!s->chunk || (s->used + s->size > SLAB_CHUNK_BYTES))
+	{
+		if (s->nchunks == s->chunksalloc)
+		{
+			void **nc = realloc(s->chunks, (s->chunksalloc ? s->chunksalloc * 2 : 16) * sizeof(*nc));
+			
+			if (!nc)
+			{
+				pthread_mutex_unlock(&bp->lock);
+				return NULL;
+			}
+			s->chunks = nc;
+			s->chunksalloc = s->chunksalloc ? s->chunksalloc * 2 : 16;
+		}
+		s->chunk = malloc(SLAB_CHUNK_BYTES);
+		if (!s->chunk)
+		{
+			pthread_mutex_unlock(&bp->lock);
+			return NULL;
+		}
+		s->chunks[s->nchunks++] = s->chunk;
+		s->used = 0;
+	}
+	obj = s->chunk + s->used;
+	s->used += s->size;
+	pthread_mutex_unlock(&bp->lock);
+	return obj;
+}
+
+void slab_release(e3tools_t *e3t, int slab, void *obj)
+{
+	struct bufpool *bp = e3t->bufpool;
+	struct freeobj *f = obj;
+	
+	if (!obj)
+		return;
+	if (!bp)
+	{
+		free(obj);
+		return;
+	}
+	pthread_mutex_lock(&bp->lock);
+	f->next = bp->slabs[slab].free;
+	bp->slabs[slab].free = f;
+	pthread_mutex_unlock(&bp->lock);
+}
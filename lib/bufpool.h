@@ -0,0 +1,27 @@
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "e3tools.h"
+
+/* Block buffers start on this boundary, which is a whole number of cache
+ * lines and enough for O_DIRECT on any disk we're likely to meet. */
+#define BUFPOOL_ALIGN 4096
+
+/* What the slabs are for. */
+#define SLAB_IFILE 0		/* struct ifile */
+#define SLAB_COW 1		/* struct exception, the COW data */
+#define NSLABS 2
+
+struct bufpool;	// opaque; defined in bufpool.c
+
+extern int bufpool_init(e3tools_t *e3t);
+extern void bufpool_free(e3tools_t *e3t);
+extern uint8_t *buf_borrow(e3tools_t *e3t);
+extern void buf_return(e3tools_t *e3t, uint8_t *buf);
+extern void *slab_alloc(e3tools_t *e3t, int slab, size_t size);
+extern void slab_release(e3tools_t *e3t, int slab, void *obj);
+
+#endif
@@ -0,0 +1,176 @@
+// e3tools directory utilities
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "inode.h"
+#include "dir.h"
+#include "index.h"
+#include "bufpool.h"
+
+/* Follows the rec_len chain through a block, and returns how far it can be
+ * trusted: every record that starts before the returned offset has its
+ * header and name inside the block.  The final record is allowed to claim
+ * more than the block has left (DIR_BLOCK_OVERRUN), since its name can
+ * still be read; anything worse stops the chain before the bad record. */
+int dir_block_validate(const uint8_t *block, int len, int *status)
+{
+	int pos = 0;
+	
+	while (pos < len)
+	{
+		const struct ext3_dir_entry *rec = (const struct ext3_dir_entry *)(block + pos);
+		
+		if (pos + DIR_REC_HEADER > len)
+		{
+			*status = DIR_BLOCK_OVERRUN;
+			return pos;
+		}
+		if (rec->rec_len == 0)
+		{
+			*status = DIR_BLOCK_ZERO_RECLEN;
+			return pos;
+		}
+		if ((rec->rec_len < DIR_REC_HEADER) || (rec->rec_len % 4) ||
+		    (rec->name_len > rec->rec_len - DIR_REC_HEADER) ||
+		    (pos + DIR_REC_HEADER + rec->name_len > len))
+		{
+			*status = DIR_BLOCK_BADREC;
+			return pos;
+		}
+		if (pos + rec->rec_len > len)
+		{
+			*status = DIR_BLOCK_OVERRUN;
+			return pos + rec->rec_len;
+		}
+		pos += rec->rec_len;
+	}
+	
+	*status = DIR_BLOCK_OK;
+	return pos;
+}
+
+void dir_block_iter_init(struct dir_block_iter *it, const uint8_t *block, int len)
+{
+	it->block = block;
+	it->pos = 0;
+	it->end = dir_block_validate(block, len, &it->status);
+}
+
+int dir_block_iter_next(struct dir_block_iter *it, struct dirent_view *de)
+{
+	const struct ext3_dir_entry *rec;
+	
+	if (it->pos >= it->end)
+		return 0;
+	
+	rec = (const struct ext3_dir_entry *)(it->block + it->pos);
+	de->inode = rec->inode;
+	de->rec_len = rec->rec_len;
+	de->name_len = rec->name_len;
+	de->file_type = rec->file_type;
+	de->name = rec->name;
+	de->offset = it->pos;
+	it->pos += rec->rec_len;
+	
+	return 1;
+}
+
+struct dir {
+	e3tools_t *e3t;
+	struct ifile *ifp;
+	int ino;
+	uint8_t *block;
+	struct dir_block_iter it;
+};
+
+struct dir *dir_open(e3tools_t *e3t, int ino)
+{
+	struct dir *dp = malloc(sizeof(*dp));
+	
+	if (!dp)
+		return NULL;
+	
+	dp->block = buf_borrow(e3t);
+	dp->ifp = ifile_open(e3t, ino);
+	if (!dp->block || !dp->ifp)
+	{
+		if (dp->ifp)
+			ifile_close(dp->ifp);
+		buf_return(e3t, dp->block);
+		free(dp);
+		return NULL;
+	}
+	dp->e3t = e3t;
+	dp->ino = ino;
+	dp->it.pos = dp->it.end = 0;
+	
+	return dp;
+}
+
+/* Returns 1 and fills in de for each entry in turn, 0 at the end of the
+ * directory, or -1 if it couldn't be read.  Whatever follows a broken
+ * record in a block is skipped; the next block gets a fresh start. */
+int dir_next(struct dir *dp, struct dirent_view *de)
+{
+	int blklen;
+	
+	while (!dir_block_iter_next(&dp->it, de))
+	{
+		blklen = ifile_read(dp->ifp, (char *)dp->block, SB_BLOCK_SIZE(&dp->e3t->sb));
+		if (blklen < 0)
+		{
+			printf("dir_next: directory inode %d read failure -- inode on fire?\n", dp->ino);
+			return -1;
+		}
+		if (blklen == 0)
+			return 0;
+		dir_block_iter_init(&dp->it, dp->block, blklen);
+	}
+	
+	if (DIRENT_IS_DOTDOT(de))
+		index_note_parent(dp->e3t, dp->ino, de->inode);
+	return 1;
+}
+
+void dir_close(struct dir *dp)
+{
+	ifile_close(dp->ifp);
+	buf_return(dp->e3t, dp->block);
+	free(dp);
+}
+
+void dir_entry_print(struct dirent_view *de)
+{
+	char *type;
+	
+	if (de->file_type == 0)
+	{
+		printf("%d bytes padding\n", de->rec_len);
+		return;
+	}
+	
+	if (de->inode == 0)
+		printf("DELETED ");
+	
+	switch (de->file_type)
+	{
+	case 1: type = "FIL"; break;
+	case 2: type = "DIR"; break;
+	case 3: type = "CHR"; break;
+	case 4: type = "BLK"; break;
+	case 5: type = "FIF"; break;
+	case 6: type = "SCK"; break;
+	case 7: type = "SYM"; break;
+	default: type = "???"; break;
+	}
+	
+	printf("[%s@%d, %d] %.*s\n", type, de->inode, de->rec_len, de->name_len, de->name);
+}
@@ -0,0 +1,68 @@
+#ifndef _DIR_H
+#define _DIR_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+
+/* On-disk directory record (ext2_dir_entry_2); name_len bytes of name
+ * follow the header, with no terminator. */
+struct ext3_dir_entry {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+#define DIR_REC_HEADER 8
+
+#define DIR_FT_UNKNOWN 0
+#define DIR_FT_REG_FILE 1
+#define DIR_FT_DIR 2
+#define DIR_FT_SYMLINK 7
+
+/* A directory entry as the iterators hand it out.  name points straight
+ * into the caller's (or the struct dir's) block buffer, so it is only good
+ * for as long as that buffer is, and it is not NUL terminated. */
+struct dirent_view {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	const char *name;
+	int offset;		/* of the record within its block */
+};
+
+#define DIRENT_IS_DOT(de) (((de)->name_len == 1) && ((de)->name[0] == '.'))
+#define DIRENT_IS_DOTDOT(de) (((de)->name_len == 2) && ((de)->name[0] == '.') && ((de)->name[1] == '.'))
+
+/* Why a block's rec_len chain stopped where it did. */
+#define DIR_BLOCK_OK 0		/* ran exactly to the end of the block */
+#define DIR_BLOCK_ZERO_RECLEN 1	/* a record had rec_len 0 */
+#define DIR_BLOCK_OVERRUN 2	/* the last record ran off the end of the block */
+#define DIR_BLOCK_BADREC 3	/* a record was too short, unaligned, or had a name longer than itself */
+
+/* Walks the records of one directory block.  dir_block_iter_init() checks
+ * the whole rec_len/name_len chain up front; after that, handing out entries
+ * is just pointer arithmetic. */
+struct dir_block_iter {
+	const uint8_t *block;
+	int pos;
+	int end;		/* records starting before here are good to hand out */
+	int status;		/* DIR_BLOCK_*, describing what stopped the chain */
+};
+
+extern int dir_block_validate(const uint8_t *block, int len, int *status);
+extern void dir_block_iter_init(struct dir_block_iter *it, const uint8_t *block, int len);
+extern int dir_block_iter_next(struct dir_block_iter *it, struct dirent_view *de);
+
+/* Walks a whole directory, a block at a time. */
+struct dir;	// opaque; defined in dir.c
+
+extern struct dir *dir_open(e3tools_t *e3t, int ino);
+extern int dir_next(struct dir *dp, struct dirent_view *de);
+extern void dir_close(struct dir *dp);
+
+extern void dir_entry_print(struct dirent_view *de);
+
+#endif
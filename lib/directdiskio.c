@@ -0,0 +1,244 @@
+// e3tools "direct" disk I/O layer
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+/* Like the simple layer, but the disk is opened O_DIRECT, so that reading
+ * the whole of a big disk doesn't fill the page cache and push everything
+ * else on the box out of it.  The kernel won't do readahead for us either,
+ * so we keep a small window of our own.
+ *
+ * O_DIRECT wants the buffer, the offset and the length all to be multiples
+ * of the disk's logical block size.  A read that already is goes straight
+ * to the disk, a megabyte at a time.  The library's bulk readers allocate
+ * their buffers on BUFPOOL_ALIGN for this, and so do the scanner and the
+ * buffer pool.  Anything else is copied out of the window, which gets
+ * refilled from the aligned sector at or before where the read starts.
+ * Either way the only memory we hold is a window for each thread that
+ * reads, however big the disk is.
+ *
+ * Assumptions:
+ *  - Each thread gets a window of its own, so that threads whose reads
+ *    don't line up (everything, on a 1K-block filesystem) neither wait on
+ *    each other nor throw away each other's windows. */
+
+#define _GNU_SOURCE		/* for O_DIRECT */
+#include "diskio.h"		/* first, so its _LARGEFILE64_SOURCE goes in before glibc's */
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "bufpool.h"
+
+#define DIRECT_CHUNK_BYTES (1024 * 1024)	/* most we ask for at once */
+#define DIRECT_WINDOW_BYTES (128 * 1024)
+
+struct window {
+	uint8_t *buf;
+	sector_t start;		/* first sector in the window ... */
+	int len;		/* ... and how many of them are good */
+};
+
+struct directdiskio {
+	diskio_t ops;
+	int diskfd;
+	int align;		/* bytes; a power of two, and whole sectors */
+	int wsize;		/* bytes in each window */
+	pthread_key_t window;	/* this thread's struct window */
+};
+
+static diskio_t *_open(char *str);
+static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf);
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf);
+static int _close(diskio_t *disk);
+static int _lame_sector(diskio_t *disk, sector_t s);
+static void _window_free(void *arg);
+
+diskio_t directdisk_ops = {
+	.open = _open,
+	.read_sector = _read_sector,
+	.read_sectors = _read_sectors,
+	.close = _close,
+	.lame_sector = _lame_sector,
+};
+
+static diskio_t *_open(char *str)
+{
+	struct directdiskio *dd;
+	int ssz;
+	
+	if (strncmp("direct:", str, 7))
+		return NULL;	/* Didn't match */
+	
+	dd = malloc(sizeof(*dd));
+	if (!dd)
+		return NULL;
+	
+	memcpy(&dd->ops, &directdisk_ops, sizeof(diskio_t));
+	dd->diskfd = open(str + 7, O_RDONLY | O_DIRECT);
+	if (dd->diskfd == -1)
+	{
+		perror("directdisk_open: open");
+		free(dd);
+		return NULL;
+	}
+	
+	/* A page is enough for most disks; a 4k-sector disk says so, and if
+	 * there's ever one with bigger sectors, it'll say that too.  Files
+	 * don't answer, and get the page. */
+	dd->align = BUFPOOL_ALIGN;
+	if ((ioctl(dd->diskfd, BLKSSZGET, &ssz) == 0) && (ssz > dd->align) && !(ssz & (ssz - 1)))
+		dd->align = ssz;
+	
+	dd->wsize = (DIRECT_WINDOW_BYTES > dd->align) ? DIRECT_WINDOW_BYTES : dd->align;
+	if (pthread_key_create(&dd->window, _window_free) != 0)
+	{
+		perror("directdisk_open: pthread_key_create");
+		close(dd->diskfd);
+		free(dd);
+		return NULL;
+	}
+	
+	return (diskio_t *)dd;
+}
+
+/* This thread's window, made the first time it needs one. */
+static struct window *_window(struct directdiskio *dd)
+{
+	struct window *w = pthread_getspecific(dd->window);
+	
+	if (w)
+		return w;
+	w = malloc(sizeof(*w));
+	if (!w)
+		return NULL;
+	if (posix_memalign((void **)&w->buf, dd->align, dd->wsize) != 0)
+	{
+		free(w);
+		return NULL;
+	}
+	w->start = 0;
+	w->len = 0;
+	if (pthread_setspecific(dd->window, w) != 0)
+	{
+		_window_free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static void _window_free(void *arg)
+{
+	struct window *w = arg;
+	
+	free(w->buf);
+	free(w);
+}
+
+/* Reads len bytes at ofs straight into buf, all three of which are aligned.
+ * Returns how many bytes came back, which is short only at the end of the
+ * disk, or -1. */
+static ssize_t _pread_direct(struct directdiskio *dd, uint8_t *buf, ssize_t len, off64_t ofs)
+{
+	ssize_t done = 0;
+	ssize_t rv;
+	
+	while (done < len)
+	{
+		rv = pread64(dd->diskfd, buf + done, (len - done > DIRECT_CHUNK_BYTES) ? DIRECT_CHUNK_BYTES : len - done, ofs + done);
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rv == 0)
+			break;
+		done += rv;
+		if (rv % dd->align)
+			break;	/* a short read means the end */
+	}
+	return done;
+}
+
+/* Makes sure that sector s is in the window. */
+static int _fill_window(struct directdiskio *dd, struct window *w, sector_t s)
+{
+	sector_t spa = dd->align / BYTES_PER_SECTOR;
+	ssize_t rv;
+	
+	if ((s >= w->start) && (s < w->start + w->len))
+		return 0;
+	
+	w->start = s - (s % spa);
+	w->len = 0;
+	rv = _pread_direct(dd, w->buf, dd->wsize, w->start * BYTES_PER_SECTOR);
+	if (rv < 0)
+		return -1;
+	w->len = rv / BYTES_PER_SECTOR;
+	
+	return (s < w->start + w->len) ? 0 : -1;
+}
+
+static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf)
+{
+	return _read_sectors(disk, s, 1, buf);
+}
+
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf)
+{
+	struct directdiskio *dd = (struct directdiskio *)disk;
+	sector_t spa = dd->align / BYTES_PER_SECTOR;
+	ssize_t len = n * BYTES_PER_SECTOR;
+	struct window *w;
+	int k;
+	
+	if (!(s % spa) && !(n % spa) && !((uintptr_t)buf & (dd->align - 1)))
+		return (_pread_direct(dd, buf, len, s * BYTES_PER_SECTOR) == len) ? 0 : -1;
+	
+	w = _window(dd);
+	if (!w)
+		return -1;
+	while (n > 0)
+	{
+		if (_fill_window(dd, w, s) < 0)
+			return -1;
+		k = w->start + w->len - s;
+		if (k > n)
+			k = n;
+		memcpy(buf, w->buf + (s - w->start) * BYTES_PER_SECTOR, k * BYTES_PER_SECTOR);
+		s += k;
+		n -= k;
+		buf += k * BYTES_PER_SECTOR;
+	}
+	
+	return 0;
+}
+
+static int _close(diskio_t *disk)
+{
+	struct directdiskio *dd = (struct directdiskio *)disk;
+	struct window *w = pthread_getspecific(dd->window);
+	
+	/* Other threads' windows went when they exited; this one's is
+	 * still here. */
+	if (w)
+		_window_free(w);
+	pthread_key_delete(dd->window);
+	close(dd->diskfd);
+	free(dd);
+	return 0;
+}
+
+static int _lame_sector(diskio_t *disk, sector_t s)
+{
+	(void) disk;
+	(void) s;
+	return -1;
+}
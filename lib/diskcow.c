@@ -15,6 +15,7 @@
 #include "e3tools.h"
 #include "diskcow.h"
 #include "diskio.h"
+#include "bufpool.h"
 
 struct exception {
 	sector_t sector;
@@ -41,13 +42,13 @@ int diskcow_import(e3tools_t *e3t, char *fname)
 	{
 		if (exn == NULL)
 		{
-			exn = e3t->exceptions = malloc(sizeof(*exn));
+			exn = e3t->exceptions = slab_alloc(e3t, SLAB_COW, sizeof(*exn));
 			if (!exn)
 				return -1;
 			exn->next = NULL;
 		} else {
-			exn->next = malloc(sizeof(*exn));
-			if (!exn)
+			exn->next = slab_alloc(e3t, SLAB_COW, sizeof(*exn));
+			if (!exn->next)
 				return -1;
 			exn = exn->next;
 			exn->next = NULL;
@@ -76,36 +77,97 @@ int diskcow_read(e3tools_t *e3t, sector_t s, uint8_t *buf)
 	return 0;
 }
 
+/* Lays whatever exceptions fall in sectors [s, s + n) over buf, which
+ * holds those sectors as read from the disk, in one walk of the list.
+ * Returns how many it found. */
+int diskcow_read_range(e3tools_t *e3t, sector_t s, int n, uint8_t *buf)
+{
+	struct exception *exn;
+	int found = 0;
+	
+	for (exn = e3t->exceptions; exn && (exn->sector < s); exn = exn->next)
+		;
+	
+	for (; exn && (exn->sector < s + n); exn = exn->next)
+	{
+		memcpy(buf + (exn->sector - s) * BYTES_PER_SECTOR, exn->data, BYTES_PER_SECTOR);
+		found++;
+	}
+	return found;
+}
+
 int diskcow_write(e3tools_t *e3t, sector_t s, uint8_t *buf)
 {
-	struct exception *exn, *exnp;
+	return diskcow_write_batch(e3t, &s, 1, buf);
+}
 
-	exn = malloc(sizeof(*exn));
-	if (!exn)
-		return -1;
+/* Writes n sectors, sectors[i] getting the i'th BYTES_PER_SECTOR of buf,
+ * in one merge into the list; sectors must be in ascending order.  It all
+ * goes in or none of it does: every exception that might be needed is
+ * allocated before the list is touched. */
+int diskcow_write_batch(e3tools_t *e3t, const sector_t *sectors, int n, uint8_t *buf)
+{
+	struct exception *spare = NULL, *exn, **pp;
+	int i;
 	
-	for (exnp = e3t->exceptions; exnp && (exnp->sector != s) && exnp->next && (exnp->next->sector < s); exnp = exnp->next)
-		;
-		
-	if (!e3t->exceptions)
+	for (i = 0; i < n; i++)
 	{
-		e3t->exceptions = exn;
-		exn->next = NULL;
-	} else if (exnp->sector == s) {
-		free(exn);	// No linked list update needed.
-		memcpy(exnp->data, buf, BYTES_PER_SECTOR);
-		return 0;
-	} else {
-		exn->next = exnp->next;
-		exnp->next = exn;
+		exn = slab_alloc(e3t, SLAB_COW, sizeof(*exn));
+		if (!exn)
+		{
+			for (; spare; spare = exn)
+			{
+				exn = spare->next;
+				slab_release(e3t, SLAB_COW, spare);
+			}
+			return -1;
+		}
+		exn->next = spare;
+		spare = exn;
 	}
 	
-	memcpy(exn->data, buf, BYTES_PER_SECTOR);
-	exn->sector = s;
-
+	pp = &e3t->exceptions;
+	for (i = 0; i < n; i++)
+	{
+		while (*pp && ((*pp)->sector < sectors[i]))
+			pp = &(*pp)->next;
+		if (!*pp || ((*pp)->sector != sectors[i]))
+		{
+			exn = spare;
+			spare = spare->next;
+			exn->sector = sectors[i];
+			exn->next = *pp;
+			*pp = exn;
+		}
+		memcpy((*pp)->data, buf + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+	}
+	
+	for (; spare; spare = exn)	/* Some overwrote sectors we already had. */
+	{
+		exn = spare->next;
+		slab_release(e3t, SLAB_COW, spare);
+	}
 	return 0;
 }
 
+/* A fingerprint of the COW data, so that things worked out from it can
+ * tell whether it has changed since. */
+uint64_t diskcow_digest(e3tools_t *e3t)
+{
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	struct exception *exn;
+	int i;
+	
+	for (exn = e3t->exceptions; exn; exn = exn->next)
+	{
+		for (i = 0; i < (int)sizeof(exn->sector); i++)
+			h = (h ^ ((uint8_t *)&exn->sector)[i]) * 1099511628211ULL;
+		for (i = 0; i < BYTES_PER_SECTOR; i++)
+			h = (h ^ exn->data[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
 int diskcow_export(e3tools_t *e3t, char *fname)
 {
 	int i = 0;
@@ -116,7 +178,7 @@ int diskcow_export(e3tools_t *e3t, char *fname)
 		i++;
 	
 	if (i > 0)
-		printf("%d dirty sectors, comprising %lld bytes\n", i, i*BYTES_PER_SECTOR);
+		E3DEBUG(E3TOOLS_PFX "%d dirty sectors, comprising %lld bytes\n", i, i*BYTES_PER_SECTOR);
 	
 	if (!fname)
 		return 0;
@@ -7,7 +7,10 @@ struct exception;
 
 extern int diskcow_import(e3tools_t *e3t, char *fname);
 extern int diskcow_read(e3tools_t *e3t, sector_t s, uint8_t *buf);
+extern int diskcow_read_range(e3tools_t *e3t, sector_t s, int n, uint8_t *buf);
 extern int diskcow_write(e3tools_t *e3t, sector_t s, uint8_t *buf);
+extern int diskcow_write_batch(e3tools_t *e3t, const sector_t *sectors, int n, uint8_t *buf);
 extern int diskcow_export(e3tools_t *e3t, char *fname);
+extern uint64_t diskcow_digest(e3tools_t *e3t);
 
 #endif
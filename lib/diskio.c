@@ -32,11 +32,14 @@
 #include "superblock.h"
 #include "blockgroup.h"
 #include "diskcow.h"
+#include "journal.h"
+#include "index.h"
 
-extern diskio_t raiddisk_ops, simpledisk_ops;
+extern diskio_t raiddisk_ops, directdisk_ops, simpledisk_ops;
 
 static diskio_t *mechanisms[] = {
         &raiddisk_ops,
+	&directdisk_ops,
 	&simpledisk_ops,
 	NULL
 };
@@ -60,16 +63,33 @@ int disk_read_sector(e3tools_t *e3t, sector_t s, uint8_t *buf)
 	if (diskcow_read(e3t, s, buf))
 		return 0;
 	
+	if (journal_read_sector(e3t, s, buf))
+		return 0;
+	
 	return e3t->disk->read_sector(e3t->disk, s, buf);
 }
 
-int disk_read_block(e3tools_t *e3t, block_t b, uint8_t *buf)
+/* Reads n sectors starting at s.  If the mechanism can do ranges, the
+ * whole thing goes to it at once, and the journal's and then the COW data
+ * get laid over the top afterwards; if it can't, or the range read fails, we go a sector at a
+ * time, so that a bad sector that the COW file covers doesn't matter. */
+int disk_read_sectors(e3tools_t *e3t, sector_t s, int n, uint8_t *buf)
 {
 	int i;
-	sector_t s;
 	
-	s = ((sector_t)b) * ((sector_t)SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR);
-	for (i = 0; i < (SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR); i++)
+	if (e3t->disk->read_sectors)
+	{
+		if (e3t->debug & E3TOOLS_DBG_DISKIO)
+			E3DEBUG(E3TOOLS_PFX "sector read from %lld (%d sectors)\n", (long long int)s, n);
+		if (e3t->disk->read_sectors(e3t->disk, s, n, buf) == 0)
+		{
+			journal_read_range(e3t, s, n, buf);
+			diskcow_read_range(e3t, s, n, buf);
+			return 0;
+		}
+	}
+	
+	for (i = 0; i < n; i++)
 	{
 		if (disk_read_sector(e3t, s, buf) < 0)
 			return -1;
@@ -79,12 +99,38 @@ int disk_read_block(e3tools_t *e3t, block_t b, uint8_t *buf)
 	return 0;
 }
 
+int disk_read_block(e3tools_t *e3t, block_t b, uint8_t *buf)
+{
+	return disk_read_blocks(e3t, b, 1, buf);
+}
+
+int disk_read_blocks(e3tools_t *e3t, block_t b, int n, uint8_t *buf)
+{
+	sector_t spb = SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR;
+	
+	return disk_read_sectors(e3t, ((sector_t)b) * spb, n * spb, buf);
+}
+
 int disk_write_sector(e3tools_t *e3t, sector_t s, uint8_t *buf)
 {
+	return disk_write_sectors(e3t, &s, 1, buf);
+}
+
+/* Writes a batch of sectors, which need not be contiguous but must be in
+ * ascending order, to the COW store as one transaction. */
+int disk_write_sectors(e3tools_t *e3t, const sector_t *sectors, int n, uint8_t *buf)
+{
+	int i;
+	
 	if (e3t->debug & E3TOOLS_DBG_DISKIO)
-		E3DEBUG(E3TOOLS_PFX "sector write to %lld\n", s);
+		for (i = 0; i < n; i++)
+			E3DEBUG(E3TOOLS_PFX "sector write to %lld\n", (long long int)sectors[i]);
+	
+	/* Whatever we've remembered might be what's being written over. */
+	block_group_desc_table_written(e3t, sectors, n, buf);
+	index_invalidate(e3t);
 	
-	return diskcow_write(e3t, s, buf);
+	return diskcow_write_batch(e3t, sectors, n, buf);
 }
 
 int disk_close(e3tools_t *e3t)
@@ -18,14 +18,18 @@ typedef uint64_t sector_t;
 #include "blockgroup.h"
 
 extern int disk_read_sector(e3tools_t *e3t, sector_t s, uint8_t *buf);
+extern int disk_read_sectors(e3tools_t *e3t, sector_t s, int n, uint8_t *buf);
 extern int disk_read_block(e3tools_t *e3t, block_t b, uint8_t *buf);
+extern int disk_read_blocks(e3tools_t *e3t, block_t b, int n, uint8_t *buf);
 extern int disk_write_sector(e3tools_t *e3t, sector_t s, uint8_t *buf);
+extern int disk_write_sectors(e3tools_t *e3t, const sector_t *sectors, int n, uint8_t *buf);
 extern int disk_lame_sector(e3tools_t *e3t, sector_t s);
 extern int disk_close(e3tools_t *e3t);
 
 struct diskio {
 	diskio_t *(*open)(char *str);
 	int (*read_sector)(diskio_t *disk, sector_t s, uint8_t *buf);
+	int (*read_sectors)(diskio_t *disk, sector_t s, int n, uint8_t *buf);	/* Optional; reads n sectors in as few requests as it can. */
 	int (*close)(diskio_t *disk);
 	int (*lame_sector)(diskio_t *disk, sector_t bad);	/* Marks a sector as being lame. Returns -1 if no further good will come of retrying, >= 0 if another attempt should be made. */
 };
@@ -1,52 +1,70 @@
 #ifndef _E3BITS_H
 #define _E3BITS_H
 
-static inline int __ispow(int n, int p)
+#include "superblock.h"
+#include "blockgroup.h"
+
+/* Is n a power of p?  (1 counts, being p to the 0th.) */
+static inline int __ispow(uint64_t n, int p)
+{
+	while ((n % p) == 0)
+		n /= p;
+	return n == 1;
+}
+
+static inline int e3_block_group_has_sb(struct ext2_super_block *sb, uint64_t bg)
 {
-	if (n == 1)
+	if (!(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+	if (bg <= 1)
 		return 1;
-	if (n % p)
+	if (!(bg & 1))	/* Powers of 3, 5 and 7 are all odd. */
 		return 0;
-	return __ispow(n / p, p);
+	return __ispow(bg, 3) || __ispow(bg, 5) || __ispow(bg, 7);
 }
 
-static inline int e3_sb_blocks(struct ext2_super_block *sb)
+/* Number of blocks that the whole group descriptor table takes up. */
+static inline block_t e3_gdt_blocks(struct ext2_super_block *sb)
 {
-	int bgs = sb->s_blocks_count / sb->s_blocks_per_group;
-	if (sb->s_blocks_count % sb->s_blocks_per_group)
-		bgs++;
-	int bytes_per_block = 1024 << sb->s_log_block_size;
-	int bgblocks = sizeof(struct ext2_group_desc) * (bgs) / bytes_per_block;
-	if (sizeof(struct ext2_group_desc) * (bgs) % bytes_per_block)
-		bgblocks++;
-	return 1 /* Superblock */ + /*bgblocks*/ 0x400 /* wtf? */;
+	uint64_t bytes = SB_DESC_SIZE(sb) * SB_GROUPS(sb);
+	return (bytes + SB_BLOCK_SIZE(sb) - 1) / SB_BLOCK_SIZE(sb);
 }
 
-static inline int e3_block_group_has_sb(struct ext2_super_block *sb, int bg)
+static inline int e3_block_is_in_block_group(struct ext2_super_block *sb, block_t block, int bg)
 {
-	if (!(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
-		return 1;
-	return (bg == 0) || (bg == 1) || __ispow(bg, 3) || __ispow(bg, 5) || __ispow(bg, 7);
+	return (block >= sb->s_first_data_block) &&
+	       ((block - sb->s_first_data_block) / sb->s_blocks_per_group) == U64(bg);
 }
 
-static inline int e3_block_is_in_block_group(struct ext2_super_block *sb, int block, int bg)
+/* With flex_bg, a group's bitmaps and inode table can live anywhere in
+ * its flex group, not just in the group itself. */
+static inline int e3_block_is_plausible_for_group(e3tools_t *e3t, block_t block, int bg)
 {
-	return (block / sb->s_blocks_per_group) == bg;
+	struct ext2_super_block *sb = &e3t->sb;
+	int flexsz;
+	
+	if (!(sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_FLEX_BG) || (SB_LOG_GROUPS_PER_FLEX(sb) >= 31))
+		return e3_block_is_in_block_group(sb, block, bg);
+	flexsz = 1 << SB_LOG_GROUPS_PER_FLEX(sb);
+	return (block >= sb->s_first_data_block) &&
+	       ((block - sb->s_first_data_block) / sb->s_blocks_per_group / flexsz) == U64(bg / flexsz);
 }
 
-static inline int e3_block_group_expected_block_bitmap(struct ext2_super_block *sb, int bg)
+/* The rest come out of the geometry table that block_group_geometry_init
+ * builds. */
+static inline block_t e3_block_group_expected_block_bitmap(e3tools_t *e3t, int bg)
 {
-	return bg * sb->s_blocks_per_group + (e3_block_group_has_sb(sb, bg) ? e3_sb_blocks(sb) : 0);
+	return e3t->geom[bg].block_bitmap;
 }
 
-static inline int e3_block_group_expected_inode_bitmap(struct ext2_super_block *sb, int bg)
+static inline block_t e3_block_group_expected_inode_bitmap(e3tools_t *e3t, int bg)
 {
-	return e3_block_group_expected_block_bitmap(sb, bg) + 1;
+	return e3t->geom[bg].inode_bitmap;
 }
 
-static inline int e3_block_group_expected_inode_table(struct ext2_super_block *sb, int bg)
+static inline block_t e3_block_group_expected_inode_table(e3tools_t *e3t, int bg)
 {
-	return e3_block_group_expected_block_bitmap(sb, bg) + 2;
+	return e3t->geom[bg].inode_table;
 }
 
 #endif
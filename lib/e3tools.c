@@ -15,6 +15,11 @@
 
 #include "e3tools.h"
 #include "diskio.h"
+#include "namei.h"
+#include "journal.h"
+#include "index.h"
+#include "ipath.h"
+#include "bufpool.h"
 
 static void _eat(int arg, int *argc, char ***argv)
 {
@@ -28,11 +33,23 @@ int e3tools_init(e3tools_t *e3t, int *argc, char ***argv)
 	/* XXX Leaks memory on failure. */
 	sector_t sbsector = 2;
 	char *diskdesc = strdup("recover");
+	char *indexfile = NULL;
 	sector_t *lames = NULL;
 	int sz = 0, allocsz = 0;
+	int consensus = 0;
+	int journal = 0;
 	
 	e3t->exceptions = NULL;
 	e3t->cowfile = NULL;
+	(void) bufpool_init(e3t);	/* Failure is OK; buffers just come from malloc */
+	e3t->geom = NULL;
+	e3t->ngroups = 0;
+	e3t->dcache = NULL;
+	e3t->gdt = NULL;
+	e3t->index = NULL;
+	e3t->ipath = NULL;
+	e3t->consensus = 0;
+	e3t->journal = NULL;
 	e3t->debug = 0;
 	
 	/* I do not like this 'nomming options' thing, since it means I have
@@ -93,6 +110,22 @@ int e3tools_init(e3tools_t *e3t, int *argc, char ***argv)
 				lames[sz] = s;
 				sz++;
 				_eat(arg, argc, argv);
+			} else if (!strcmp((*argv)[arg], "--index")) {
+				_eat(arg, argc, argv);
+				if (arg == *argc)
+				{
+					E3DEBUG(E3TOOLS_PFX "--index requires a parameter!\n");
+					return -1;
+				}
+				free(indexfile);
+				indexfile = strdup((*argv)[arg]);
+				_eat(arg, argc, argv);
+			} else if (!strcmp((*argv)[arg], "--journal")) {
+				journal = 1;
+				_eat(arg, argc, argv);
+			} else if (!strcmp((*argv)[arg], "--consensus")) {
+				consensus = 1;
+				_eat(arg, argc, argv);
 			} else if (!strcmp((*argv)[arg], "--debug-diskio")) {
 				e3t->debug |= E3TOOLS_DBG_DISKIO;
 				_eat(arg, argc, argv);
@@ -116,7 +149,6 @@ int e3tools_init(e3tools_t *e3t, int *argc, char ***argv)
 		for (i = 0; i < sz; i++)
 			disk_lame_sector(e3t, lames[i]);
 	}
-	free(lames);
 	
 	E3DEBUG(E3TOOLS_PFX "Reading superblock from sector %lld.\n", (long long int)sbsector);
 	if (disk_read_sector(e3t, sbsector, (uint8_t*)&e3t->sb) < 0)
@@ -125,6 +157,38 @@ int e3tools_init(e3tools_t *e3t, int *argc, char ***argv)
 		return -1;
 	}
 	
+	(void) block_group_geometry_init(e3t);	/* Failure is OK; e3showsb still wants to run */
+	
+	if (consensus)
+		(void) superblock_consensus(e3t);	/* Failure leaves us with the one we read */
+	
+	/* Once the journal is in place, everything read so far might have a
+	 * newer copy in it -- the superblock included, unless the backups
+	 * already voted on it. */
+	if (journal && (journal_open(e3t) == 0) && !e3t->consensus)
+	{
+		block_group_desc_table_invalidate(e3t);
+		if (disk_read_sector(e3t, sbsector, (uint8_t*)&e3t->sb) < 0)
+		{
+			perror("disk_read_sector(sbsector)");
+			return -1;
+		}
+		(void) block_group_geometry_init(e3t);
+	}
+	
+	/* The index goes with the COW data it was made from, unless we're
+	 * told to put it somewhere else. */
+	if (!indexfile && e3t->cowfile)
+	{
+		indexfile = malloc(strlen(e3t->cowfile) + 7);
+		if (indexfile)
+			sprintf(indexfile, "%s.index", e3t->cowfile);
+	}
+	if (indexfile)
+		(void) index_open(e3t, indexfile, lames, sz);	/* Failure is OK; we just do it the slow way */
+	free(indexfile);
+	free(lames);
+	
 	free(diskdesc);
 	
 	return 0;
@@ -137,8 +201,13 @@ void e3tools_usage()
 	printf("          -n <sector>\n");
 	printf("--cowfile <file> gives a file to read in COW data from and save out COW data to\n");
 	printf("--disk <mechanism> gives a mechanism by which to read a disk -- i.e., 'simple:recover' to read from a file called 'recover'.  This is the default.\n");
+	printf("          'direct:<file>' reads it with O_DIRECT, which keeps a whole-disk scan out of the page cache\n");
 	printf("--debug-diskio enables prints on every disk access\n");
 	printf("--lame <sector> marks a sector as lame (can be specified multiple times)\n");
+	printf("--journal reads committed metadata from the journal that never made it to its home on disk\n");
+	printf("--consensus reads every backup superblock and descriptor table, and goes with what most of them say\n");
+	printf("--index <file> keeps what one run works out about the filesystem in a file, for the next run to use\n");
+	printf("          (with --cowfile, it's kept in <cowfile>.index unless this says otherwise)\n");
 }
 
 void e3tools_close(e3tools_t *e3t)
@@ -147,4 +216,32 @@ void e3tools_close(e3tools_t *e3t)
 	diskcow_export(e3t, e3t->cowfile);
 	if (e3t->cowfile)
 		free(e3t->cowfile);
+	index_close(e3t);
+	ipath_free(e3t);
+	journal_close(e3t);
+	free(e3t->gdt);
+	free(e3t->geom);
+	dcache_free(e3t);
+	bufpool_free(e3t);	/* the COW data went with it */
+	e3t->exceptions = NULL;
+}
+
+/* Formats the 16 bytes at p, which came from byte addr of the disk, as
+ * one line of hex dump: the address, the bytes in hex, and again as text.
+ * The line ends in a newline and a NUL; returns its length without the
+ * NUL. */
+int e3tools_hexdump_line(char *line, uint64_t addr, const uint8_t *p)
+{
+	int i, n;
+	
+	n = snprintf(line, E3TOOLS_HEXDUMP_LINE, "%012llx ", (unsigned long long)addr);
+	for (i = 0; i < 16; i++)
+		n += snprintf(line + n, E3TOOLS_HEXDUMP_LINE - n, "%s%02x", (i == 8) ? "  " : " ", p[i]);
+	n += snprintf(line + n, E3TOOLS_HEXDUMP_LINE - n, "  |");
+	for (i = 0; i < 16; i++)
+		line[n++] = ((p[i] >= 0x20) && (p[i] < 0x7f)) ? p[i] : '.';
+	line[n++] = '|';
+	line[n++] = '\n';
+	line[n] = 0;
+	return n;
 }
@@ -20,6 +20,15 @@ struct e3tools {
 	struct exception *exceptions;
 	char *cowfile;
 	diskio_t *disk;
+	struct e3_group_geom *geom;	/* one per block group; NULL if the superblock made no sense */
+	int ngroups;
+	struct dcache *dcache;	/* see namei.c */
+	uint8_t *gdt;		/* the raw descriptor table, once something has wanted it */
+	struct e3index *index;	/* see index.c; --index, else <cowfile>.index; NULL with neither, or if it won't open */
+	struct ipath *ipath;	/* see ipath.c; NULL until something builds it */
+	struct bufpool *bufpool;	/* see bufpool.c; scratch blocks and small objects */
+	int consensus;		/* sb and gdt were voted on by all the copies (--consensus) */
+	struct e3journal *journal;	/* see journal.c; NULL without --journal */
 	unsigned long debug;
 };
 
@@ -27,4 +36,7 @@ extern int e3tools_init(e3tools_t *e3t, int *argc, char ***argv);
 extern void e3tools_usage();
 extern void e3tools_close(e3tools_t *e3t);
 
+#define E3TOOLS_HEXDUMP_LINE 96	/* room for one line of e3tools_hexdump_line() */
+extern int e3tools_hexdump_line(char *line, uint64_t addr, const uint8_t *p);
+
 #endif
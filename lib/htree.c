@@ -0,0 +1,382 @@
+// e3tools hash tree (dir_index) directory lookups
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+//
+// Useful resources:
+//  * linux/fs/ext3/hash.c and linux/fs/ext3/namei.c, for the hashes and the
+//    on-disk format of the index
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "inode.h"
+#include "dir.h"
+#include "htree.h"
+#include "bufpool.h"
+
+#define SB_FLAGS(sb) SB_FIELD(sb, uint32_t, 0x160)
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+/* Block 0 of an indexed directory: "." and ".." records (the latter
+ * covering the rest of the block, so that old code sees nothing else),
+ * then the index itself. */
+struct dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;	/* 8 */
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+};
+
+struct dx_entry {
+	uint32_t hash;		/* in entry 0, this is a struct dx_countlimit instead */
+	uint32_t block;		/* logical block of the directory */
+};
+
+struct dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+};
+
+#define DX_ROOT_ENTRIES_OFS (24 + sizeof(struct dx_root_info))
+#define DX_NODE_ENTRIES_OFS DIR_REC_HEADER
+#define DX_MAX_LEVELS 3
+
+/*** The hashes.  These have to match the kernel's bit for bit. ***/
+
+static void _str2hashbuf(const char *msg, int len, uint32_t *buf, int num, int unsig)
+{
+	uint32_t pad, val;
+	int i;
+	
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+	
+	val = pad;
+	if (len > num * 4)
+		len = num * 4;
+	for (i = 0; i < len; i++)
+	{
+		int c = unsig ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3)
+		{
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0)
+		*buf++ = val;
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+static void _half_md4_transform(uint32_t buf[4], const uint32_t in[8])
+{
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+	
+	ROUND(F, a, b, c, d, in[0] + K1,  3);
+	ROUND(F, d, a, b, c, in[1] + K1,  7);
+	ROUND(F, c, d, a, b, in[2] + K1, 11);
+	ROUND(F, b, c, d, a, in[3] + K1, 19);
+	ROUND(F, a, b, c, d, in[4] + K1,  3);
+	ROUND(F, d, a, b, c, in[5] + K1,  7);
+	ROUND(F, c, d, a, b, in[6] + K1, 11);
+	ROUND(F, b, c, d, a, in[7] + K1, 19);
+	
+	ROUND(G, a, b, c, d, in[1] + K2,  3);
+	ROUND(G, d, a, b, c, in[3] + K2,  5);
+	ROUND(G, c, d, a, b, in[5] + K2,  9);
+	ROUND(G, b, c, d, a, in[7] + K2, 13);
+	ROUND(G, a, b, c, d, in[0] + K2,  3);
+	ROUND(G, d, a, b, c, in[2] + K2,  5);
+	ROUND(G, c, d, a, b, in[4] + K2,  9);
+	ROUND(G, b, c, d, a, in[6] + K2, 13);
+	
+	ROUND(H, a, b, c, d, in[3] + K3,  3);
+	ROUND(H, d, a, b, c, in[7] + K3,  9);
+	ROUND(H, c, d, a, b, in[2] + K3, 11);
+	ROUND(H, b, c, d, a, in[6] + K3, 15);
+	ROUND(H, a, b, c, d, in[1] + K3,  3);
+	ROUND(H, d, a, b, c, in[5] + K3,  9);
+	ROUND(H, c, d, a, b, in[0] + K3, 11);
+	ROUND(H, b, c, d, a, in[4] + K3, 15);
+	
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void _tea_transform(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+	
+	do {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+	
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static uint32_t _legacy_hash(const char *name, int len, int unsig)
+{
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	
+	while (len--)
+	{
+		int c = unsig ? (int)(unsigned char)*name : (int)(signed char)*name;
+		name++;
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* Hashes a name the way that the directory's index did.  Returns -1 for a
+ * hash version that we don't know about. */
+int dx_hash(e3tools_t *e3t, int version, const char *name, int len, uint32_t *hash)
+{
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	int unsig = 0;
+	int i;
+	
+	for (i = 0; i < 4; i++)
+		if (e3t->sb.s_hash_seed[i])
+		{
+			memcpy(buf, e3t->sb.s_hash_seed, sizeof(buf));
+			break;
+		}
+	
+	if (version >= DX_HASH_LEGACY_UNSIGNED)
+	{
+		unsig = 1;
+		version -= DX_HASH_LEGACY_UNSIGNED;
+	}
+	
+	switch (version)
+	{
+	case DX_HASH_LEGACY:
+		*hash = _legacy_hash(name, len, unsig);
+		break;
+	case DX_HASH_HALF_MD4:
+		for (; len > 0; len -= 32, name += 32)
+		{
+			_str2hashbuf(name, len, in, 8, unsig);
+			_half_md4_transform(buf, in);
+		}
+		*hash = buf[1];
+		break;
+	case DX_HASH_TEA:
+		for (; len > 0; len -= 16, name += 16)
+		{
+			_str2hashbuf(name, len, in, 4, unsig);
+			_tea_transform(buf, in);
+		}
+		*hash = buf[0];
+		break;
+	default:
+		return -1;
+	}
+	
+	*hash &= ~1;
+	if (*hash == (0x7fffffffu << 1))	/* reserved for EOF */
+		*hash = (0x7fffffffu - 1) << 1;
+	return 0;
+}
+
+/*** The lookup. ***/
+
+struct dx_level {
+	uint8_t *block;
+	struct dx_entry *entries;
+	int count;
+	int at;			/* entry that we followed down */
+};
+
+static int _read_dir_block(struct ifile *ifp, e3tools_t *e3t, uint32_t lblk, uint8_t *buf)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	
+	if (ifile_seek(ifp, U64(lblk) * bs) < 0)
+		return -1;
+	return (ifile_read(ifp, (char *)buf, bs) == bs) ? 0 : -1;
+}
+
+/* Sanity checks an index node's count and limit, since everything after
+ * this trusts them. */
+static int _dx_node_ok(struct dx_entry *entries, int expect_limit)
+{
+	struct dx_countlimit *cl = (struct dx_countlimit *)entries;
+	
+	return (cl->limit == expect_limit) && (cl->count >= 1) && (cl->count <= cl->limit);
+}
+
+/* Reads interior node b of the tree into l->block and checks it: it has to
+ * be in the directory, look like one empty record covering the whole block
+ * (the fake dirent that hides it from a linear scan), and have a sane count
+ * and limit.  Returns 0 or -1. */
+static int _dx_node_read(struct ifile *ifp, e3tools_t *e3t, uint32_t b, uint32_t nblocks, struct dx_level *l)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	struct ext3_dir_entry *fake = (struct ext3_dir_entry *)l->block;
+	
+	if ((b >= nblocks) || (_read_dir_block(ifp, e3t, b, l->block) < 0))
+		return -1;
+	if ((fake->rec_len != bs) || (fake->inode != 0))
+		return -1;
+	l->entries = (struct dx_entry *)(l->block + DX_NODE_ENTRIES_OFS);
+	if (!_dx_node_ok(l->entries, (bs - DX_NODE_ENTRIES_OFS) / sizeof(struct dx_entry)))
+		return -1;
+	l->count = ((struct dx_countlimit *)l->entries)->count;
+	l->at = 0;
+	return 0;
+}
+
+/* Finds the last entry whose hash is at or below hash; entry 0 stands for
+ * everything below entry 1. */
+static int _dx_search(struct dx_entry *entries, int count, uint32_t hash)
+{
+	int lo = 1, hi = count;
+	
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (entries[mid].hash <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* Looks name up through the hash tree of directory dir, whose inode the
+ * caller has already fetched.  Returns the inode number, 0 if the index
+ * says that there is no such name, or -1 if the index can't be trusted and
+ * the caller should go and do a linear scan instead. */
+int htree_lookup(e3tools_t *e3t, int dir, struct ext2_inode *inode, const char *name, int len)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	uint32_t nblocks = INODE_FILE_SIZE(inode) / bs;
+	struct dx_level path[DX_MAX_LEVELS + 1];
+	struct dx_root_info *info;
+	struct ifile *ifp;
+	uint8_t *leaf;
+	uint32_t hash;
+	int version, levels, depth;
+	int rv = -1;
+	int i;
+	
+	if (!(inode->i_flags & INODE_INDEX_FL) || (nblocks < 2))
+		return -1;
+	
+	ifp = ifile_open(e3t, dir);
+	if (!ifp)
+		return -1;
+	memset(path, 0, sizeof(path));
+	leaf = buf_borrow(e3t);
+	if (!leaf)
+		goto out;
+	
+	path[0].block = buf_borrow(e3t);
+	if (!path[0].block || (_read_dir_block(ifp, e3t, 0, path[0].block) < 0))
+		goto out;
+	info = (struct dx_root_info *)(path[0].block + 24);
+	if ((info->reserved_zero != 0) || (info->info_length != 8) || (info->indirect_levels >= DX_MAX_LEVELS))
+		goto out;
+	
+	version = info->hash_version;
+	if ((version <= DX_HASH_TEA) && (SB_FLAGS(&e3t->sb) & EXT2_FLAGS_UNSIGNED_HASH))
+		version += DX_HASH_LEGACY_UNSIGNED;
+	if (dx_hash(e3t, version, name, len, &hash) < 0)
+		goto out;
+	
+	/* Down the tree... */
+	levels = info->indirect_levels;
+	path[0].entries = (struct dx_entry *)(path[0].block + DX_ROOT_ENTRIES_OFS);
+	if (!_dx_node_ok(path[0].entries, (bs - DX_ROOT_ENTRIES_OFS) / sizeof(struct dx_entry)))
+		goto out;
+	for (depth = 0; ; depth++)
+	{
+		struct dx_level *l = &path[depth];
+		
+		l->count = ((struct dx_countlimit *)l->entries)->count;
+		l->at = _dx_search(l->entries, l->count, hash);
+		if ((l->entries[l->at].block & 0x0FFFFFFF) >= nblocks)
+			goto out;
+		if (depth == levels)
+			break;
+		
+		path[depth + 1].block = buf_borrow(e3t);
+		if (!path[depth + 1].block ||
+		    (_dx_node_read(ifp, e3t, l->entries[l->at].block & 0x0FFFFFFF, nblocks, &path[depth + 1]) < 0))
+			goto out;
+	}
+	
+	/* ... and along the leaves, for as long as hash collisions carry on
+	 * into the next one. */
+	for (;;)
+	{
+		struct dir_block_iter it;
+		struct dirent_view de;
+		
+		if (((path[levels].entries[path[levels].at].block & 0x0FFFFFFF) >= nblocks) ||
+		    (_read_dir_block(ifp, e3t, path[levels].entries[path[levels].at].block & 0x0FFFFFFF, leaf) < 0))
+			goto out;
+		dir_block_iter_init(&it, leaf, bs);
+		if (it.status == DIR_BLOCK_BADREC)
+			goto out;
+		while (dir_block_iter_next(&it, &de))
+			if (de.inode && (de.name_len == len) && !memcmp(de.name, name, len))
+			{
+				rv = de.inode;
+				goto out;
+			}
+		
+		/* Step to the next leaf, climbing as far as we need to; every
+		 * node on the way back down gets the same checks as on the way
+		 * down from the root. */
+		for (i = levels; (i >= 0) && (path[i].at + 1 >= path[i].count); i--)
+			;
+		if ((i < 0) || ((path[i].entries[path[i].at + 1].hash & ~1) != hash))
+			break;
+		path[i].at++;
+		for (; i < levels; i++)
+			if (_dx_node_read(ifp, e3t, path[i].entries[path[i].at].block & 0x0FFFFFFF, nblocks, &path[i + 1]) < 0)
+				goto out;
+	}
+	rv = 0;
+
+out:
+	for (i = 0; i <= DX_MAX_LEVELS; i++)
+		buf_return(e3t, path[i].block);
+	buf_return(e3t, leaf);
+	ifile_close(ifp);
+	return rv;
+}
@@ -0,0 +1,20 @@
+#ifndef _HTREE_H
+#define _HTREE_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+
+#define INODE_INDEX_FL 0x00001000	/* directory has a hash tree index */
+
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+
+extern int dx_hash(e3tools_t *e3t, int version, const char *name, int len, uint32_t *hash);
+extern int htree_lookup(e3tools_t *e3t, int dir, struct ext2_inode *inode, const char *name, int len);
+
+#endif
@@ -0,0 +1,500 @@
+// e3tools persistent metadata index
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "e3tools.h"
+#include "diskio.h"
+#include "diskcow.h"
+#include "journal.h"
+#include "ipath.h"
+#include "index.h"
+
+/* Every tool run starts from nothing, and on a big volume, working out the
+ * same things over again -- reading the descriptor table, scanning inode
+ * tables, finding out which directory is whose parent -- is most of what a
+ * short run spends its time on.  --index <file> keeps those answers in a
+ * file between runs.
+ *
+ * The file is only believed if it was made from the same superblock (its
+ * UUID, and a digest of the whole sector, so that a remount or an
+ * alternative superblock doesn't match), the same COW data and the same
+ * lame sectors, since those change what reads come back with.  If
+ * anything doesn't match, we start it over.  If this run writes to the COW
+ * data, what we have learned might not be true any more, so from then on
+ * we neither answer from the file nor save it.
+ *
+ * The layout is a header followed by sections at 8-byte aligned offsets:
+ * the raw descriptor table, an ok/bogus count pair per group from
+ * inode_table_check(), (directory, parent) pairs sorted by directory,
+ * which we binary search where they sit in the mapping rather than
+ * reading them all in, and, once something has built it, the path index
+ * from ipath.c: its per-inode table and its names, used straight out of
+ * the mapping too. */
+
+#define INDEX_MAGIC "e3index"
+#define INDEX_VERSION 2
+
+#define INDEX_HAVE_GDT 0x1
+#define INDEX_HAVE_NAMES 0x2
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t ngroups;
+	uint8_t uuid[16];
+	uint64_t sbdigest;
+	uint64_t cowdigest;
+	uint32_t descsz;
+	uint32_t flags;
+	uint64_t gdt_off;
+	uint64_t itcheck_off;
+	uint64_t parents_off;
+	uint64_t nparents;
+	uint64_t names_off;
+	uint64_t nnames;
+	uint64_t arena_off;
+	uint64_t arenalen;
+};
+
+struct index_itcheck {
+	int32_t ok;		/* -1 if the group hasn't been scanned */
+	int32_t bogus;
+};
+
+struct index_parent {
+	uint32_t dir;
+	uint32_t parent;
+};
+
+struct e3index {
+	char *fname;
+	struct index_header hdr;
+	uint8_t *map;		/* the old file, if it matched */
+	size_t maplen;
+	const uint8_t *oldgdt;
+	const struct index_parent *oldparents;
+	uint64_t noldparents;
+	const struct ipath_entry *oldnames;	/* NULL if the old file had no path index */
+	const uint8_t *oldarena;
+	uint64_t noldnames, oldarenalen;
+	struct index_itcheck *itcheck;
+	struct index_parent *newparents;	/* open addressing on dir; dir 0 is empty */
+	uint32_t nnew;
+	uint32_t newalloc;	/* always a power of two */
+	pthread_mutex_t lock;
+	int dirty;
+	int stale;
+};
+
+static uint64_t _fnv64(uint64_t h, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	size_t i;
+	
+	for (i = 0; i < len; i++)
+	{
+		h ^= b[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+#define FNV64_INIT 14695981039346656037ULL
+
+int index_open(e3tools_t *e3t, const char *fname, const sector_t *lames, int nlames)
+{
+	struct e3index *ix;
+	struct index_header *old;
+	struct stat st;
+	uint32_t i;
+	int fd;
+	
+	if (!e3t->geom)
+	{
+		E3DEBUG(E3TOOLS_PFX "not using index %s -- the superblock doesn't make enough sense to key it on\n", fname);
+		return -1;
+	}
+	
+	ix = calloc(1, sizeof(*ix));
+	if (!ix)
+		return -1;
+	ix->fname = strdup(fname);
+	pthread_mutex_init(&ix->lock, NULL);
+	
+	memcpy(ix->hdr.magic, INDEX_MAGIC, sizeof(ix->hdr.magic));
+	ix->hdr.version = INDEX_VERSION;
+	ix->hdr.ngroups = e3t->ngroups;
+	memcpy(ix->hdr.uuid, e3t->sb.s_uuid, sizeof(ix->hdr.uuid));
+	ix->hdr.sbdigest = _fnv64(FNV64_INIT, &e3t->sb, BYTES_PER_SECTOR);
+	if (e3t->consensus)	/* A voted-on descriptor table is no good to a run that reads just the one. */
+		ix->hdr.sbdigest = _fnv64(ix->hdr.sbdigest, "consensus", 9);
+	if (e3t->journal)
+	{
+		uint64_t jd = journal_digest(e3t);
+		
+		ix->hdr.sbdigest = _fnv64(ix->hdr.sbdigest, &jd, sizeof(jd));
+	}
+	ix->hdr.cowdigest = diskcow_digest(e3t);
+	if (nlames)
+		ix->hdr.cowdigest = _fnv64(ix->hdr.cowdigest, lames, nlames * sizeof(*lames));
+	ix->hdr.descsz = SB_DESC_SIZE(&e3t->sb);
+	
+	ix->itcheck = malloc(e3t->ngroups * sizeof(*ix->itcheck));
+	if (!ix->fname || !ix->itcheck)
+	{
+		free(ix->fname);
+		free(ix->itcheck);
+		free(ix);
+		return -1;
+	}
+	for (i = 0; i < ix->hdr.ngroups; i++)
+		ix->itcheck[i].ok = -1;
+	e3t->index = ix;
+	
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 0;	/* First time; we'll make one on the way out. */
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(*old)))
+	{
+		close(fd);
+		return 0;
+	}
+	ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ix->map == MAP_FAILED)
+	{
+		perror("index_open: mmap");
+		ix->map = NULL;
+		return 0;
+	}
+	ix->maplen = st.st_size;
+	old = (struct index_header *)ix->map;
+	
+	/* Everything up to the flags is the key. */
+	if (memcmp(old, &ix->hdr, offsetof(struct index_header, flags)) ||
+	    (old->itcheck_off + U64(old->ngroups) * sizeof(struct index_itcheck) > ix->maplen) ||
+	    (old->parents_off + old->nparents * sizeof(struct index_parent) > ix->maplen) ||
+	    ((old->flags & INDEX_HAVE_GDT) && (old->gdt_off + U64(old->ngroups) * old->descsz > ix->maplen)) ||
+	    ((old->flags & INDEX_HAVE_NAMES) && ((old->names_off + old->nnames * sizeof(struct ipath_entry) > ix->maplen) ||
+	                                         (old->arena_off + old->arenalen > ix->maplen))))
+	{
+		E3DEBUG(E3TOOLS_PFX "index %s is for some other filesystem or COW state or lame sectors; starting it over\n", fname);
+		munmap(ix->map, ix->maplen);
+		ix->map = NULL;
+		ix->dirty = 1;
+		return 0;
+	}
+	
+	if (old->flags & INDEX_HAVE_GDT)
+		ix->oldgdt = ix->map + old->gdt_off;
+	memcpy(ix->itcheck, ix->map + old->itcheck_off, ix->hdr.ngroups * sizeof(*ix->itcheck));
+	ix->oldparents = (const struct index_parent *)(ix->map + old->parents_off);
+	ix->noldparents = old->nparents;
+	if (old->flags & INDEX_HAVE_NAMES)
+	{
+		ix->oldnames = (const struct ipath_entry *)(ix->map + old->names_off);
+		ix->noldnames = old->nnames;
+		ix->oldarena = ix->map + old->arena_off;
+		ix->oldarenalen = old->arenalen;
+	}
+	
+	return 0;
+}
+
+/* Something got written to the COW data; whatever we know is suspect. */
+void index_invalidate(e3tools_t *e3t)
+{
+	if (e3t->index)
+		e3t->index->stale = 1;
+}
+
+int index_gdt_get(e3tools_t *e3t, uint8_t *buf, int len)
+{
+	struct e3index *ix = e3t->index;
+	
+	if (!ix || ix->stale || !ix->oldgdt || ((uint64_t)len != U64(ix->hdr.ngroups) * ix->hdr.descsz))
+		return -1;
+	memcpy(buf, ix->oldgdt, len);
+	return 0;
+}
+
+/* e3t->gdt has been read in; it gets saved from there. */
+void index_gdt_put(e3tools_t *e3t)
+{
+	if (e3t->index)
+		e3t->index->dirty = 1;
+}
+
+int index_itable_check_get(e3tools_t *e3t, int bg, int *ok, int *bogus)
+{
+	struct e3index *ix = e3t->index;
+	
+	if (!ix || ix->stale || (bg < 0) || (bg >= (int)ix->hdr.ngroups) || (ix->itcheck[bg].ok < 0))
+		return -1;
+	*ok = ix->itcheck[bg].ok;
+	*bogus = ix->itcheck[bg].bogus;
+	return 0;
+}
+
+void index_itable_check_put(e3tools_t *e3t, int bg, int ok, int bogus)
+{
+	struct e3index *ix = e3t->index;
+	
+	if (!ix || (bg < 0) || (bg >= (int)ix->hdr.ngroups))
+		return;
+	ix->itcheck[bg].ok = ok;
+	ix->itcheck[bg].bogus = bogus;
+	ix->dirty = 1;
+}
+
+int index_names_get(e3tools_t *e3t, const struct ipath_entry **ents, uint32_t *nents, const uint8_t **arena, uint64_t *arenalen)
+{
+	struct e3index *ix = e3t->index;
+	
+	if (!ix || ix->stale || !ix->oldnames)
+		return -1;
+	*ents = ix->oldnames;
+	*nents = ix->noldnames;
+	*arena = ix->oldarena;
+	*arenalen = ix->oldarenalen;
+	return 0;
+}
+
+/* e3t->ipath has been built; it gets saved from there. */
+void index_names_put(e3tools_t *e3t)
+{
+	if (e3t->index)
+		e3t->index->dirty = 1;
+}
+
+static struct index_parent *_new_slot(struct e3index *ix, uint32_t dir)
+{
+	uint32_t i = (dir * 2654435761u) & (ix->newalloc - 1);
+	
+	while (ix->newparents[i].dir && (ix->newparents[i].dir != dir))
+		i = (i + 1) & (ix->newalloc - 1);
+	return &ix->newparents[i];
+}
+
+static uint32_t _old_parent(struct e3index *ix, uint32_t dir)
+{
+	uint64_t lo = 0, hi = ix->noldparents;
+	
+	while (lo < hi)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		
+		if (ix->oldparents[mid].dir == dir)
+			return ix->oldparents[mid].parent;
+		if (ix->oldparents[mid].dir < dir)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/* Returns the inode of dir's "..", if anything has told us; 0 if not. */
+uint32_t index_parent(e3tools_t *e3t, uint32_t dir)
+{
+	struct e3index *ix = e3t->index;
+	uint32_t parent = 0;
+	
+	if (!ix || ix->stale || !dir)
+		return 0;
+	
+	pthread_mutex_lock(&ix->lock);
+	if (ix->nnew)
+		parent = _new_slot(ix, dir)->parent;
+	if (!parent)
+		parent = _old_parent(ix, dir);
+	pthread_mutex_unlock(&ix->lock);
+	
+	return parent;
+}
+
+void index_note_parent(e3tools_t *e3t, uint32_t dir, uint32_t parent)
+{
+	struct e3index *ix = e3t->index;
+	struct index_parent *slot;
+	
+	if (!ix || ix->stale || !dir || !parent || (index_parent(e3t, dir) == parent))
+		return;
+	
+	pthread_mutex_lock(&ix->lock);
+	if ((ix->nnew + 1) * 2 > ix->newalloc)
+	{
+		struct index_parent *old = ix->newparents;
+		uint32_t oldalloc = ix->newalloc;
+		struct index_parent *np;
+		uint32_t i;
+		
+		np = calloc(oldalloc ? (oldalloc * 2) : 1024, sizeof(*np));
+		if (!np)
+		{
+			pthread_mutex_unlock(&ix->lock);
+			return;
+		}
+		ix->newparents = np;
+		ix->newalloc = oldalloc ? (oldalloc * 2) : 1024;
+		for (i = 0; i < oldalloc; i++)
+			if (old[i].dir)
+				*_new_slot(ix, old[i].dir) = old[i];
+		free(old);
+	}
+	slot = _new_slot(ix, dir);
+	if (!slot->dir)
+		ix->nnew++;
+	slot->dir = dir;
+	slot->parent = parent;
+	ix->dirty = 1;
+	pthread_mutex_unlock(&ix->lock);
+}
+
+static int _parent_cmp(const void *a, const void *b)
+{
+	const struct index_parent *pa = a, *pb = b;
+	
+	return (pa->dir < pb->dir) ? -1 : (pa->dir > pb->dir);
+}
+
+static int _write(int fd, const void *buf, size_t len, uint64_t *pos)
+{
+	const uint8_t *p = buf;
+	ssize_t rv;
+	
+	while (len)
+	{
+		rv = write(fd, p, len);
+		if (rv <= 0)
+			return -1;
+		p += rv;
+		len -= rv;
+		*pos += rv;
+	}
+	return 0;
+}
+
+static int _pad(int fd, uint64_t *pos)
+{
+	static const uint8_t zeroes[8];
+	
+	return _write(fd, zeroes, (8 - *pos % 8) % 8, pos);
+}
+
+/* Merges what we learned about parents this run into the sorted list from
+ * last time (this run's answers win), and writes the whole lot out to a
+ * new file, which then replaces the old one in one go. */
+static int _save(e3tools_t *e3t, struct e3index *ix)
+{
+	struct index_header hdr = ix->hdr;
+	struct index_parent *news = NULL, *merged = NULL;
+	const uint8_t *gdt = e3t->gdt ? e3t->gdt : ix->oldgdt;
+	const struct ipath_entry *names = e3t->ipath ? e3t->ipath->ents : ix->oldnames;
+	uint64_t nnames = e3t->ipath ? e3t->ipath->nents : ix->noldnames;
+	const uint8_t *arena = e3t->ipath ? e3t->ipath->arena : ix->oldarena;
+	uint64_t arenalen = e3t->ipath ? e3t->ipath->arenalen : ix->oldarenalen;
+	uint64_t nmerged = 0, pos = 0;
+	uint64_t i, j;
+	uint32_t k, n = 0;
+	char *tmpname;
+	int fd, rv = -1;
+	
+	news = malloc((ix->nnew + 1) * sizeof(*news));
+	merged = malloc((ix->nnew + ix->noldparents + 1) * sizeof(*merged));
+	tmpname = malloc(strlen(ix->fname) + 5);
+	if (!news || !merged || !tmpname)
+		goto out;
+	for (k = 0; k < ix->newalloc; k++)
+		if (ix->newparents[k].dir)
+			news[n++] = ix->newparents[k];
+	qsort(news, n, sizeof(*news), _parent_cmp);
+	for (i = 0, j = 0; (i < ix->noldparents) || (j < n); )
+	{
+		if ((j < n) && ((i == ix->noldparents) || (news[j].dir <= ix->oldparents[i].dir)))
+		{
+			if ((i < ix->noldparents) && (news[j].dir == ix->oldparents[i].dir))
+				i++;
+			merged[nmerged++] = news[j++];
+		} else {
+			merged[nmerged++] = ix->oldparents[i++];
+		}
+	}
+	
+	hdr.flags = (gdt ? INDEX_HAVE_GDT : 0) | (names ? INDEX_HAVE_NAMES : 0);
+	hdr.gdt_off = (sizeof(hdr) + 7) & ~U64(7);
+	hdr.itcheck_off = (hdr.gdt_off + (gdt ? U64(hdr.ngroups) * hdr.descsz : 0) + 7) & ~U64(7);
+	hdr.parents_off = (hdr.itcheck_off + U64(hdr.ngroups) * sizeof(*ix->itcheck) + 7) & ~U64(7);
+	hdr.nparents = nmerged;
+	hdr.names_off = (hdr.parents_off + nmerged * sizeof(*merged) + 7) & ~U64(7);
+	hdr.nnames = names ? nnames : 0;
+	hdr.arena_off = (hdr.names_off + hdr.nnames * sizeof(*names) + 7) & ~U64(7);
+	hdr.arenalen = names ? arenalen : 0;
+	
+	sprintf(tmpname, "%s.new", ix->fname);
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	{
+		perror(tmpname);
+		goto out;
+	}
+	if ((_write(fd, &hdr, sizeof(hdr), &pos) < 0) || (_pad(fd, &pos) < 0) ||
+	    (gdt && ((_write(fd, gdt, U64(hdr.ngroups) * hdr.descsz, &pos) < 0) || (_pad(fd, &pos) < 0))) ||
+	    (_write(fd, ix->itcheck, U64(hdr.ngroups) * sizeof(*ix->itcheck), &pos) < 0) || (_pad(fd, &pos) < 0) ||
+	    (_write(fd, merged, nmerged * sizeof(*merged), &pos) < 0) || (_pad(fd, &pos) < 0) ||
+	    (names && ((_write(fd, names, nnames * sizeof(*names), &pos) < 0) || (_pad(fd, &pos) < 0) ||
+	               (_write(fd, arena, arenalen, &pos) < 0))))
+	{
+		perror(tmpname);
+		close(fd);
+		unlink(tmpname);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmpname, ix->fname) < 0)
+	{
+		perror(ix->fname);
+		unlink(tmpname);
+		goto out;
+	}
+	rv = 0;
+
+out:
+	free(news);
+	free(merged);
+	free(tmpname);
+	return rv;
+}
+
+void index_close(e3tools_t *e3t)
+{
+	struct e3index *ix = e3t->index;
+	
+	if (!ix)
+		return;
+	
+	if (ix->dirty && !ix->stale)
+		_save(e3t, ix);
+	
+	if (ix->map)
+		munmap(ix->map, ix->maplen);
+	free(ix->newparents);
+	free(ix->itcheck);
+	free(ix->fname);
+	free(ix);
+	e3t->index = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "diskio.h"
+#include "ipath.h"
+
+struct e3index;	// opaque; defined in index.c
+
+extern int index_open(e3tools_t *e3t, const char *fname, const sector_t *lames, int nlames);
+extern void index_close(e3tools_t *e3t);
+extern void index_invalidate(e3tools_t *e3t);
+
+extern int index_gdt_get(e3tools_t *e3t, uint8_t *buf, int len);
+extern void index_gdt_put(e3tools_t *e3t);
+
+extern int index_itable_check_get(e3tools_t *e3t, int bg, int *ok, int *bogus);
+extern void index_itable_check_put(e3tools_t *e3t, int bg, int ok, int bogus);
+
+extern int index_names_get(e3tools_t *e3t, const struct ipath_entry **ents, uint32_t *nents, const uint8_t **arena, uint64_t *arenalen);
+extern void index_names_put(e3tools_t *e3t);
+
+extern uint32_t index_parent(e3tools_t *e3t, uint32_t dir);
+extern void index_note_parent(e3tools_t *e3t, uint32_t dir, uint32_t parent);
+
+#endif
@@ -7,7 +7,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <alloca.h>
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
 
@@ -16,6 +15,8 @@
 #include "superblock.h"
 #include "blockgroup.h"
 #include "inode.h"
+#include "index.h"
+#include "bufpool.h"
 
 void inode_print(e3tools_t *e3t, struct ext2_inode *inode, int ino)
 {
@@ -47,11 +48,28 @@ void inode_print(e3tools_t *e3t, struct ext2_inode *inode, int ino)
 		(inode->i_links_count > 1024) ? " (looks bogus!)" : "");
 	printf("\t\tSize       : %d\n", inode->i_size);
 	printf("\t\t# Blocks   : %d\n", inode->i_blocks);
-	printf("\t\tBlock list : %d %d %d %d %d %d %d %d %d %d %d %d *%d **%d ***%d\n",
-		inode->i_block[0], inode->i_block[1], inode->i_block[2], inode->i_block[3], 
-		inode->i_block[4], inode->i_block[5], inode->i_block[6], inode->i_block[7], 
-		inode->i_block[8], inode->i_block[9], inode->i_block[10], inode->i_block[11], 
-		inode->i_block[12], inode->i_block[13], inode->i_block[14]);
+	if (inode->i_flags & INODE_EXTENTS_FL)
+	{
+		struct ext3_extent_header *eh = (struct ext3_extent_header *)inode->i_block;
+		
+		printf("\t\tExtent tree: magic %04X%s, depth %d, %d/%d entries\n", eh->eh_magic,
+			(eh->eh_magic == EXTENT_MAGIC) ? "" : " (looks bogus!)", eh->eh_depth, eh->eh_entries, eh->eh_max);
+		if ((eh->eh_magic == EXTENT_MAGIC) && (eh->eh_depth == 0) && (eh->eh_entries <= 4))
+		{
+			struct ext3_extent *ex = (struct ext3_extent *)(eh + 1);
+			int i;
+			for (i = 0; i < eh->eh_entries; i++)
+				printf("\t\t  [%d] logical %d, %d blocks at %lld%s\n", i, ex[i].ee_block,
+					(ex[i].ee_len > EXTENT_INIT_MAX_LEN) ? (ex[i].ee_len - EXTENT_INIT_MAX_LEN) : ex[i].ee_len,
+					(long long int)((U64(ex[i].ee_start_hi) << 32) | ex[i].ee_start),
+					(ex[i].ee_len > EXTENT_INIT_MAX_LEN) ? " (uninitialized)" : "");
+		}
+	} else
+		printf("\t\tBlock list : %d %d %d %d %d %d %d %d %d %d %d %d *%d **%d ***%d\n",
+			inode->i_block[0], inode->i_block[1], inode->i_block[2], inode->i_block[3], 
+			inode->i_block[4], inode->i_block[5], inode->i_block[6], inode->i_block[7], 
+			inode->i_block[8], inode->i_block[9], inode->i_block[10], inode->i_block[11], 
+			inode->i_block[12], inode->i_block[13], inode->i_block[14]);
 	printf("\t\tFlags      : ");
 	if (inode->i_flags & 0x00000001)
 		printf("secrm ");
@@ -69,13 +87,17 @@ void inode_print(e3tools_t *e3t, struct ext2_inode *inode, int ino)
 		printf("nodump ");
 	if (inode->i_flags & 0x00000080)
 		printf("noatime ");
-	if (inode->i_flags & 0x00010000)
+	if (inode->i_flags & 0x00001000)
 		printf("btreedir/hashdir ");
+	if (inode->i_flags & 0x00010000)
+		printf("dirsync ");
 	if (inode->i_flags & 0x00020000)
 		printf("afs ");
 	if (inode->i_flags & 0x00040000)
 		printf("journal ");
-	if (inode->i_flags & 0xFFF80000)
+	if (inode->i_flags & INODE_EXTENTS_FL)
+		printf("extents ");
+	if (inode->i_flags & 0xFFF00000)
 		printf("type A? ");
 	printf("\n");
 }
@@ -84,26 +106,144 @@ int inode_find(e3tools_t *e3t, int ino, struct ext2_inode *inode)
 {
 	int inodes_per_block = SB_BLOCK_SIZE(&e3t->sb) / e3t->sb.s_inode_size;
 	int bg = (ino - 1) / e3t->sb.s_inodes_per_group;
-	int curblock = block_group_inode_table_block(e3t, bg) + ((ino - 1) % e3t->sb.s_inodes_per_group) / inodes_per_block;
+	block_t curblock = block_group_inode_table_block(e3t, bg) + ((ino - 1) % e3t->sb.s_inodes_per_group) / inodes_per_block;
 	int offset = e3t->sb.s_inode_size * ((ino - 1) % inodes_per_block);
-	uint8_t *block = alloca(SB_BLOCK_SIZE(&e3t->sb));
+	uint8_t *block = buf_borrow(e3t);
 	
+	if (!block)
+		return -1;
 	if (disk_read_block(e3t, curblock, (uint8_t *)block) < 0)
 	{
 		perror("inode_find: disk_read_block");
+		buf_return(e3t, block);
 		return -1;
 	}
 	
-	memcpy((void*)inode, block + offset, e3t->sb.s_inode_size);
+	/* Just the part we have a struct for; with 256-byte inodes the rest
+	 * would run off the end of the caller's. */
+	memcpy((void*)inode, block + offset, sizeof(struct ext2_inode));
+	buf_return(e3t, block);
 	
 	return 0;
 }
 
+struct wanted {
+	block_t block;		/* the table block the inode is in */
+	int ofs;		/* and where in it */
+	int idx;		/* where it goes in the caller's array */
+};
+
+static int _wanted_cmp(const void *a, const void *b)
+{
+	const struct wanted *wa = a, *wb = b;
+	
+	if (wa->block != wb->block)
+		return (wa->block > wb->block) - (wa->block < wb->block);
+	return wa->idx - wb->idx;
+}
+
+/* inode_find() for a whole list of inodes at once.  The inodes get sorted
+ * by where they are in the inode tables, each table block that has any of
+ * them in it is read once, and blocks that are close enough together go
+ * in one read (up to ITABLE_CHUNK_BYTES).  inodes[i] gets inos[i], and
+ * rvs[i], if rvs isn't NULL, what inode_find() would have returned for it.
+ * Returns 0 if every inode was read, or -1 if any weren't. */
+int inode_find_many(e3tools_t *e3t, const int *inos, int n, struct ext2_inode *inodes, int *rvs)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int isz = e3t->sb.s_inode_size;
+	int inodes_per_block = bs / isz;
+	int ipg = e3t->sb.s_inodes_per_group;
+	int chunk = ITABLE_CHUNK_BYTES / bs;
+	struct wanted *w;
+	uint8_t *buf;
+	block_t table = 0;
+	int i, j, k, nw = 0, lastbg = -1, nread = 0;
+	
+	w = malloc(n * sizeof(*w));
+	if (posix_memalign((void **)&buf, BUFPOOL_ALIGN, chunk * bs) != 0)
+		buf = NULL;
+	if (!w || !buf)
+	{
+		perror("inode_find_many: malloc");
+		free(w);
+		free(buf);
+		return -1;
+	}
+	
+	for (i = 0; i < n; i++)
+	{
+		if (rvs)
+			rvs[i] = -1;
+		if ((inos[i] < 1) || ((uint32_t)inos[i] > e3t->sb.s_inodes_count))
+			continue;
+		w[nw].block = (inos[i] - 1) / ipg;	/* the group, for now */
+		w[nw].ofs = (inos[i] - 1) % ipg;
+		w[nw].idx = i;
+		nw++;
+	}
+	
+	/* Looking a table up without the descriptor table in memory means a
+	 * read, so do it once a group. */
+	qsort(w, nw, sizeof(*w), _wanted_cmp);
+	for (i = 0; i < nw; i++)
+	{
+		if ((int)w[i].block != lastbg)
+		{
+			lastbg = w[i].block;
+			table = block_group_inode_table_block(e3t, lastbg);
+		}
+		if (table == (block_t)-1)
+		{
+			w[i].block = (block_t)-1;
+			continue;
+		}
+		w[i].block = table + w[i].ofs / inodes_per_block;
+		w[i].ofs = (w[i].ofs % inodes_per_block) * isz;
+	}
+	qsort(w, nw, sizeof(*w), _wanted_cmp);
+	
+	for (i = 0; (i < nw) && (w[i].block != (block_t)-1); i = j)
+	{
+		block_t first = w[i].block;
+		int nblocks, ok;
+		
+		/* Take in everything up to a few blocks past the last one we
+		 * need, as long as it fits. */
+		for (j = i + 1; (j < nw) && (w[j].block != (block_t)-1) && (w[j].block < first + chunk) && (w[j].block <= w[j - 1].block + 4); j++)
+			;
+		nblocks = w[j - 1].block - first + 1;
+		ok = (disk_read_blocks(e3t, first, nblocks, buf) == 0);
+		for (k = i; k < j; k++)
+		{
+			block_t b = w[k].block - first;
+			
+			if (!ok && ((k == i) || (w[k].block != w[k - 1].block)) &&
+			    (disk_read_block(e3t, w[k].block, buf + b * bs) < 0))
+			{
+				perror("inode_find_many: disk_read_block");
+				/* Every other inode in this block is lost too. */
+				while ((k + 1 < j) && (w[k + 1].block == w[k].block))
+					k++;
+				continue;
+			}
+			memcpy(&inodes[w[k].idx], buf + b * bs + w[k].ofs, sizeof(struct ext2_inode));
+			if (rvs)
+				rvs[w[k].idx] = 0;
+			nread++;
+		}
+	}
+	
+	free(w);
+	free(buf);
+	return (nread == n) ? 0 : -1;
+}
+
 int inode_mark_lame(e3tools_t *e3t, int ino)
 {
 	int inodes_per_block = SB_BLOCK_SIZE(&e3t->sb) / e3t->sb.s_inode_size;
 	int bg = (ino - 1) / e3t->sb.s_inodes_per_group;
-	int curblock = block_group_inode_table_block(e3t, bg) + ((ino - 1) % e3t->sb.s_inodes_per_group) / inodes_per_block;
+	block_t curblock = block_group_inode_table_block(e3t, bg) + ((ino - 1) % e3t->sb.s_inodes_per_group) / inodes_per_block;
 	int offset = e3t->sb.s_inode_size * ((ino - 1) % inodes_per_block);
 	sector_t s = curblock * (SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR) + (offset / BYTES_PER_SECTOR);
 	
@@ -112,22 +252,24 @@ int inode_mark_lame(e3tools_t *e3t, int ino)
 
 void inode_table_show(e3tools_t *e3t, int bg)
 {
-	int curblock = block_group_inode_table_block(e3t, bg);
+	block_t curblock = block_group_inode_table_block(e3t, bg);
 	int inodes = e3t->sb.s_inodes_per_group;
 	int inodes_per_block = SB_BLOCK_SIZE(&e3t->sb) / e3t->sb.s_inode_size;
 	int blocks = inodes * e3t->sb.s_inode_size / SB_BLOCK_SIZE(&e3t->sb);
-	uint8_t *block = alloca(SB_BLOCK_SIZE(&e3t->sb));
+	uint8_t *block = buf_borrow(e3t);
 	int b;
 	
+	if (!block)
+		return;
 	printf("Inode table from block group %d\n", bg);
-	printf("Starts at block %d, should contain %d inodes in %d blocks\n", curblock, inodes, blocks);
+	printf("Starts at block %lld, should contain %d inodes in %d blocks\n", (long long int)curblock, inodes, blocks);
 	for (b = 0; b < blocks; b++)
 	{
 		int i;
 		if (disk_read_block(e3t, curblock, (uint8_t *)block) < 0)
 		{
 			perror("inode_table_show: disk_read_block");
-			return;
+			break;
 		}
 		for (i = 0; i < inodes_per_block; i++)
 		{
@@ -138,25 +280,36 @@ void inode_table_show(e3tools_t *e3t, int bg)
 		}
 		curblock++;
 	}
+	buf_return(e3t, block);
 }
 
 void inode_table_check(e3tools_t *e3t, int bg)
 {
-	int curblock = block_group_inode_table_block(e3t, bg);
+	block_t curblock = block_group_inode_table_block(e3t, bg);
 	int inodes = e3t->sb.s_inodes_per_group;
 	int inodes_per_block = SB_BLOCK_SIZE(&e3t->sb) / e3t->sb.s_inode_size;
 	int blocks = inodes * e3t->sb.s_inode_size / SB_BLOCK_SIZE(&e3t->sb);
-	uint8_t *block = alloca(SB_BLOCK_SIZE(&e3t->sb));
+	uint8_t *block;
 	int b;
 	int ok = 0;
 	int bogus = 0;
 	
+	if (index_itable_check_get(e3t, bg, &ok, &bogus) == 0)
+	{
+		printf("Inode table from block group %d: %d OK inodes, %d bogus inodes\n", bg, ok, bogus);
+		return;
+	}
+	block = buf_borrow(e3t);
+	if (!block)
+		return;
+	
 	for (b = 0; b < blocks; b++)
 	{
 		int i;
 		if (disk_read_block(e3t, curblock, (uint8_t *)block) < 0)
 		{
 			perror("inode_table_check: disk_read_block");
+			buf_return(e3t, block);
 			return;
 		}
 		for (i = 0; i < inodes_per_block; i++)
@@ -171,158 +324,655 @@ void inode_table_check(e3tools_t *e3t, int bg)
 		}
 		curblock++;
 	}
+	buf_return(e3t, block);
+	index_itable_check_put(e3t, bg, ok, bogus);
 	printf("Inode table from block group %d: %d OK inodes, %d bogus inodes\n", bg, ok, bogus);
 }
 
+/* Hands every inode in group bg's table to fn, reading the table a big
+ * chunk at a time rather than a block at a time.  A chunk that won't read
+ * gets read again a block at a time, so a bad sector only costs the
+ * inodes that are in it (and a warning). */
+int inode_table_scan(e3tools_t *e3t, int bg, inode_scan_fn fn, void *arg)
+{
+	int bs = SB_BLOCK_SIZE(&e3t->sb);
+	int isz = e3t->sb.s_inode_size;
+	int inodes_per_block = bs / isz;
+	int ipg = e3t->sb.s_inodes_per_group;
+	int blocks = (ipg + inodes_per_block - 1) / inodes_per_block;
+	int chunk = ITABLE_CHUNK_BYTES / bs;
+	block_t table = block_group_inode_table_block(e3t, bg);
+	uint8_t *buf;
+	int b, n, j, i, ok, ino;
+	
+	if ((table == (block_t)-1) || (chunk < 1))
+		return -1;
+	if (posix_memalign((void **)&buf, BUFPOOL_ALIGN, chunk * bs) != 0)
+	{
+		perror("inode_table_scan: posix_memalign");
+		return -1;
+	}
+	
+	for (b = 0; b < blocks; b += n)
+	{
+		n = (blocks - b < chunk) ? blocks - b : chunk;
+		ok = (disk_read_blocks(e3t, table + b, n, buf) == 0);
+		for (j = 0; j < n; j++)
+		{
+			if (!ok && (disk_read_block(e3t, table + b + j, buf + j * bs) < 0))
+			{
+				E3DEBUG(E3TOOLS_PFX "couldn't read inode table block %lld (group %d); skipping its inodes\n", (long long int)(table + b + j), bg);
+				continue;
+			}
+			for (i = 0; i < inodes_per_block; i++)
+			{
+				ino = (b + j) * inodes_per_block + i;
+				if (ino >= ipg)
+					break;
+				fn(arg, bg * ipg + ino + 1, (struct ext2_inode *)(buf + j * bs + i * isz));
+			}
+		}
+	}
+	
+	free(buf);
+	return 0;
+}
+
+/* Does this symlink keep its target in i_block?  i_blocks alone can't
+ * say: an extended attribute block counts towards it, so a fast symlink
+ * with one has i_blocks != 0.  Like the kernel, we go by the target fitting
+ * in i_block, and there being no extent tree or data blocks besides the
+ * attribute block. */
+int inode_is_fast_symlink(e3tools_t *e3t, struct ext2_inode *inode)
+{
+	uint32_t ea_blocks = inode->i_file_acl ? (SB_BLOCK_SIZE(&e3t->sb) >> 9) : 0;
+	
+	if ((inode->i_mode & 0xF000) != 0xA000)
+		return 0;
+	if (inode->i_flags & (INODE_EXTENTS_FL | INODE_INLINE_DATA_FL))
+		return 0;
+	return (inode->i_size > 0) && (inode->i_size < sizeof(inode->i_block)) && (inode->i_blocks <= ea_blocks);
+}
+
+/* Could this inode's block map still lead anywhere?  Deleting a file
+ * zeroes it on ext3 and ext4, but not on ext2.  Every block it names has
+ * to be on the disk, and it has to name at least one -- unless the data
+ * never needed a block (a fast symlink). */
+int inode_map_plausible(e3tools_t *e3t, struct ext2_inode *inode)
+{
+	block_t lo = e3t->sb.s_first_data_block;
+	block_t hi = SB_BLOCKS_COUNT(&e3t->sb);
+	int i, n = 0;
+	
+	if (inode_is_fast_symlink(e3t, inode))
+		return 1;
+	
+	if (inode->i_flags & INODE_EXTENTS_FL)
+	{
+		struct ext3_extent_header *eh = (struct ext3_extent_header *)inode->i_block;
+		
+		if ((eh->eh_magic != EXTENT_MAGIC) || !eh->eh_entries || (eh->eh_entries > eh->eh_max) || (eh->eh_max > 4) ||
+		    (eh->eh_depth > EXTENT_MAX_DEPTH))
+			return 0;
+		for (i = 0; i < eh->eh_entries; i++)
+		{
+			block_t start;
+			int len = 1;
+			
+			if (eh->eh_depth == 0)
+			{
+				struct ext3_extent *ext = (struct ext3_extent *)(eh + 1) + i;
+				
+				start = ext->ee_start | (U64(ext->ee_start_hi) << 32);
+				len = (ext->ee_len > EXTENT_INIT_MAX_LEN) ? ext->ee_len - EXTENT_INIT_MAX_LEN : ext->ee_len;
+			} else {
+				struct ext3_extent_idx *idx = (struct ext3_extent_idx *)(eh + 1) + i;
+				
+				start = idx->ei_leaf | (U64(idx->ei_leaf_hi) << 32);
+			}
+			if ((start < lo) || (start + len > hi) || (len == 0))
+				return 0;
+		}
+		return 1;
+	}
+	
+	for (i = 0; i < INODE_INDIRECT3 + 1; i++)
+	{
+		if (!inode->i_block[i])
+			continue;
+		if ((inode->i_block[i] < lo) || (inode->i_block[i] >= hi))
+			return 0;
+		n++;
+	}
+	return n > 0;
+}
+
+/* The walkers below report data a run at a time: n consecutive logical
+ * blocks from lblk that are consecutive on the disk from pblk. */
+struct iwalk {
+	e3tools_t *e3t;
+	inode_walk_fn fn;
+	void *arg;
+	block_t lo, hi;		/* blocks outside [lo, hi) aren't on the disk */
+	block_t run_l, run_p, run_n;
+	int stop;
+	int errors;
+};
+
+static void _walk_flush(struct iwalk *w)
+{
+	if (w->run_n && !w->stop)
+		w->stop = w->fn(w->arg, w->run_l, w->run_p, w->run_n, IWALK_DATA);
+	w->run_n = 0;
+}
+
+static void _walk_data(struct iwalk *w, block_t lblk, block_t pblk, block_t n)
+{
+	if ((pblk < w->lo) || (pblk + n > w->hi) || (pblk + n < pblk))
+	{
+		E3DEBUG(E3TOOLS_PFX "logical block %lld maps to block %lld, which isn't on the disk -- inode on fire?\n", (long long int)lblk, (long long int)pblk);
+		w->errors++;
+		return;
+	}
+	if (w->run_n && (w->run_l + w->run_n == lblk) && (w->run_p + w->run_n == pblk))
+	{
+		w->run_n += n;
+		return;
+	}
+	_walk_flush(w);
+	w->run_l = lblk;
+	w->run_p = pblk;
+	w->run_n = n;
+}
+
+static void _walk_meta(struct iwalk *w, block_t pblk)
+{
+	_walk_flush(w);
+	if (!w->stop)
+		w->stop = w->fn(w->arg, -1, pblk, 1, IWALK_META);
+}
+
+/* An indirect block of the given level (1 for single), mapping logical
+ * blocks from lblk. */
+static void _walk_ind(struct iwalk *w, uint32_t blk, int level, block_t lblk)
+{
+	int perblk = SB_BLOCK_SIZE(&w->e3t->sb) / sizeof(uint32_t);
+	block_t span = 1;
+	uint32_t *map;
+	int i;
+	
+	for (i = 1; i < level; i++)
+		span *= perblk;
+	if ((blk < w->lo) || (blk >= w->hi))
+	{
+		E3DEBUG(E3TOOLS_PFX "level %d indirect block %u isn't on the disk -- inode on fire?\n", level, blk);
+		w->errors++;
+		return;
+	}
+	_walk_meta(w, blk);
+	
+	map = (uint32_t *)buf_borrow(w->e3t);
+	if (!map || (disk_read_block(w->e3t, blk, (uint8_t *)map) < 0))
+	{
+		perror("inode_block_walk: disk_read_block");
+		w->errors++;
+		buf_return(w->e3t, (uint8_t *)map);
+		return;
+	}
+	for (i = 0; (i < perblk) && !w->stop; i++, lblk += span)
+	{
+		if (!map[i])
+			continue;
+		if (level == 1)
+			_walk_data(w, lblk, map[i], 1);
+		else
+			_walk_ind(w, map[i], level - 1, lblk);
+	}
+	buf_return(w->e3t, (uint8_t *)map);
+}
+
+/* One node of an extent tree, and everything under it. */
+static void _walk_extents(struct iwalk *w, struct ext3_extent_header *eh, int maxent, int depth)
+{
+	uint8_t *block;
+	int i;
+	
+	if ((eh->eh_magic != EXTENT_MAGIC) || (eh->eh_entries > maxent) || (eh->eh_depth != depth) || (depth > EXTENT_MAX_DEPTH))
+	{
+		E3DEBUG(E3TOOLS_PFX "bad extent header (magic %04x, %d entries, depth %d) -- inode on fire?\n", eh->eh_magic, eh->eh_entries, eh->eh_depth);
+		w->errors++;
+		return;
+	}
+	for (i = 0; (i < eh->eh_entries) && !w->stop; i++)
+	{
+		if (depth == 0)
+		{
+			struct ext3_extent *ext = (struct ext3_extent *)(eh + 1) + i;
+			int len = (ext->ee_len > EXTENT_INIT_MAX_LEN) ? ext->ee_len - EXTENT_INIT_MAX_LEN : ext->ee_len;
+			
+			_walk_data(w, ext->ee_block, ext->ee_start | (U64(ext->ee_start_hi) << 32), len);
+		} else {
+			struct ext3_extent_idx *idx = (struct ext3_extent_idx *)(eh + 1) + i;
+			block_t leaf = idx->ei_leaf | (U64(idx->ei_leaf_hi) << 32);
+			
+			if ((leaf < w->lo) || (leaf >= w->hi))
+			{
+				E3DEBUG(E3TOOLS_PFX "extent tree block %lld isn't on the disk -- inode on fire?\n", (long long int)leaf);
+				w->errors++;
+				continue;
+			}
+			_walk_meta(w, leaf);
+			block = buf_borrow(w->e3t);
+			if (!block || (disk_read_block(w->e3t, leaf, block) < 0))
+			{
+				perror("inode_block_walk: disk_read_block");
+				w->errors++;
+			} else {
+				_walk_extents(w, (struct ext3_extent_header *)block,
+					      (SB_BLOCK_SIZE(&w->e3t->sb) - sizeof(*eh)) / sizeof(struct ext3_extent), depth - 1);
+			}
+			buf_return(w->e3t, block);
+		}
+	}
+}
+
+/* Calls fn for every block an inode has: its data, a run at a time and in
+ * logical order, and the indirect and extent tree blocks that map it, as
+ * they come up (with lblk -1 and IWALK_META), and its extended
+ * attribute block (IWALK_XATTR), which other inodes may share.  fn returns
+ * nonzero to stop the walk.  Returns how many parts of the map couldn't
+ * be followed, or 0 if it was all good. */
+int inode_block_walk(e3tools_t *e3t, struct ext2_inode *inode, inode_walk_fn fn, void *arg)
+{
+	struct iwalk w;
+	int i;
+	
+	memset(&w, 0, sizeof(w));
+	w.e3t = e3t;
+	w.fn = fn;
+	w.arg = arg;
+	w.lo = e3t->sb.s_first_data_block;
+	w.hi = SB_BLOCKS_COUNT(&e3t->sb);
+	
+	if (inode->i_file_acl)
+	{
+		if ((inode->i_file_acl < w.lo) || (inode->i_file_acl >= w.hi))
+			w.errors++;
+		else
+			w.stop = fn(arg, -1, inode->i_file_acl, 1, IWALK_XATTR);
+	}
+	
+	/* Fast symlinks and inline data keep everything in the inode. */
+	if (inode_is_fast_symlink(e3t, inode))
+		return w.errors;
+	if (inode->i_flags & INODE_INLINE_DATA_FL)
+		return w.errors;
+	
+	if (inode->i_flags & INODE_EXTENTS_FL)
+	{
+		struct ext3_extent_header *eh = (struct ext3_extent_header *)inode->i_block;
+		
+		if (!w.stop)
+			_walk_extents(&w, eh, 4, eh->eh_depth);
+	} else {
+		for (i = 0; (i < INODE_INDIRECT1) && !w.stop; i++)
+			if (inode->i_block[i])
+				_walk_data(&w, i, inode->i_block[i], 1);
+		for (i = INODE_INDIRECT1; (i <= INODE_INDIRECT3) && !w.stop; i++)
+		{
+			block_t perblk = SB_BLOCK_SIZE(&e3t->sb) / sizeof(uint32_t);
+			block_t first = INODE_INDIRECT1 + ((i > INODE_INDIRECT1) ? perblk : 0) + ((i > INODE_INDIRECT2) ? perblk * perblk : 0);
+			
+			if (inode->i_block[i])
+				_walk_ind(&w, inode->i_block[i], i - INODE_INDIRECT1 + 1, first);
+		}
+	}
+	_walk_flush(&w);
+	
+	return w.errors;
+}
+
 struct ifile {
 	e3tools_t *e3t;
 	struct ext2_inode inode;
 	block_t curblock;
 	int blockofs;
+	
+	/* The last run that _iblock_lookup handed back: logical blocks
+	 * [run_start, run_start + run_len) live at run_disk onwards, or are a
+	 * hole if run_disk is 0.  Sequential reads only go back to the block
+	 * map once they fall off the end of it. */
+	block_t run_start;
+	block_t run_len;
+	block_t run_disk;
 };
 
 struct ifile *ifile_open(e3tools_t *e3t, int ino)
 {
-	struct ifile *ifp = malloc(sizeof(*ifp));
+	struct ifile *ifp = slab_alloc(e3t, SLAB_IFILE, sizeof(*ifp));
 	
 	if (!ifp)
 		return NULL;
 	
 	if (inode_find(e3t, ino, &ifp->inode) < 0)
 	{
-		free(ifp);
+		slab_release(e3t, SLAB_IFILE, ifp);
 		return NULL;
 	}
 	
 	ifp->e3t = e3t;
 	ifp->curblock = 0;
 	ifp->blockofs = 0;
+	ifp->run_start = 0;
+	ifp->run_len = 0;
+	ifp->run_disk = 0;
 	
 	return ifp;
 }
 
-static block_t _iblock_lookup(e3tools_t *e3t, struct ext2_inode *inode, int blockno)
+/* How many entries, starting at map[0], continue the run that map[0]
+ * begins -- either consecutive disk blocks, or more holes? */
+static block_t _map_run(uint32_t *map, int n)
 {
-	block_t *block = alloca(SB_BLOCK_SIZE(&e3t->sb));
-	int perblk = SB_BLOCK_SIZE(&e3t->sb) / sizeof(block_t);
-	int origblockno = blockno;
+	int i;
+	
+	for (i = 1; i < n; i++)
+		if (map[0] ? (map[i] != map[0] + i) : (map[i] != 0))
+			break;
+	return i;
+}
+
+/* Finds the extent covering logical block blockno, binary searching each
+ * level of the tree on the way down, so a lookup costs one metadata read
+ * per level no matter how fragmented the file is.  Holes and uninitialized
+ * extents (which read back as zeroes) both come back as block 0. */
+static block_t _extent_lookup(e3tools_t *e3t, struct ext2_inode *inode, block_t blockno, block_t *run, uint8_t *block)
+{
+	struct ext3_extent_header *eh = (struct ext3_extent_header *)inode->i_block;
+	int maxent = (sizeof(inode->i_block) - sizeof(*eh)) / sizeof(struct ext3_extent);
+	int depth = eh->eh_depth;
+	uint64_t limit = U64(1) << 32;	/* first logical block past everything under this node */
+	
+	for (;;)
+	{
+		/* Index and leaf entries are the same size, and both start
+		 * with the first logical block that they cover. */
+		uint32_t *starts = (uint32_t *)(eh + 1);
+		int stride = sizeof(struct ext3_extent) / sizeof(uint32_t);
+		int lo = 0, hi;
+		
+		if ((eh->eh_magic != EXTENT_MAGIC) || (eh->eh_depth != depth) || (depth > EXTENT_MAX_DEPTH) ||
+		    (eh->eh_entries > eh->eh_max) || (eh->eh_max > maxent))
+		{
+			printf("_extent_lookup: bad extent header (magic %04x, depth %d, %d/%d entries) looking up block %lld -- inode on fire?\n",
+				eh->eh_magic, eh->eh_depth, eh->eh_entries, eh->eh_max, (long long int)blockno);
+			return IBLOCK_ERROR;
+		}
+		
+		/* After this, lo is the number of entries starting at or
+		 * before blockno. */
+		hi = eh->eh_entries;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (starts[mid * stride] <= blockno)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < eh->eh_entries)
+			limit = starts[lo * stride];
+		
+		if (depth == 0)
+		{
+			struct ext3_extent *ex = (struct ext3_extent *)(eh + 1) + lo - 1;
+			uint64_t len;
+			
+			if (lo > 0)
+			{
+				len = ex->ee_len;
+				if (len > EXTENT_INIT_MAX_LEN)
+					len -= EXTENT_INIT_MAX_LEN;
+				if (U64(blockno) < U64(ex->ee_block) + len)
+				{
+					*run = U64(ex->ee_block) + len - blockno;
+					if (ex->ee_len > EXTENT_INIT_MAX_LEN)
+						return 0;
+					return ((U64(ex->ee_start_hi) << 32) | ex->ee_start) + (blockno - ex->ee_block);
+				}
+			}
+			break;
+		}
+		
+		if (lo == 0)	/* Before the first thing this node knows about. */
+			break;
+		
+		{
+			struct ext3_extent_idx *ix = (struct ext3_extent_idx *)(eh + 1) + lo - 1;
+			block_t leaf = (U64(ix->ei_leaf_hi) << 32) | ix->ei_leaf;
+			
+			if (disk_read_block(e3t, leaf, block) < 0)
+			{
+				perror("_extent_lookup: disk_read_block");
+				return IBLOCK_ERROR;
+			}
+		}
+		eh = (struct ext3_extent_header *)block;
+		maxent = (SB_BLOCK_SIZE(&e3t->sb) - sizeof(*eh)) / sizeof(struct ext3_extent);
+		depth--;
+	}
+	
+	/* A hole, running up to wherever the next thing starts. */
+	*run = (limit > U64(blockno)) ? (limit - blockno) : 1;
+	return 0;
+}
+
+/* The same for the old direct/indirect block map; block is a block of
+ * scratch space. */
+static block_t _map_lookup(e3tools_t *e3t, struct ext2_inode *inode, block_t blockno, block_t *run, uint32_t *block)
+{
+	uint64_t perblk = SB_BLOCK_SIZE(&e3t->sb) / sizeof(uint32_t);
+	uint64_t origblockno = blockno;
+	uint64_t b = blockno;
+	uint32_t next;
 	
 	/* Direct block? */
-	if (blockno < INODE_INDIRECT1)
-		return inode->i_block[blockno];
+	if (b < INODE_INDIRECT1)
+	{
+		*run = _map_run(inode->i_block + b, INODE_INDIRECT1 - b);
+		return inode->i_block[b];
+	}
 	
 	/* Well, maybe in a first-level indirect block? */
-	blockno -= INODE_INDIRECT1;
-	if (blockno < perblk)
+	b -= INODE_INDIRECT1;
+	if (b < perblk)
 	{
 		if (inode->i_block[INODE_INDIRECT1] == 0)	/* Ha! Gotcha! */
+		{
+			*run = perblk - b;
 			return 0;
+		}
 		if (disk_read_block(e3t, inode->i_block[INODE_INDIRECT1], (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(INDIRECT1)");
-			return;
+			return IBLOCK_ERROR;
 		}
-		return block[blockno];
+		*run = _map_run(block + b, perblk - b);
+		return block[b];
 	}
 	
 	/* How about in a second-level indirect block? */
-	blockno -= perblk;
-	if (blockno < (perblk * perblk))
+	b -= perblk;
+	if (b < (perblk * perblk))
 	{
 		if (inode->i_block[INODE_INDIRECT2] == 0)	/* Ha! Gotcha! */
+		{
+			*run = perblk * perblk - b;
 			return 0;
+		}
 		if (disk_read_block(e3t, inode->i_block[INODE_INDIRECT2], (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(INDIRECT2)");
-			return;
+			return IBLOCK_ERROR;
 		}
 		
-		if (block[blockno / perblk] == 0)		/* Ha! Gotcha! */
+		next = block[b / perblk];
+		if (next == 0)		/* Ha! Gotcha! */
+		{
+			*run = perblk - b % perblk;
 			return 0;
-		if (disk_read_block(e3t, block[blockno / perblk], (uint8_t *)block) < 0)
+		}
+		if (disk_read_block(e3t, next, (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(*INDIRECT2)");
-			return;
+			return IBLOCK_ERROR;
 		}
-		return block[blockno % perblk];
+		*run = _map_run(block + b % perblk, perblk - b % perblk);
+		return block[b % perblk];
 	}
 	
 	/* Maybe a third level indirect block? */
-	blockno -= perblk * perblk;
-	if (blockno < (perblk * perblk * perblk))
+	b -= perblk * perblk;
+	if (b < (perblk * perblk * perblk))
 	{
 		if (inode->i_block[INODE_INDIRECT3] == 0)	/* Ha! Gotcha! */
+		{
+			*run = perblk * perblk * perblk - b;
 			return 0;
+		}
 		if (disk_read_block(e3t, inode->i_block[INODE_INDIRECT3], (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(INDIRECT3)");
-			return;
+			return IBLOCK_ERROR;
 		}
 		
-		if (block[blockno / (perblk * perblk)] == 0)	/* Ha! Gotcha !*/
+		next = block[b / (perblk * perblk)];
+		if (next == 0)	/* Ha! Gotcha !*/
+		{
+			*run = perblk * perblk - b % (perblk * perblk);
 			return 0;
-		if (disk_read_block(e3t, block[blockno / (perblk * perblk)], (uint8_t *)block) < 0)
+		}
+		if (disk_read_block(e3t, next, (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(*INDIRECT3)");
-			return;
+			return IBLOCK_ERROR;
 		}
 		
-		if (block[blockno % (perblk * perblk)] == 0)	/* Ha! Gotcha !*/
+		next = block[(b / perblk) % perblk];
+		if (next == 0)	/* Ha! Gotcha !*/
+		{
+			*run = perblk - b % perblk;
 			return 0;
-		if (disk_read_block(e3t, block[blockno % (perblk * perblk)], (uint8_t *)block) < 0)
+		}
+		if (disk_read_block(e3t, next, (uint8_t *)block) < 0)
 		{
 			perror("_iblock_lookup: disk_read_block(**INDIRECT3)");
-			return;
+			return IBLOCK_ERROR;
 		}
-		return block[blockno % perblk];
+		*run = _map_run(block + b % perblk, perblk - b % perblk);
+		return block[b % perblk];
 	}
 	
-	printf("_iblock_lookup: WTF? requested blockno %d is not in either the inode, the first level indirect, the second level indirect, *or* the third level indirect...\n", origblockno);
+	printf("_iblock_lookup: WTF? requested blockno %lld is not in either the inode, the first level indirect, the second level indirect, *or* the third level indirect...\n", (long long int)origblockno);
+	*run = 1;
 	return 0;
 }
 
+/* Maps logical block blockno of an inode to a disk block (0 for a hole),
+ * and stores in *run how many logical blocks, starting at blockno, carry on
+ * contiguously on disk (or stay a hole). */
+static block_t _iblock_lookup(e3tools_t *e3t, struct ext2_inode *inode, block_t blockno, block_t *run)
+{
+	uint8_t *block;
+	block_t rv;
+	
+	/* Direct blocks don't need to read anything. */
+	if (!(inode->i_flags & INODE_EXTENTS_FL) && (blockno < INODE_INDIRECT1))
+		return _map_lookup(e3t, inode, blockno, run, NULL);
+	
+	block = buf_borrow(e3t);
+	if (!block)
+		return IBLOCK_ERROR;
+	if (inode->i_flags & INODE_EXTENTS_FL)
+		rv = _extent_lookup(e3t, inode, blockno, run, block);
+	else
+		rv = _map_lookup(e3t, inode, blockno, run, (uint32_t *)block);
+	buf_return(e3t, block);
+	return rv;
+}
+
+/* The same thing, for tools that want to plan their own reads. */
+block_t inode_map_block(e3tools_t *e3t, struct ext2_inode *inode, block_t blockno, block_t *run)
+{
+	return _iblock_lookup(e3t, inode, blockno, run);
+}
+
 int ifile_read(struct ifile *ifp, char *buf, int len)
 {
 	int rlen = 0;
 	int blocksz = SB_BLOCK_SIZE(&ifp->e3t->sb);
 	uint64_t curpos = U64(ifp->curblock) * U64(blocksz) + U64(ifp->blockofs);
 	uint64_t flen = INODE_FILE_SIZE(&ifp->inode);
-	uint8_t *block = alloca(SB_BLOCK_SIZE(&ifp->e3t->sb));
+	uint8_t *block;
 	
 	while (len)
 	{
 		block_t diskblock;
-		int nbytes = blocksz - ifp->blockofs;	/* We can transfer a maximum of one block each go. */
+		uint64_t nbytes;
+		
+		/* Next up, see if we can find the block in the run we looked
+		 * up last time, or failing that, in the inode's table. */
+		if ((ifp->curblock < ifp->run_start) || (ifp->curblock - ifp->run_start >= ifp->run_len))
+		{
+			ifp->run_start = ifp->curblock;
+			ifp->run_disk = _iblock_lookup(ifp->e3t, &ifp->inode, ifp->curblock, &ifp->run_len);
+			if (ifp->run_disk == IBLOCK_ERROR)
+			{
+				ifp->run_len = 0;
+				return -1;
+			}
+		}
+		diskblock = ifp->run_disk ? (ifp->run_disk + (ifp->curblock - ifp->run_start)) : 0;
 		
-		if ((curpos + U64(nbytes)) > flen)
+		/* We can transfer whatever is left of the run in one go. */
+		nbytes = (U64(ifp->run_start) + ifp->run_len - ifp->curblock) * U64(blocksz) - U64(ifp->blockofs);
+		if ((curpos + nbytes) > flen)
 			nbytes = flen - curpos;
-		if (nbytes > len)
+		if (nbytes > U64(len))
 			nbytes = len;
 		if (nbytes == 0)
 			break;
 		
-		/* Next up, see if we can find the block in the inode's table. */
-		diskblock = _iblock_lookup(ifp->e3t, &ifp->inode, ifp->curblock);
 		if (diskblock == 0)	/* Sparse block -- fill in the blanks */
 		{
 			memset(buf, 0, nbytes);
-			buf += nbytes;
+		} else if ((ifp->blockofs == 0) && (nbytes >= U64(blocksz))) {
+			/* Whole blocks go straight into the caller's buffer. */
+			nbytes -= nbytes % blocksz;
+			if (disk_read_blocks(ifp->e3t, diskblock, nbytes / blocksz, (uint8_t *)buf) < 0)
+			{
+				perror("_ifile_read: disk_read_blocks");
+				return -1;
+			}
 		} else {
+			if (nbytes > U64(blocksz - ifp->blockofs))
+				nbytes = blocksz - ifp->blockofs;
+			block = buf_borrow(ifp->e3t);
+			if (!block)
+				return -1;
 			if (disk_read_block(ifp->e3t, diskblock, block) < 0)
 			{
 				perror("_ifile_read: disk_read_block");
+				buf_return(ifp->e3t, block);
 				return -1;
 			}
 			memcpy(buf, block + ifp->blockofs, nbytes);
-			buf += nbytes;
+			buf_return(ifp->e3t, block);
 		}
+		buf += nbytes;
 		
-		ifp->blockofs += nbytes;
-		if (ifp->blockofs == blocksz)
-		{
-			ifp->blockofs = 0;
-			ifp->curblock++;
-		}
+		ifp->curblock += (ifp->blockofs + nbytes) / blocksz;
+		ifp->blockofs = (ifp->blockofs + nbytes) % blocksz;
 		curpos += nbytes;
 		rlen += nbytes;
 		len -= nbytes;
@@ -343,5 +993,5 @@ int ifile_seek(struct ifile *ifp, uint64_t pos)
 
 void ifile_close(struct ifile *ifp)
 {
-	free(ifp);
+	slab_release(ifp->e3t, SLAB_IFILE, ifp);
 }
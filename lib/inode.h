@@ -8,11 +8,28 @@
 
 struct ifile;	// opaque; defined in inode.c
 
+/* Called by inode_table_scan() for each inode; inode points at the whole
+ * on-disk inode, s_inode_size bytes, and is only good until fn returns. */
+typedef void (*inode_scan_fn)(void *arg, int ino, struct ext2_inode *inode);
+
+/* Called by inode_block_walk() for each run of an inode's blocks; lblk is
+ * -1 for the blocks that aren't data. */
+#define IWALK_DATA 0
+#define IWALK_META 1		/* an indirect block, or a node of the extent tree */
+#define IWALK_XATTR 2		/* the extended attribute block, which can be shared */
+typedef int (*inode_walk_fn)(void *arg, block_t lblk, block_t pblk, block_t n, int what);
+
 extern void inode_table_show(e3tools_t *e3t, int bg);
 void inode_table_check(e3tools_t *e3t, int bg);
 void inode_print(e3tools_t *e3t, struct ext2_inode *inode, int ino);
 int inode_find(e3tools_t *e3t, int ino, struct ext2_inode *inode);
+int inode_find_many(e3tools_t *e3t, const int *inos, int n, struct ext2_inode *inodes, int *rvs);
 int inode_mark_lame(e3tools_t *e3t, int ino);
+block_t inode_map_block(e3tools_t *e3t, struct ext2_inode *inode, block_t blockno, block_t *run);
+int inode_table_scan(e3tools_t *e3t, int bg, inode_scan_fn fn, void *arg);
+int inode_is_fast_symlink(e3tools_t *e3t, struct ext2_inode *inode);
+int inode_map_plausible(e3tools_t *e3t, struct ext2_inode *inode);
+int inode_block_walk(e3tools_t *e3t, struct ext2_inode *inode, inode_walk_fn fn, void *arg);
 
 struct ifile *ifile_open(e3tools_t *e3t, int ino);
 int ifile_read(struct ifile *ifp, char *buf, int len);
@@ -30,4 +47,39 @@ void ifile_close(struct ifile *ifp);
 #define INODE_INDIRECT2 13
 #define INODE_INDIRECT3 14
 
+#define IBLOCK_ERROR ((block_t)-1)	/* couldn't read the block map */
+
+#define ITABLE_CHUNK_BYTES (1024 * 1024)	/* how much of an inode table inode_table_scan() reads at once */
+
+/* ext4 extent trees.  An inode with INODE_EXTENTS_FL set keeps an extent
+ * header in i_block instead of the direct/indirect block map; the same
+ * header starts every index and leaf block further down the tree. */
+#define INODE_EXTENTS_FL 0x00080000
+#define INODE_INLINE_DATA_FL 0x10000000
+#define EXTENT_MAGIC 0xF30A
+#define EXTENT_INIT_MAX_LEN 32768	/* ee_len above this means an uninitialized extent */
+#define EXTENT_MAX_DEPTH 5	/* the kernel's EXT4_MAX_EXTENT_DEPTH; deeper is damage */
+
+struct ext3_extent_header {
+	uint16_t eh_magic;
+	uint16_t eh_entries;
+	uint16_t eh_max;
+	uint16_t eh_depth;
+	uint32_t eh_generation;
+};
+
+struct ext3_extent_idx {
+	uint32_t ei_block;	/* first logical block covered */
+	uint32_t ei_leaf;	/* low 32 bits of the next level's block */
+	uint16_t ei_leaf_hi;
+	uint16_t ei_unused;
+};
+
+struct ext3_extent {
+	uint32_t ee_block;	/* first logical block */
+	uint16_t ee_len;
+	uint16_t ee_start_hi;
+	uint32_t ee_start;	/* low 32 bits of the first physical block */
+};
+
 #endif
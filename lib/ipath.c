@@ -0,0 +1,315 @@
+// e3tools inode to path index
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "inode.h"
+#include "dir.h"
+#include "bitmap.h"
+#include "namei.h"
+#include "index.h"
+#include "ipath.h"
+
+/* namei_path() finds a directory's name by reading its parent, and its
+ * parent's parent, and so on up; that's fine for one directory, but a
+ * tool with a list of bare inode numbers to name (and plain files don't
+ * have a ".." to start from at all) wants something better.  So we read
+ * every directory once, and write down, for every inode named in one, the
+ * directory and the name.  After that a path is just following parents
+ * up to the root.  The index keeps the lot between runs.
+ *
+ * Assumptions:
+ *  - A file with more than one hard link gets the name in the directory
+ *    with the lowest inode number; any name will do, but the same one
+ *    every run is nicer.
+ *  - "." and ".." aren't names; a directory's name is the one its parent
+ *    gives it. */
+
+struct found {
+	uint32_t ino;
+	uint32_t parent;
+	uint8_t len;
+	char name[255];
+};
+
+struct builder {
+	e3tools_t *e3t;
+	struct ipath_entry *ents;
+	uint32_t nents;
+	uint8_t *arena;
+	uint64_t arenalen, arenaalloc;
+	pthread_mutex_t lock;
+	int nextgroup;
+	int ndirs;
+};
+
+static int _add_name(struct builder *b, const struct found *f)
+{
+	struct ipath_entry *e = &b->ents[f->ino];
+	
+	if (e->name && (e->parent <= f->parent))
+		return 0;
+	if (b->arenalen + 1 + f->len > UINT32_MAX)
+		return -1;	/* 4GB of names; we'll do without the rest. */
+	if (b->arenalen + 1 + f->len > b->arenaalloc)
+	{
+		uint8_t *na;
+		
+		b->arenaalloc = b->arenaalloc ? b->arenaalloc * 2 : 65536;
+		na = realloc(b->arena, b->arenaalloc);
+		if (!na)
+		{
+			perror("ipath_build: realloc");
+			return -1;
+		}
+		b->arena = na;
+	}
+	
+	/* A name we're replacing just stays in the arena, unused; hard
+	 * links are rare enough that it doesn't matter. */
+	e->parent = f->parent;
+	e->name = b->arenalen;
+	b->arena[b->arenalen] = f->len;
+	memcpy(b->arena + b->arenalen + 1, f->name, f->len);
+	b->arenalen += 1 + f->len;
+	return 0;
+}
+
+/* Moves a thread's finds into the tables; the lock gets taken once every
+ * few dozen names. */
+static void _flush(struct builder *b, struct found *local, int nlocal)
+{
+	int i;
+	
+	pthread_mutex_lock(&b->lock);
+	for (i = 0; i < nlocal; i++)
+		if (_add_name(b, &local[i]) < 0)
+			break;
+	pthread_mutex_unlock(&b->lock);
+}
+
+struct sweep {
+	struct builder *b;
+	struct found local[64];
+	int nlocal;
+};
+
+static void _sweep_dir(void *arg, int ino, struct ext2_inode *inode)
+{
+	struct sweep *s = arg;
+	struct dir *dp;
+	struct dirent_view de;
+	
+	if (((inode->i_mode & 0xF000) != 0x4000) || !inode->i_links_count || inode->i_dtime)
+		return;
+	dp = dir_open(s->b->e3t, ino);
+	if (!dp)
+		return;
+	__sync_fetch_and_add(&s->b->ndirs, 1);
+	while (dir_next(dp, &de) > 0)
+	{
+		struct found *f;
+		
+		if (!de.inode || (de.inode >= s->b->nents) || !de.name_len || DIRENT_IS_DOT(&de) || DIRENT_IS_DOTDOT(&de))
+			continue;
+		f = &s->local[s->nlocal++];
+		f->ino = de.inode;
+		f->parent = ino;
+		f->len = de.name_len;
+		memcpy(f->name, de.name, de.name_len);
+		if (s->nlocal == 64)
+		{
+			_flush(s->b, s->local, s->nlocal);
+			s->nlocal = 0;
+		}
+	}
+	dir_close(dp);
+}
+
+static void *_sweep_worker(void *arg)
+{
+	struct builder *b = arg;
+	const uint8_t *gdt = block_group_desc_table(b->e3t);
+	struct e3_group_desc gd;
+	struct sweep *s;
+	int bg;
+	
+	s = malloc(sizeof(*s));
+	if (!s)
+	{
+		perror("ipath_build: malloc");
+		return NULL;
+	}
+	s->b = b;
+	s->nlocal = 0;
+	for (;;)
+	{
+		pthread_mutex_lock(&b->lock);
+		bg = b->nextgroup++;
+		pthread_mutex_unlock(&b->lock);
+		if (bg >= b->e3t->ngroups)
+			break;
+		if (gdt)
+		{
+			block_group_desc_decode(b->e3t, (uint8_t *)gdt + bg * SB_DESC_SIZE(&b->e3t->sb), &gd);
+			if (gd.flags & BG_INODE_UNINIT)
+				continue;
+		}
+		if (inode_table_scan(b->e3t, bg, _sweep_dir, s) < 0)
+			E3DEBUG(E3TOOLS_PFX "couldn't find group %d's inode table; its directories won't be in the path index\n", bg);
+	}
+	if (s->nlocal)
+		_flush(b, s->local, s->nlocal);
+	free(s);
+	
+	return NULL;
+}
+
+/* Makes e3t->ipath, from the index if it has one, or else by reading
+ * every directory on the filesystem with nthreads threads. */
+int ipath_build(e3tools_t *e3t, int nthreads)
+{
+	struct builder b;
+	struct ipath *ip;
+	pthread_t *threads = NULL;
+	int i, started = 0;
+	
+	if (e3t->ipath)
+		return 0;
+	if (!e3t->geom)
+		return -1;
+	ip = calloc(1, sizeof(*ip));
+	if (!ip)
+		return -1;
+	
+	if (index_names_get(e3t, &ip->ents, &ip->nents, &ip->arena, &ip->arenalen) == 0)
+	{
+		ip->mapped = 1;
+		e3t->ipath = ip;
+		return 0;
+	}
+	
+	memset(&b, 0, sizeof(b));
+	b.e3t = e3t;
+	b.nents = e3t->sb.s_inodes_count + 1;
+	b.ents = calloc(b.nents, sizeof(*b.ents));
+	b.arenalen = 1;		/* so that no name is at 0 */
+	b.arenaalloc = 65536;
+	b.arena = malloc(b.arenaalloc);
+	if (!b.ents || !b.arena)
+	{
+		perror("ipath_build: malloc");
+		free(b.ents);
+		free(b.arena);
+		free(ip);
+		return -1;
+	}
+	b.arena[0] = 0;
+	pthread_mutex_init(&b.lock, NULL);
+	
+	if (nthreads > 1)
+	{
+		threads = malloc(nthreads * sizeof(pthread_t));
+		for (i = 0; threads && (i < nthreads); i++)
+		{
+			if (pthread_create(&threads[i], NULL, _sweep_worker, &b) != 0)
+				break;
+			started++;
+		}
+	}
+	if (started == 0)
+		_sweep_worker(&b);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&b.lock);
+	
+	E3DEBUG(E3TOOLS_PFX "path index: %d directories, %llu bytes of names\n", b.ndirs, (unsigned long long)b.arenalen);
+	ip->ents = b.ents;
+	ip->nents = b.nents;
+	ip->arena = b.arena;
+	ip->arenalen = b.arenalen;
+	e3t->ipath = ip;
+	index_names_put(e3t);
+	return 0;
+}
+
+/* Puts a path for ino in buf, building it from the end.  Returns 0, or 1
+ * if the chain of parents stops short of the root, in which case the path
+ * starts with the last directory we could get to, as "<inode>"; or -1 if
+ * we know nothing about ino, the chain loops, or it doesn't fit. */
+int ipath_path(e3tools_t *e3t, uint32_t ino, char *buf, int len)
+{
+	struct ipath *ip = e3t->ipath;
+	int pos = len - 1;
+	int depth, n;
+	
+	if (!ip || (ino >= ip->nents) || (len < 2))
+		return -1;
+	buf[pos] = '\0';
+	if (ino == ROOT_INO)
+	{
+		strcpy(buf, "/");
+		return 0;
+	}
+	if (!ip->ents[ino].name)
+		return -1;
+	
+	for (depth = 0; ino != ROOT_INO; depth++)
+	{
+		const struct ipath_entry *e;
+		const uint8_t *name;
+		
+		if (depth > 4096)
+			return -1;	/* Deeper than anything real; a loop. */
+		if ((ino >= ip->nents) || !ip->ents[ino].name)
+		{
+			char top[16];
+			
+			n = snprintf(top, sizeof(top), "<%u>", ino);
+			if (pos < n)
+				return -1;
+			pos -= n;
+			memcpy(buf + pos, top, n);
+			memmove(buf, buf + pos, len - pos);
+			return 1;
+		}
+		e = &ip->ents[ino];
+		if (e->name + U64(1) + ip->arena[e->name] > ip->arenalen)
+			return -1;
+		name = ip->arena + e->name;
+		if (pos < *name + 1)
+			return -1;
+		pos -= *name;
+		memcpy(buf + pos, name + 1, *name);
+		buf[--pos] = '/';
+		ino = e->parent;
+	}
+	
+	memmove(buf, buf + pos, len - pos);
+	return 0;
+}
+
+void ipath_free(e3tools_t *e3t)
+{
+	struct ipath *ip = e3t->ipath;
+	
+	if (!ip)
+		return;
+	if (!ip->mapped)
+	{
+		free((void *)ip->ents);
+		free((void *)ip->arena);
+	}
+	free(ip);
+	e3t->ipath = NULL;
+}
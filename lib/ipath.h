@@ -0,0 +1,30 @@
+#ifndef _IPATH_H
+#define _IPATH_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+
+/* Where an inode was found: the directory it's in, and where its name is
+ * in the arena (a length byte, then the name).  Name 0 means no directory
+ * we swept had it. */
+struct ipath_entry {
+	uint32_t parent;
+	uint32_t name;
+};
+
+/* One entry for every inode number, 0 included, so an inode's entry is
+ * just ents[ino]. */
+struct ipath {
+	const struct ipath_entry *ents;
+	uint32_t nents;
+	const uint8_t *arena;
+	uint64_t arenalen;
+	int mapped;		/* ents and arena belong to the index, not to us */
+};
+
+extern int ipath_build(e3tools_t *e3t, int nthreads);
+extern int ipath_path(e3tools_t *e3t, uint32_t ino, char *buf, int len);
+extern void ipath_free(e3tools_t *e3t);
+
+#endif
@@ -0,0 +1,484 @@
+// e3tools journal overlay
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "diskio.h"
+#include "inode.h"
+#include "journal.h"
+#include "bufpool.h"
+
+/* If the filesystem went down with transactions in its journal that were
+ * committed but never checkpointed, the newest copies of those metadata
+ * blocks are in the journal and not where they belong.  journal_open()
+ * walks the log once, from s_start onwards, in the same order that
+ * e2fsck would replay it, and remembers for each filesystem block where
+ * its latest committed copy lives.  Reads below the COW layer then come
+ * from there instead, so every tool sees the filesystem as replaying the
+ * journal would have left it -- without writing anything.
+ *
+ * We don't check the journal's checksums: a transaction counts if its
+ * commit block is there with the right sequence number, like it did
+ * before there were checksums. */
+
+struct jmap {
+	block_t block;		/* filesystem block ... */
+	block_t copy;		/* ... and where its newest copy is; 0 if revoked */
+	uint32_t seq;
+	uint32_t flags;		/* JBD_FLAG_ESCAPE, or not */
+};
+#define JMAP_USED 0x80000000	/* in the scan's hash table */
+
+struct e3journal {
+	struct jmap *map;	/* sorted by block, revoked ones taken out */
+	uint64_t nmap;
+};
+
+#define JOURNAL_CHUNK 256	/* blocks read at a time */
+
+static uint32_t _be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t _be16(const uint8_t *p)
+{
+	return ((uint16_t)p[0] << 8) | p[1];
+}
+
+/* Streams the journal inode's blocks in, a chunk at a time.  The log is
+ * only ever read going forwards (wrapping once, at the end), and blocks
+ * that we only need the location of -- the logged copies themselves --
+ * are never read at all. */
+struct jcursor {
+	e3tools_t *e3t;
+	struct ext2_inode inode;
+	int bs;
+	uint32_t first, maxlen;
+	uint8_t *buf;
+	uint32_t bufstart, bufn;
+	block_t run_start, run_len, run_disk;	/* last extent looked up */
+};
+
+static block_t _jphys(struct jcursor *jc, uint32_t lblk)
+{
+	if ((lblk < jc->run_start) || (lblk - jc->run_start >= jc->run_len))
+	{
+		jc->run_start = lblk;
+		jc->run_disk = inode_map_block(jc->e3t, &jc->inode, lblk, &jc->run_len);
+		if ((jc->run_disk == IBLOCK_ERROR) || !jc->run_disk)
+		{
+			jc->run_len = 0;
+			return 0;
+		}
+	}
+	return jc->run_disk + (lblk - jc->run_start);
+}
+
+static const uint8_t *_jread(struct jcursor *jc, uint32_t lblk)
+{
+	uint32_t n, got;
+	block_t phys, run;
+	
+	if ((lblk >= jc->bufstart) && (lblk - jc->bufstart < jc->bufn))
+		return jc->buf + (lblk - jc->bufstart) * jc->bs;
+	
+	jc->bufstart = lblk;
+	jc->bufn = 0;
+	n = ((jc->maxlen - lblk) < JOURNAL_CHUNK) ? (jc->maxlen - lblk) : JOURNAL_CHUNK;
+	for (got = 0; got < n; got += run)
+	{
+		phys = _jphys(jc, lblk + got);
+		if (!phys)
+			break;
+		run = jc->run_len - (lblk + got - jc->run_start);
+		if (run > n - got)
+			run = n - got;
+		if (disk_read_blocks(jc->e3t, phys, run, jc->buf + got * jc->bs) < 0)
+			break;
+		jc->bufn = got + run;
+	}
+	
+	return jc->bufn ? jc->buf : NULL;
+}
+
+/* While scanning: every block logged by a committed transaction, in an
+ * open addressing hash on the block number. */
+struct jhash {
+	struct jmap *slots;
+	uint64_t nslots;	/* always a power of two */
+	uint64_t nused;
+};
+
+static uint64_t _jhash_slot(struct jhash *h, block_t block)
+{
+	uint64_t i = (block * 0x9E3779B97F4A7C15ULL) & (h->nslots - 1);
+	
+	while ((h->slots[i].flags & JMAP_USED) && (h->slots[i].block != block))
+		i = (i + 1) & (h->nslots - 1);
+	return i;
+}
+
+static int _jhash_grow(struct jhash *h)
+{
+	struct jhash nh;
+	uint64_t i;
+	
+	nh.nslots = h->nslots ? (h->nslots * 2) : 1024;
+	nh.nused = h->nused;
+	nh.slots = calloc(nh.nslots, sizeof(struct jmap));
+	if (!nh.slots)
+	{
+		perror("journal: calloc");
+		return -1;
+	}
+	for (i = 0; i < h->nslots; i++)
+		if (h->slots[i].flags & JMAP_USED)
+			nh.slots[_jhash_slot(&nh, h->slots[i].block)] = h->slots[i];
+	free(h->slots);
+	*h = nh;
+	return 0;
+}
+
+/* A transaction's blocks go in first and its revokes after, since a revoke
+ * cancels the copy in its own transaction as well as older ones. */
+static int _commit(struct jhash *h, struct jmap *tags, int ntags, block_t *revokes, int nrevokes, uint32_t seq)
+{
+	struct jmap *m;
+	int i;
+	
+	for (i = 0; i < ntags; i++)
+	{
+		if ((h->nused + 1) * 2 > h->nslots)
+			if (_jhash_grow(h) < 0)
+				return -1;
+		m = &h->slots[_jhash_slot(h, tags[i].block)];
+		if (!(m->flags & JMAP_USED))
+			h->nused++;
+		*m = tags[i];
+		m->seq = seq;
+		m->flags |= JMAP_USED;
+	}
+	for (i = 0; (i < nrevokes) && h->nslots; i++)
+	{
+		m = &h->slots[_jhash_slot(h, revokes[i])];
+		if (m->flags & JMAP_USED)
+			m->copy = 0;
+	}
+	return 0;
+}
+
+static int _map_cmp(const void *a, const void *b)
+{
+	const struct jmap *ma = a, *mb = b;
+	
+	return (ma->block > mb->block) - (ma->block < mb->block);
+}
+
+static void *_grow(void *p, int *alloc, int n, size_t size)
+{
+	void *np;
+	
+	if (n < *alloc)
+		return p;
+	*alloc = *alloc ? (*alloc * 2) : 64;
+	np = realloc(p, *alloc * size);
+	if (!np)
+	{
+		perror("journal: realloc");
+		free(p);
+	}
+	return np;
+}
+
+int journal_open(e3tools_t *e3t)
+{
+	struct jcursor jc;
+	struct jhash h;
+	struct e3journal *j;
+	const uint8_t *b;
+	struct jmap *tags = NULL;
+	block_t *revokes = NULL;
+	int ntags = 0, tagalloc = 0, nrevokes = 0, revokealloc = 0;
+	uint32_t incompat = 0, seq, firstseq, pos, scanned;
+	int tagbytes, tail, ntrans = 0;
+	uint64_t i, n;
+	int rv = -1;
+	
+	if (!e3t->sb.s_journal_inum)
+	{
+		E3DEBUG(E3TOOLS_PFX "no journal inode (external journals aren't supported); not using the journal\n");
+		return -1;
+	}
+	
+	memset(&jc, 0, sizeof(jc));
+	memset(&h, 0, sizeof(h));
+	jc.e3t = e3t;
+	jc.bs = SB_BLOCK_SIZE(&e3t->sb);
+	if (inode_find(e3t, e3t->sb.s_journal_inum, &jc.inode) < 0)
+	{
+		E3DEBUG(E3TOOLS_PFX "couldn't read journal inode %d -- inode on fire?\n", e3t->sb.s_journal_inum);
+		return -1;
+	}
+	if (posix_memalign((void **)&jc.buf, BUFPOOL_ALIGN, JOURNAL_CHUNK * jc.bs) != 0)
+	{
+		perror("journal_open: posix_memalign");
+		return -1;
+	}
+	
+	/* The journal superblock says where the log starts and how big the
+	 * ring is. */
+	jc.maxlen = 1;
+	b = _jread(&jc, 0);
+	if (!b || (_be32(b) != JBD_MAGIC) ||
+	    ((_be32(b + 4) != JBD_SUPERBLOCK_V1) && (_be32(b + 4) != JBD_SUPERBLOCK_V2)) ||
+	    (_be32(b + 0xC) != (uint32_t)jc.bs))
+	{
+		E3DEBUG(E3TOOLS_PFX "journal superblock is missing or mangled; not using the journal\n");
+		goto out;
+	}
+	jc.maxlen = _be32(b + 0x10);
+	jc.first = _be32(b + 0x14);
+	seq = firstseq = _be32(b + 0x18);
+	pos = _be32(b + 0x1C);
+	if (_be32(b + 4) == JBD_SUPERBLOCK_V2)
+		incompat = _be32(b + 0x28);
+	jc.bufn = 0;
+	if ((jc.first == 0) || (jc.first >= jc.maxlen) || (U64(jc.maxlen) * jc.bs > INODE_FILE_SIZE(&jc.inode)))
+	{
+		E3DEBUG(E3TOOLS_PFX "journal superblock has a bogus geometry (first %u, length %u); not using the journal\n", jc.first, jc.maxlen);
+		goto out;
+	}
+	if (pos == 0)
+	{
+		E3DEBUG(E3TOOLS_PFX "journal is empty; nothing to lay over the disk\n");
+		goto out;
+	}
+	if ((pos < jc.first) || (pos >= jc.maxlen))
+	{
+		E3DEBUG(E3TOOLS_PFX "journal starts at block %u, outside the log; not using the journal\n", pos);
+		goto out;
+	}
+	
+	if (incompat & JBD_FEATURE_INCOMPAT_CSUM_V3)
+		tagbytes = 16;
+	else
+		tagbytes = 8 + ((incompat & JBD_FEATURE_INCOMPAT_64BIT) ? 4 : 0) + ((incompat & JBD_FEATURE_INCOMPAT_CSUM_V2) ? 2 : 0);
+	tail = (incompat & (JBD_FEATURE_INCOMPAT_CSUM_V2 | JBD_FEATURE_INCOMPAT_CSUM_V3)) ? 4 : 0;
+
+#define NEXT(p) (((p) + 1 == jc.maxlen) ? jc.first : ((p) + 1))
+	
+	/* One trip around the ring at most; the log ends at the first block
+	 * that isn't the next thing we expect. */
+	for (scanned = 0; scanned < jc.maxlen - jc.first; )
+	{
+		uint32_t type;
+		int off;
+		
+		b = _jread(&jc, pos);
+		if (!b || (_be32(b) != JBD_MAGIC) || (_be32(b + 8) != seq))
+			break;
+		type = _be32(b + 4);
+		
+		if (type == JBD_DESCRIPTOR_BLOCK)
+		{
+			uint32_t flags = 0;
+			
+			for (off = JBD_HEADER_SIZE; !(flags & JBD_FLAG_LAST_TAG) && (off + tagbytes <= jc.bs - tail); off += tagbytes)
+			{
+				block_t block = _be32(b + off);
+				
+				flags = (tagbytes == 16) ? _be32(b + off + 4) : _be16(b + off + 6);
+				if (incompat & JBD_FEATURE_INCOMPAT_64BIT)
+					block |= U64(_be32(b + off + 8)) << 32;
+				if (!(flags & JBD_FLAG_SAME_UUID))
+					off += 16;
+				
+				pos = NEXT(pos);
+				scanned++;
+				tags = _grow(tags, &tagalloc, ntags, sizeof(*tags));
+				if (!tags)
+					goto out;
+				tags[ntags].block = block;
+				tags[ntags].copy = _jphys(&jc, pos);
+				tags[ntags].flags = flags & JBD_FLAG_ESCAPE;
+				if (tags[ntags].copy)
+					ntags++;
+			}
+		} else if (type == JBD_REVOKE_BLOCK) {
+			int rsz = (incompat & JBD_FEATURE_INCOMPAT_64BIT) ? 8 : 4;
+			int count = _be32(b + JBD_HEADER_SIZE);
+			
+			if (count > jc.bs - tail)
+				count = jc.bs - tail;
+			for (off = JBD_HEADER_SIZE + 4; off + rsz <= count; off += rsz)
+			{
+				revokes = _grow(revokes, &revokealloc, nrevokes, sizeof(*revokes));
+				if (!revokes)
+					goto out;
+				revokes[nrevokes++] = (rsz == 8) ? ((U64(_be32(b + off)) << 32) | _be32(b + off + 4)) : _be32(b + off);
+			}
+		} else if (type == JBD_COMMIT_BLOCK) {
+			if (_commit(&h, tags, ntags, revokes, nrevokes, seq) < 0)
+				goto out;
+			ntags = nrevokes = 0;
+			ntrans++;
+			seq++;
+		} else {
+			break;
+		}
+		
+		pos = NEXT(pos);
+		scanned++;
+	}
+
+#undef NEXT
+	
+	if (ntags || nrevokes)
+		E3DEBUG(E3TOOLS_PFX "journal transaction %u was never committed; ignoring it\n", seq);
+	
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		goto out;
+	for (i = n = 0; i < h.nslots; i++)
+		if ((h.slots[i].flags & JMAP_USED) && h.slots[i].copy)
+			h.slots[n++] = h.slots[i];
+	qsort(h.slots, n, sizeof(struct jmap), _map_cmp);
+	j->map = h.slots;
+	j->nmap = n;
+	h.slots = NULL;
+	e3t->journal = j;
+	rv = 0;
+	
+	E3DEBUG(E3TOOLS_PFX "journal: %d committed transactions (%u to %u), laying %lld blocks over the disk\n",
+		ntrans, firstseq, seq - 1, (long long int)n);
+
+out:
+	free(h.slots);
+	free(tags);
+	free(revokes);
+	free(jc.buf);
+	return rv;
+}
+
+void journal_close(e3tools_t *e3t)
+{
+	if (!e3t->journal)
+		return;
+	free(e3t->journal->map);
+	free(e3t->journal);
+	e3t->journal = NULL;
+}
+
+/* The first entry for a block at or after block. */
+static uint64_t _lower_bound(struct e3journal *j, block_t block)
+{
+	uint64_t lo = 0, hi = j->nmap, mid;
+	
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (j->map[mid].block < block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Reads n sectors of a journalled copy straight from the mechanism; the
+ * COW layer is above us, and has already had its say. */
+static int _read_copy(e3tools_t *e3t, struct jmap *m, int ofs, int n, uint8_t *buf)
+{
+	sector_t spb = SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR;
+	sector_t s = m->copy * spb + ofs;
+	int i;
+	
+	if (e3t->debug & E3TOOLS_DBG_DISKIO)
+		E3DEBUG(E3TOOLS_PFX "block %lld comes from the journal, at block %lld\n", (long long int)m->block, (long long int)m->copy);
+	
+	if (!e3t->disk->read_sectors || (e3t->disk->read_sectors(e3t->disk, s, n, buf) < 0))
+		for (i = 0; i < n; i++)
+			if (e3t->disk->read_sector(e3t->disk, s + i, buf + i * BYTES_PER_SECTOR) < 0)
+				return -1;
+	
+	if ((m->flags & JBD_FLAG_ESCAPE) && (ofs == 0))
+	{
+		buf[0] = (JBD_MAGIC >> 24) & 0xFF;
+		buf[1] = (JBD_MAGIC >> 16) & 0xFF;
+		buf[2] = (JBD_MAGIC >> 8) & 0xFF;
+		buf[3] = JBD_MAGIC & 0xFF;
+	}
+	return 0;
+}
+
+/* Returns 1 if sector s was read from the journal, or 0 if it should come
+ * from the disk as usual (including if the journal's copy is unreadable). */
+int journal_read_sector(e3tools_t *e3t, sector_t s, uint8_t *buf)
+{
+	struct e3journal *j = e3t->journal;
+	sector_t spb = SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR;
+	uint64_t i;
+	
+	if (!j)
+		return 0;
+	i = _lower_bound(j, s / spb);
+	if ((i == j->nmap) || (j->map[i].block != s / spb))
+		return 0;
+	return _read_copy(e3t, &j->map[i], s % spb, 1, buf) == 0;
+}
+
+/* Lays whatever the journal has for sectors s .. s + n - 1 over buf,
+ * which has been read from the disk already. */
+void journal_read_range(e3tools_t *e3t, sector_t s, int n, uint8_t *buf)
+{
+	struct e3journal *j = e3t->journal;
+	sector_t spb = SB_BLOCK_SIZE(&e3t->sb) / BYTES_PER_SECTOR;
+	uint8_t *tmp = NULL;
+	sector_t first, last;
+	uint64_t i;
+	
+	if (!j || (n <= 0))
+		return;
+	for (i = _lower_bound(j, s / spb); (i < j->nmap) && (j->map[i].block * spb < s + n); i++)
+	{
+		first = j->map[i].block * spb;
+		last = first + spb;
+		if (first < s)
+			first = s;
+		if (last > s + n)
+			last = s + n;
+		/* If the copy is unreadable, what's on the disk will have to do. */
+		if (!tmp)
+			tmp = buf_borrow(e3t);
+		if (tmp && _read_copy(e3t, &j->map[i], first - j->map[i].block * spb, last - first, tmp) == 0)
+			memcpy(buf + (first - s) * BYTES_PER_SECTOR, tmp, (last - first) * BYTES_PER_SECTOR);
+	}
+	buf_return(e3t, tmp);
+}
+
+/* For the index: what the journal has done to the disk. */
+uint64_t journal_digest(e3tools_t *e3t)
+{
+	struct e3journal *j = e3t->journal;
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	uint64_t i;
+	
+	if (!j)
+		return 0;
+	for (i = 0; i < j->nmap; i++)
+	{
+		h ^= j->map[i].block;
+		h *= 1099511628211ULL;
+		h ^= j->map[i].copy;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
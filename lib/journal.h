@@ -0,0 +1,37 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "diskio.h"
+
+struct e3journal;	// opaque; defined in journal.c
+
+extern int journal_open(e3tools_t *e3t);
+extern void journal_close(e3tools_t *e3t);
+extern int journal_read_sector(e3tools_t *e3t, sector_t s, uint8_t *buf);
+extern void journal_read_range(e3tools_t *e3t, sector_t s, int n, uint8_t *buf);
+extern uint64_t journal_digest(e3tools_t *e3t);
+
+/* JBD on-disk format; everything in the journal is big-endian. */
+#define JBD_MAGIC 0xC03B3998U
+
+#define JBD_DESCRIPTOR_BLOCK 1
+#define JBD_COMMIT_BLOCK 2
+#define JBD_SUPERBLOCK_V1 3
+#define JBD_SUPERBLOCK_V2 4
+#define JBD_REVOKE_BLOCK 5
+
+#define JBD_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD_FEATURE_INCOMPAT_64BIT 0x2
+#define JBD_FEATURE_INCOMPAT_CSUM_V2 0x8
+#define JBD_FEATURE_INCOMPAT_CSUM_V3 0x10
+
+#define JBD_FLAG_ESCAPE 0x1	/* the block started with JBD_MAGIC, which was zeroed */
+#define JBD_FLAG_SAME_UUID 0x2	/* no 16 byte UUID follows this tag */
+#define JBD_FLAG_LAST_TAG 0x8
+
+#define JBD_HEADER_SIZE 12	/* h_magic, h_blocktype, h_sequence */
+
+#endif
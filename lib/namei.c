@@ -0,0 +1,329 @@
+// e3tools path name resolution
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "inode.h"
+#include "dir.h"
+#include "htree.h"
+#include "index.h"
+#include "ipath.h"
+#include "namei.h"
+
+/* The dentry cache remembers (directory, name) -> inode for every name that
+ * we have seen while scanning a directory, so that once a directory has
+ * been read, lookups in it never go back to the disk.  A directory that
+ * was scanned from one end to the other also gets a "complete" marker --
+ * an entry with an empty name -- which lets misses be answered from the
+ * cache too.  Names found through a hash tree index are cached one at a
+ * time.  Misses there aren't: a damaged index can lose names that are
+ * still in the directory, so a miss is checked by reading the whole of
+ * it, once, after which the marker answers the rest. */
+struct dentry {
+	struct dentry *next;
+	uint32_t dir;
+	uint32_t ino;
+	uint32_t hash;
+	uint8_t len;
+	char name[];
+};
+
+struct dcache {
+	struct dentry **buckets;
+	uint32_t nbuckets;	/* always a power of two */
+	uint32_t nentries;
+};
+
+static uint32_t _hash(uint32_t dir, const char *name, int len)
+{
+	uint32_t h = 2166136261u ^ dir;	/* FNV-1a */
+	int i;
+	
+	for (i = 0; i < len; i++)
+	{
+		h ^= (uint8_t)name[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static struct dcache *_dcache(e3tools_t *e3t)
+{
+	struct dcache *dc = e3t->dcache;
+	
+	if (dc)
+		return dc;
+	
+	dc = malloc(sizeof(*dc));
+	if (!dc)
+		return NULL;
+	dc->nbuckets = 1024;
+	dc->nentries = 0;
+	dc->buckets = calloc(dc->nbuckets, sizeof(struct dentry *));
+	if (!dc->buckets)
+	{
+		free(dc);
+		return NULL;
+	}
+	e3t->dcache = dc;
+	return dc;
+}
+
+static struct dentry *_dcache_find(struct dcache *dc, uint32_t dir, const char *name, int len, uint32_t hash)
+{
+	struct dentry *de;
+	
+	for (de = dc->buckets[hash & (dc->nbuckets - 1)]; de; de = de->next)
+		if ((de->hash == hash) && (de->dir == dir) && (de->len == len) && !memcmp(de->name, name, len))
+			return de;
+	return NULL;
+}
+
+static void _dcache_grow(struct dcache *dc)
+{
+	struct dentry **nb;
+	struct dentry *de, *next;
+	uint32_t i;
+	
+	nb = calloc(dc->nbuckets * 2, sizeof(struct dentry *));
+	if (!nb)
+		return;	/* Chains just get longer; oh well. */
+	
+	for (i = 0; i < dc->nbuckets; i++)
+		for (de = dc->buckets[i]; de; de = next)
+		{
+			next = de->next;
+			de->next = nb[de->hash & (dc->nbuckets * 2 - 1)];
+			nb[de->hash & (dc->nbuckets * 2 - 1)] = de;
+		}
+	free(dc->buckets);
+	dc->buckets = nb;
+	dc->nbuckets *= 2;
+}
+
+static void _dcache_add(struct dcache *dc, uint32_t dir, const char *name, int len, uint32_t ino)
+{
+	uint32_t hash = _hash(dir, name, len);
+	struct dentry *de;
+	
+	if (_dcache_find(dc, dir, name, len, hash))
+		return;	/* First one wins, like a linear lookup would. */
+	
+	de = malloc(sizeof(*de) + len);
+	if (!de)
+		return;
+	de->dir = dir;
+	de->ino = ino;
+	de->hash = hash;
+	de->len = len;
+	memcpy(de->name, name, len);
+	
+	if (dc->nentries >= dc->nbuckets)
+		_dcache_grow(dc);
+	de->next = dc->buckets[hash & (dc->nbuckets - 1)];
+	dc->buckets[hash & (dc->nbuckets - 1)] = de;
+	dc->nentries++;
+}
+
+void dcache_free(e3tools_t *e3t)
+{
+	struct dcache *dc = e3t->dcache;
+	struct dentry *de, *next;
+	uint32_t i;
+	
+	if (!dc)
+		return;
+	for (i = 0; i < dc->nbuckets; i++)
+		for (de = dc->buckets[i]; de; de = next)
+		{
+			next = de->next;
+			free(de);
+		}
+	free(dc->buckets);
+	free(dc);
+	e3t->dcache = NULL;
+}
+
+/* Reads all of dir into the cache, or, if stop is given, just as far as
+ * its first two entries ("." and ".."). */
+static int _dcache_fill(e3tools_t *e3t, struct dcache *dc, int dir, int stop)
+{
+	struct dir *dp;
+	struct dirent_view de;
+	int rv;
+	int n = 0;
+	
+	dp = dir_open(e3t, dir);
+	if (!dp)
+		return -1;
+	while ((!stop || (n++ < 2)) && ((rv = dir_next(dp, &de)) > 0))
+		if (de.inode && de.name_len)
+			_dcache_add(dc, dir, de.name, de.name_len, de.inode);
+	dir_close(dp);
+	
+	if (!stop && (rv == 0))
+		_dcache_add(dc, dir, "", 0, 1);
+	return stop ? 0 : rv;
+}
+
+/* Looks up one name in directory dir; returns its inode, or -1. */
+int dir_lookup(e3tools_t *e3t, int dir, const char *name, int len)
+{
+	struct dcache *dc = _dcache(e3t);
+	struct ext2_inode inode;
+	struct dentry *de;
+	int ino;
+	
+	if (!dc || (len <= 0) || (len > 255))
+		return -1;
+	
+	de = _dcache_find(dc, dir, name, len, _hash(dir, name, len));
+	if (de)
+		return de->ino;
+	if (_dcache_find(dc, dir, "", 0, _hash(dir, "", 0)))
+		return -1;	/* We've seen the whole thing, and it isn't there. */
+	
+	if (inode_find(e3t, dir, &inode) < 0)
+		return -1;
+	if ((inode.i_mode & 0xF000) != 0x4000)
+		return -1;	/* Not a directory; don't go parsing file data as one. */
+	
+	/* A big directory with an index gets searched through that, rather
+	 * than being read end to end; "." and ".." aren't in the index, but
+	 * they are always the first two records. */
+	if ((e3t->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) && (inode.i_flags & INODE_INDEX_FL))
+	{
+		if ((len <= 2) && !memcmp(name, "..", len))
+			_dcache_fill(e3t, dc, dir, 1);
+		else if ((ino = htree_lookup(e3t, dir, &inode, name, len)) > 0)
+			_dcache_add(dc, dir, name, len, ino);
+		else if (ino < 0)
+			E3DEBUG(E3TOOLS_PFX "directory inode %d has a broken hash tree index; searching it the slow way\n", dir);
+		
+		de = _dcache_find(dc, dir, name, len, _hash(dir, name, len));
+		if (de)
+			return de->ino;
+	}
+	
+	if (_dcache_fill(e3t, dc, dir, 0) < 0)
+		return -1;
+	de = _dcache_find(dc, dir, name, len, _hash(dir, name, len));
+	return (de && de->ino) ? (int)de->ino : -1;
+}
+
+/* Resolves path, relative to directory dir unless it starts with a slash.
+ * Symlinks are not followed -- on a filesystem this damaged, they are as
+ * likely to lead somewhere bogus as not. */
+int namei_at(e3tools_t *e3t, int dir, const char *path)
+{
+	const char *p = path;
+	
+	if (*p == '/')
+		dir = ROOT_INO;
+	
+	while (*p)
+	{
+		const char *end;
+		
+		while (*p == '/')
+			p++;
+		for (end = p; *end && (*end != '/'); end++)
+			;
+		if ((end == p) || ((end - p == 1) && (*p == '.')))
+		{
+			p = end;
+			continue;
+		}
+		
+		dir = dir_lookup(e3t, dir, p, end - p);
+		if (dir < 0)
+			return -1;
+		p = end;
+	}
+	
+	return dir;
+}
+
+int namei(e3tools_t *e3t, const char *path)
+{
+	return namei_at(e3t, ROOT_INO, path);
+}
+
+/* The other way around: works out a path for directory inode dir, by
+ * following ".." up to the root and finding each directory's name in its
+ * parent.  The index, if we have one, remembers the ".."s from earlier
+ * runs; if something has built the path index, that's asked first.
+ * Returns -1 if the chain is broken, loops, or doesn't fit. */
+int namei_path(e3tools_t *e3t, int dir, char *buf, int len)
+{
+	int pos = len - 1;
+	int depth;
+	
+	if (len < 2)
+		return -1;
+	if (e3t->ipath && (ipath_path(e3t, dir, buf, len) == 0))
+		return 0;
+	buf[pos] = '\0';
+	
+	for (depth = 0; dir != ROOT_INO; depth++)
+	{
+		struct dir *dp;
+		struct dirent_view de;
+		int parent = index_parent(e3t, dir);
+		int found = 0;
+		
+		if (depth > 4096)
+			return -1;	/* Deeper than anything real; a loop. */
+		if (!parent)
+			parent = dir_lookup(e3t, dir, "..", 2);
+		if ((parent <= 0) || (parent == dir))
+			return -1;
+		
+		dp = dir_open(e3t, parent);
+		if (!dp)
+			return -1;
+		while (dir_next(dp, &de) > 0)
+			if ((de.inode == (uint32_t)dir) && !DIRENT_IS_DOT(&de) && !DIRENT_IS_DOTDOT(&de))
+			{
+				found = 1;
+				break;
+			}
+		if (found && (pos > de.name_len))
+		{
+			pos -= de.name_len;
+			memcpy(buf + pos, de.name, de.name_len);
+			buf[--pos] = '/';
+		}
+		dir_close(dp);
+		if (!found || (pos <= 0))
+			return -1;
+		dir = parent;
+	}
+	
+	if (pos == len - 1)
+		buf[--pos] = '/';
+	memmove(buf, buf + pos, len - pos);
+	return 0;
+}
+
+/* For tools that take an inode on the command line: a number is an inode
+ * number, and anything starting with a slash is a path. */
+int namei_arg(e3tools_t *e3t, const char *arg)
+{
+	int ino;
+	
+	if (arg[0] != '/')
+		return strtoll(arg, NULL, 0);
+	
+	ino = namei(e3t, arg);
+	if (ino < 0)
+		printf("%s: no such path\n", arg);
+	return ino;
+}
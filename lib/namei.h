@@ -0,0 +1,17 @@
+#ifndef _NAMEI_H
+#define _NAMEI_H
+
+#include "e3tools.h"
+
+#define ROOT_INO 2
+
+struct dcache;	// opaque; defined in namei.c
+
+extern int namei(e3tools_t *e3t, const char *path);
+extern int namei_at(e3tools_t *e3t, int dir, const char *path);
+extern int namei_arg(e3tools_t *e3t, const char *arg);
+extern int dir_lookup(e3tools_t *e3t, int dir, const char *name, int len);
+extern int namei_path(e3tools_t *e3t, int dir, char *buf, int len);
+extern void dcache_free(e3tools_t *e3t);
+
+#endif
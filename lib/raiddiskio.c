@@ -30,6 +30,7 @@ struct raiddiskio {
 
 static diskio_t *_open(char *str);
 static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf);
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf);
 static int _close(diskio_t *disk);
 static int _lame_sector(diskio_t *disk, sector_t s);
 static int __is_lame(struct raiddiskio *rd, chunk_t c);
@@ -37,6 +38,7 @@ static int __is_lame(struct raiddiskio *rd, chunk_t c);
 diskio_t raiddisk_ops = {
 	.open = _open,
 	.read_sector = _read_sector,
+	.read_sectors = _read_sectors,
 	.close = _close,
 	.lame_sector = _lame_sector,
 };
@@ -117,13 +119,37 @@ static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf)
 	
 	__compute_disklocs(rd, s, &new_sector, &pd_idx, &dd_idx);
 
-	if (lseek64(rd->diskfd[dd_idx], new_sector * BYTES_PER_SECTOR, SEEK_SET) == (off64_t)-1)
-		return -1;	/* oh well */
-	if (read(rd->diskfd[dd_idx], buf, BYTES_PER_SECTOR) < BYTES_PER_SECTOR)
+	if (pread64(rd->diskfd[dd_idx], buf, BYTES_PER_SECTOR, new_sector * BYTES_PER_SECTOR) < BYTES_PER_SECTOR)
 		return -1;
 	return 0;
 }
 
+/* A chunk is contiguous on whichever disk it lives on, so a range turns
+ * into one read per chunk that it touches. */
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf)
+{
+	struct raiddiskio *rd = (struct raiddiskio *)disk;
+	int pd_idx, dd_idx;
+	sector_t new_sector;
+	int len;
+	
+	s += (sector_t)LVM_OFFSET;
+	
+	while (n > 0)
+	{
+		len = SECTORS_PER_CHUNK - s % SECTORS_PER_CHUNK;
+		if (len > n)
+			len = n;
+		__compute_disklocs(rd, s, &new_sector, &pd_idx, &dd_idx);
+		if (pread64(rd->diskfd[dd_idx], buf, len * BYTES_PER_SECTOR, new_sector * BYTES_PER_SECTOR) < len * BYTES_PER_SECTOR)
+			return -1;
+		s += len;
+		n -= len;
+		buf += len * BYTES_PER_SECTOR;
+	}
+	return 0;
+}
+
 static int __is_lame(struct raiddiskio *rd, chunk_t c)
 {
 	int i;
@@ -0,0 +1,154 @@
+// e3tools whole-disk scanning
+// Utility to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "e3tools.h"
+#include "superblock.h"
+#include "diskio.h"
+#include "scan.h"
+#include "bufpool.h"
+
+/* The carvers all want the same thing: every block in some set of ranges
+ * (usually the whole disk) handed to a function, as fast as the disk can
+ * give them up.  The ranges are cut into big chunks, and a pool of threads
+ * takes them in order, each reading its chunk in one request and then
+ * running the callback over it while the others are reading theirs.  The
+ * chunks go out in ascending order, so the disk sees a few sequential
+ * streams that are close together, rather than seeking about. */
+
+#define SCAN_CHUNK_BYTES (4 * 1024 * 1024)
+
+struct scanner {
+	e3tools_t *e3t;
+	const struct scan_range *ranges;
+	int nranges;
+	int range;		/* next chunk to hand out is in this range ... */
+	block_t ofs;		/* ... this far in */
+	int chunkblocks;
+	scan_fn fn;
+	void *arg;
+	pthread_mutex_t lock;
+	struct scan_stats stats;
+};
+
+/* Takes the next chunk; returns 0 when there are none left. */
+static int _next_chunk(struct scanner *sc, block_t *b, int *n)
+{
+	int rv = 0;
+	
+	pthread_mutex_lock(&sc->lock);
+	while ((sc->range < sc->nranges) && (sc->ofs >= sc->ranges[sc->range].count))
+	{
+		sc->range++;
+		sc->ofs = 0;
+	}
+	if (sc->range < sc->nranges)
+	{
+		const struct scan_range *r = &sc->ranges[sc->range];
+		
+		*b = r->start + sc->ofs;
+		*n = (r->count - sc->ofs > U64(sc->chunkblocks)) ? sc->chunkblocks : (int)(r->count - sc->ofs);
+		sc->ofs += *n;
+		rv = 1;
+	}
+	pthread_mutex_unlock(&sc->lock);
+	
+	return rv;
+}
+
+static void _scan_chunk(struct scanner *sc, uint8_t *buf, block_t b, int n)
+{
+	int bs = SB_BLOCK_SIZE(&sc->e3t->sb);
+	int i, start, bad = 0;
+	
+	if (disk_read_blocks(sc->e3t, b, n, buf) == 0)
+	{
+		sc->fn(sc->arg, b, n, buf);
+	} else {
+		/* Go back over it a block at a time, and hand over the runs
+		 * that could be read. */
+		for (i = 0; i < n; )
+		{
+			for (start = i; (i < n) && (disk_read_block(sc->e3t, b + i, buf + i * bs) == 0); i++)
+				;
+			if (i > start)
+				sc->fn(sc->arg, b + start, i - start, buf + start * bs);
+			if (i < n)
+			{
+				E3DEBUG(E3TOOLS_PFX "scan: couldn't read block %lld; skipping it\n", (long long int)(b + i));
+				bad++;
+				i++;
+			}
+		}
+	}
+	
+	pthread_mutex_lock(&sc->lock);
+	sc->stats.scanned += n;
+	sc->stats.bad += bad;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+static void *_scan_worker(void *arg)
+{
+	struct scanner *sc = arg;
+	uint8_t *buf;
+	block_t b;
+	int n;
+	
+	if (posix_memalign((void **)&buf, BUFPOOL_ALIGN, sc->chunkblocks * SB_BLOCK_SIZE(&sc->e3t->sb)) != 0)
+	{
+		perror("scan: posix_memalign");
+		return NULL;
+	}
+	while (_next_chunk(sc, &b, &n))
+		_scan_chunk(sc, buf, b, n);
+	free(buf);
+	
+	return NULL;
+}
+
+/* Runs fn over every block in ranges, with nthreads threads (or just this
+ * one, if nthreads is 0 or 1).  fn had better be thread safe. */
+int scan_blocks(e3tools_t *e3t, const struct scan_range *ranges, int nranges, int nthreads, scan_fn fn, void *arg, struct scan_stats *stats)
+{
+	struct scanner sc;
+	pthread_t *threads = NULL;
+	int i, started = 0;
+	
+	memset(&sc, 0, sizeof(sc));
+	sc.e3t = e3t;
+	sc.ranges = ranges;
+	sc.nranges = nranges;
+	sc.chunkblocks = SCAN_CHUNK_BYTES / SB_BLOCK_SIZE(&e3t->sb);
+	sc.fn = fn;
+	sc.arg = arg;
+	pthread_mutex_init(&sc.lock, NULL);
+	
+	if (nthreads > 1)
+	{
+		threads = malloc(nthreads * sizeof(pthread_t));
+		for (i = 0; threads && (i < nthreads); i++)
+		{
+			if (pthread_create(&threads[i], NULL, _scan_worker, &sc) != 0)
+				break;
+			started++;
+		}
+	}
+	if (started == 0)
+		_scan_worker(&sc);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	
+	pthread_mutex_destroy(&sc.lock);
+	if (stats)
+		*stats = sc.stats;
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stdint.h>
+
+#include "e3tools.h"
+#include "blockgroup.h"
+
+/* A stretch of the disk to scan. */
+struct scan_range {
+	block_t start;
+	block_t count;
+};
+
+/* Called with n blocks starting at b, from whichever thread read them;
+ * buf is only good until the callback returns. */
+typedef void (*scan_fn)(void *arg, block_t b, int n, const uint8_t *buf);
+
+struct scan_stats {
+	block_t scanned;
+	block_t bad;		/* unreadable, and not handed to the callback */
+};
+
+extern int scan_blocks(e3tools_t *e3t, const struct scan_range *ranges, int nranges, int nthreads, scan_fn fn, void *arg, struct scan_stats *stats);
+
+#endif
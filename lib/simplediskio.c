@@ -19,12 +19,14 @@ struct simplediskio {
 
 static diskio_t *_open(char *str);
 static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf);
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf);
 static int _close(diskio_t *disk);
 static int _lame_sector(diskio_t *disk, sector_t s);
 
 diskio_t simpledisk_ops = {
 	.open = _open,
 	.read_sector = _read_sector,
+	.read_sectors = _read_sectors,
 	.close = _close,
 	.lame_sector = _lame_sector,
 };
@@ -52,13 +54,30 @@ static diskio_t *_open(char *str)
 static int _read_sector(diskio_t *disk, sector_t s, uint8_t *buf)
 {
 	struct simplediskio *sd = (struct simplediskio *)disk;
-	if (lseek64(sd->diskfd, s * BYTES_PER_SECTOR, SEEK_SET) == (off64_t)-1)
-		return -1;	/* oh well */
-	if (read(sd->diskfd, buf, BYTES_PER_SECTOR) < BYTES_PER_SECTOR)
+	/* pread, not lseek and read, so that threads can share the fd. */
+	if (pread64(sd->diskfd, buf, BYTES_PER_SECTOR, s * BYTES_PER_SECTOR) < BYTES_PER_SECTOR)
 		return -1;
 	return 0;
 }
 
+static int _read_sectors(diskio_t *disk, sector_t s, int n, uint8_t *buf)
+{
+	struct simplediskio *sd = (struct simplediskio *)disk;
+	ssize_t len = n * BYTES_PER_SECTOR;
+	ssize_t rv;
+	
+	while (len > 0)
+	{
+		rv = pread64(sd->diskfd, buf, len, s * BYTES_PER_SECTOR);
+		if ((rv <= 0) || (rv % BYTES_PER_SECTOR))
+			return -1;
+		s += rv / BYTES_PER_SECTOR;
+		buf += rv;
+		len -= rv;
+	}
+	return 0;
+}
+
 static int _close(diskio_t *disk)
 {
 	struct simplediskio *sd = (struct simplediskio *)disk;
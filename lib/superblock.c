@@ -7,16 +7,21 @@
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "e3tools.h"
 #include "superblock.h"
+#include "e3bits.h"
+#include "diskio.h"
 
 void superblock_show(e3tools_t *e3t)
 {
 	printf("Superblock from block group %d\n", e3t->sb.s_block_group_nr);
 	printf("\tMagic         : 0x%04X (%s)\n", e3t->sb.s_magic, (e3t->sb.s_magic == 0xEF53) ? "correct" : "INCORRECT");
 	printf("\tInodes        : %d\n", e3t->sb.s_inodes_count);
-	printf("\tBlocks        : %d\n", e3t->sb.s_blocks_count);
+	printf("\tBlocks        : %lld%s\n", (long long int)SB_BLOCKS_COUNT(&e3t->sb), SB_IS_64BIT(&e3t->sb) ? " (64-bit)" : "");
 	printf("\tBlock size    : %d\n", 1024 << e3t->sb.s_log_block_size);
 	printf("\t   on-disk    : %d\n", e3t->sb.s_log_block_size);
 	printf("\tFragment size : %d\n", (e3t->sb.s_log_frag_size > 0) ? (1024 << e3t->sb.s_log_frag_size) : (1024 >> -e3t->sb.s_log_frag_size));
@@ -29,6 +34,7 @@ void superblock_show(e3tools_t *e3t)
 	printf("\tBlocks per       : %d\n", e3t->sb.s_blocks_per_group);
 	printf("\tFragments per    : %d\n", e3t->sb.s_frags_per_group);
 	printf("\tInodes per       : %d\n", e3t->sb.s_inodes_per_group);
+	printf("\tDescriptor size  : %d\n", SB_DESC_SIZE(&e3t->sb));
 	if (e3t->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)
 		printf("\tSuperblocks are sparse -- available at block groups 0, 1, powers of 3, powers of 5, powers of 7.\n");
 	printf("\n");
@@ -39,6 +45,395 @@ void superblock_show(e3tools_t *e3t)
 	}
 	
 	printf("OK, so expect:\n");
-	printf("\tFull block groups      : %d\n", e3t->sb.s_blocks_count / e3t->sb.s_blocks_per_group);
-	printf("\t   (Blocks left over?) : %d\n", e3t->sb.s_blocks_count % e3t->sb.s_blocks_per_group);
+	printf("\tFull block groups      : %lld\n", (long long int)(SB_BLOCKS_COUNT(&e3t->sb) / e3t->sb.s_blocks_per_group));
+	printf("\t   (Blocks left over?) : %lld\n", (long long int)(SB_BLOCKS_COUNT(&e3t->sb) % e3t->sb.s_blocks_per_group));
+}
+
+/* Finding every copy of the superblock and descriptor table and letting
+ * them vote.  Each copy is read by a pool of threads, since they are spread
+ * all across the disk (and, on a RAID, across every member), and then each
+ * 32-bit word that is voted on is whatever most of the copies say it is.
+ * A word that the copies can't agree on goes to the lowest numbered group
+ * that has the winning value, so the primary copy wins ties.
+ *
+ * Only what mke2fs wrote and nothing since changes gets a vote, though.
+ * The kernel only ever updates the primary copies, so the backups' free
+ * counts, state, feature flags and (in the descriptors) uninit flags and
+ * unused inode counts are as old as the filesystem; letting them outvote
+ * the primary would say that groups in use were never touched.  Those come
+ * from the primary, and only where it couldn't be read at all from the
+ * backups, with the uninit flags cleared so that nothing gets skipped.
+ *
+ * Descriptor tables can run to megabytes, and there may be 64 copies of
+ * one; they are read and voted on a piece at a time, so that only a piece
+ * of each is ever in memory. */
+
+#define CONSENSUS_MAX_COPIES 64
+#define CONSENSUS_THREADS 8
+#define CONSENSUS_PIECE_SECTORS 64	/* a whole number of descriptors, however big */
+#define SB_BYTES 1024
+#define SB_GROUP_NR_OFS 0x5A
+
+/* Superblock fields that the kernel keeps up to date in the primary copy
+ * only. */
+static const struct {
+	int ofs;
+	int len;
+} sb_dynamic[] = {
+	{ 0x0C, 8 },	/* s_free_blocks_count, s_free_inodes_count */
+	{ 0x2C, 10 },	/* s_mtime, s_wtime, s_mnt_count */
+	{ 0x3A, 2 },	/* s_state */
+	{ 0x40, 4 },	/* s_lastcheck */
+	{ 0x5C, 12 },	/* s_feature_compat, _incompat, _ro_compat */
+	{ 0xE8, 4 },	/* s_last_orphan */
+	{ 0x158, 4 },	/* s_free_blocks_count_hi */
+	{ 0x178, 8 },	/* s_kbytes_written */
+	{ 0x3FC, 4 },	/* s_checksum */
+};
+
+/* Where a descriptor keeps its locations (the _hi halves only in 64-byte
+ * ones), and the fields the kernel changes as groups get used. */
+static const int gd_locations[] = { 0x00, 0x04, 0x08, 0x20, 0x24, 0x28 };
+#define GD_FLAGS_OFS 0x12
+#define GD_ITABLE_UNUSED_OFS 0x1C
+#define GD_ITABLE_UNUSED_HI_OFS 0x32
+
+struct sbcopy {
+	int bg;
+	sector_t sector;
+	int nsect;
+	uint8_t *buf;
+	int ok;			/* this piece read OK */
+	int unread;		/* pieces that didn't */
+	int disagree;		/* words it lost the vote on */
+};
+
+static struct {
+	e3tools_t *e3t;
+	struct sbcopy *copies;
+	int ncopies;
+	int next;
+	pthread_mutex_t lock;
+} cs;
+
+static void *_consensus_reader(void *arg)
+{
+	struct sbcopy *c;
+	
+	(void) arg;
+	for (;;)
+	{
+		pthread_mutex_lock(&cs.lock);
+		c = (cs.next < cs.ncopies) ? &cs.copies[cs.next++] : NULL;
+		pthread_mutex_unlock(&cs.lock);
+		if (!c)
+			break;
+		c->ok = (disk_read_sectors(cs.e3t, c->sector, c->nsect, c->buf) == 0);
+	}
+	return NULL;
+}
+
+static void _consensus_read(e3tools_t *e3t, struct sbcopy *copies, int n)
+{
+	pthread_t threads[CONSENSUS_THREADS];
+	int nthreads = 0;
+	
+	cs.e3t = e3t;
+	cs.copies = copies;
+	cs.ncopies = n;
+	cs.next = 0;
+	pthread_mutex_init(&cs.lock, NULL);
+	
+	for (; (nthreads < CONSENSUS_THREADS) && (nthreads < n); nthreads++)
+		if (pthread_create(&threads[nthreads], NULL, _consensus_reader, NULL) != 0)
+			break;
+	if (nthreads == 0)
+		_consensus_reader(NULL);
+	while (nthreads)
+		pthread_join(threads[--nthreads], NULL);
+	
+	pthread_mutex_destroy(&cs.lock);
+}
+
+/* Votes on word w of every copy that read OK, and counts it against the
+ * ones that lose.  There has to be at least one. */
+static uint32_t _consensus_word(struct sbcopy *copies, int n, int w)
+{
+	uint32_t vals[CONSENSUS_MAX_COPIES];
+	int counts[CONSENSUS_MAX_COPIES];
+	int nvals = 0, best;
+	int i, j;
+	
+	for (i = 0; i < n; i++)
+	{
+		uint32_t v;
+		
+		if (!copies[i].ok)
+			continue;
+		v = ((uint32_t *)copies[i].buf)[w];
+		for (j = 0; (j < nvals) && (vals[j] != v); j++)
+			;
+		if (j == nvals)
+		{
+			vals[nvals] = v;
+			counts[nvals++] = 0;
+		}
+		counts[j]++;
+	}
+	if (nvals == 0)
+		return 0;
+	for (best = 0, j = 1; j < nvals; j++)
+		if (counts[j] > counts[best])
+			best = j;
+	
+	for (i = 0; i < n; i++)
+		if (copies[i].ok && (((uint32_t *)copies[i].buf)[w] != vals[best]))
+			copies[i].disagree++;
+	return vals[best];
+}
+
+/* The copy to take what doesn't get a vote from: the primary, or failing
+ * that the first backup that read OK.  NULL if none did. */
+static struct sbcopy *_consensus_base(struct sbcopy *copies, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		if (copies[i].ok)
+			return &copies[i];
+	return NULL;
+}
+
+static void _consensus_report(const char *what, struct sbcopy *copies, int n, int pieces)
+{
+	int voters = 0;
+	int i;
+	
+	for (i = 0; i < n; i++)
+		voters += (copies[i].unread < pieces);
+	E3DEBUG(E3TOOLS_PFX "%s consensus from %d of %d copies\n", what, voters, n);
+	for (i = 0; i < n; i++)
+	{
+		if (copies[i].unread == pieces)
+			E3DEBUG(E3TOOLS_PFX "  %s copy in group %d couldn't be used\n", what, copies[i].bg);
+		else if (copies[i].unread)
+			E3DEBUG(E3TOOLS_PFX "  %s copy in group %d couldn't be read in %d of %d pieces\n", what, copies[i].bg, copies[i].unread, pieces);
+		if (copies[i].disagree)
+			E3DEBUG(E3TOOLS_PFX "  %s copy in group %d disagrees in %d words\n", what, copies[i].bg, copies[i].disagree);
+	}
+}
+
+/* Picks out which groups' copies to read: all of them, if there are few
+ * enough, or else an even spread that always starts with group 0. */
+static int _consensus_groups(e3tools_t *e3t, int *groups)
+{
+	int nsb = 0, stride, bg, n = 0;
+	
+	for (bg = 0; bg < e3t->ngroups; bg++)
+		nsb += e3t->geom[bg].has_sb;
+	stride = (nsb + CONSENSUS_MAX_COPIES - 1) / CONSENSUS_MAX_COPIES;
+	
+	for (nsb = 0, bg = 0; (bg < e3t->ngroups) && (n < CONSENSUS_MAX_COPIES); bg++)
+		if (e3t->geom[bg].has_sb && ((nsb++ % stride) == 0))
+			groups[n++] = bg;
+	return n;
+}
+
+/* If the superblock we were pointed at is no good, we still need one to
+ * tell us where the others are.  mke2fs's default is a group per block
+ * bitmap's worth of blocks, so group 1's backup is at a place that only
+ * depends on the block size; try each in turn. */
+static int _consensus_seed(e3tools_t *e3t)
+{
+	uint8_t buf[SB_BYTES];
+	struct ext2_super_block *sb = (struct ext2_super_block *)buf;
+	int log;
+	
+	for (log = 0; log <= 6; log++)
+	{
+		uint64_t bs = 1024 << log;
+		uint64_t block = 8 * bs + ((log == 0) ? 1 : 0);
+		
+		if (disk_read_sectors(e3t, block * bs / BYTES_PER_SECTOR, SB_BYTES / BYTES_PER_SECTOR, buf) < 0)
+			continue;
+		if ((sb->s_magic != 0xEF53) || (sb->s_log_block_size != (uint32_t)log) || (sb->s_blocks_per_group != 8 * bs))
+			continue;
+		
+		E3DEBUG(E3TOOLS_PFX "using the backup superblock at block %lld to find the rest\n", (long long int)block);
+		memcpy(&e3t->sb, buf, (sizeof(e3t->sb) < SB_BYTES) ? sizeof(e3t->sb) : SB_BYTES);
+		return block_group_geometry_init(e3t);
+	}
+	return -1;
+}
+
+/* Reads and votes on the superblock copies wherever e3t->sb says they
+ * should be.  Each backup knows which group it is in, so that has to be
+ * taken out before they can agree.  Returns how many copies voted. */
+static int _consensus_sb(e3tools_t *e3t, struct sbcopy *copies, int *n, uint8_t *sb)
+{
+	int sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
+	int groups[CONSENSUS_MAX_COPIES];
+	struct sbcopy *base;
+	int i, w, voters = 0;
+	
+	*n = _consensus_groups(e3t, groups);
+	memset(copies, 0, CONSENSUS_MAX_COPIES * sizeof(*copies));
+	for (i = 0; i < *n; i++)
+	{
+		copies[i].bg = groups[i];
+		copies[i].sector = (groups[i] == 0) ? 2 : e3t->geom[groups[i]].start * (sector_t)sectors_per_block;
+		copies[i].nsect = SB_BYTES / BYTES_PER_SECTOR;
+		copies[i].buf = malloc(SB_BYTES);
+		if (!copies[i].buf)
+			return 0;
+	}
+	_consensus_read(e3t, copies, *n);
+	for (i = 0; i < *n; i++)
+	{
+		if (copies[i].ok && (((struct ext2_super_block *)copies[i].buf)->s_magic != 0xEF53))
+			copies[i].ok = 0;
+		if (copies[i].ok)
+			*(uint16_t *)(copies[i].buf + SB_GROUP_NR_OFS) = 0;
+		copies[i].unread = !copies[i].ok;
+		voters += copies[i].ok;
+	}
+	
+	base = _consensus_base(copies, *n);
+	if (base)
+	{
+		for (w = 0; w < SB_BYTES / 4; w++)
+			((uint32_t *)sb)[w] = _consensus_word(copies, *n, w);
+		for (i = 0; i < (int)(sizeof(sb_dynamic) / sizeof(sb_dynamic[0])); i++)
+			memcpy(sb + sb_dynamic[i].ofs, base->buf + sb_dynamic[i].ofs, sb_dynamic[i].len);
+	}
+	_consensus_report("superblock", copies, *n, 1);
+	return voters;
+}
+
+/* Votes on the locations in len bytes' worth of descriptors, one piece of
+ * every copy, and takes the rest from the primary.  Returns -1 if no copy
+ * of this piece could be read. */
+static int _consensus_gdt_piece(e3tools_t *e3t, struct sbcopy *copies, int n, int len, uint8_t *out)
+{
+	int descsz = SB_DESC_SIZE(&e3t->sb);
+	int nlocs = (descsz >= 64) ? 6 : 3;
+	struct sbcopy *base = _consensus_base(copies, n);
+	int d, l;
+	
+	if (!base)
+		return -1;
+	
+	memcpy(out, base->buf, len);
+	for (d = 0; d < len; d += descsz)
+	{
+		for (l = 0; l < nlocs; l++)
+			((uint32_t *)out)[(d + gd_locations[l]) / 4] = _consensus_word(copies, n, (d + gd_locations[l]) / 4);
+		if (base->bg == 0)
+			continue;
+		*(uint16_t *)(out + d + GD_FLAGS_OFS) = 0;
+		*(uint16_t *)(out + d + GD_ITABLE_UNUSED_OFS) = 0;
+		if (descsz >= 64)
+			*(uint16_t *)(out + d + GD_ITABLE_UNUSED_HI_OFS) = 0;
+	}
+	return 0;
+}
+
+int superblock_consensus(e3tools_t *e3t)
+{
+	int sectors_per_block;
+	int groups[CONSENSUS_MAX_COPIES];
+	struct sbcopy copies[CONSENSUS_MAX_COPIES];
+	uint8_t sb[SB_BYTES];
+	uint8_t *gdt = NULL;
+	int n = 0, i, s, k, len, nsect, pieces, voters = 0;
+	int seeded = 0;
+	
+	if ((e3t->sb.s_magic != 0xEF53) || !e3t->geom)
+	{
+		if (_consensus_seed(e3t) < 0)
+		{
+			E3DEBUG(E3TOOLS_PFX "no superblock to go looking for backups from; no consensus\n");
+			return -1;
+		}
+		seeded = 1;
+	}
+	
+	/* A superblock that is damaged but not obviously so sends us looking
+	 * for backups in all the wrong places; if none of them turn up, try
+	 * again from where mke2fs would have put them. */
+	voters = _consensus_sb(e3t, copies, &n, sb);
+	if ((voters < 2) && !seeded && (_consensus_seed(e3t) == 0))
+	{
+		for (i = 0; i < n; i++)
+			free(copies[i].buf);
+		voters = _consensus_sb(e3t, copies, &n, sb);
+	}
+	if (!voters)
+		goto out;
+	
+	memcpy(&e3t->sb, sb, (sizeof(e3t->sb) < SB_BYTES) ? sizeof(e3t->sb) : SB_BYTES);
+	if (block_group_geometry_init(e3t) < 0)
+		goto out;
+	
+	/* Then the descriptor tables, which sit right after each copy.  With
+	 * meta_bg, they don't (past s_first_meta_bg), and we'd only be
+	 * voting on part of the table; don't bother. */
+	if (e3t->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+	{
+		E3DEBUG(E3TOOLS_PFX "meta_bg descriptor tables aren't in one piece; no descriptor table consensus\n");
+		goto done;
+	}
+	sectors_per_block = (1024 / BYTES_PER_SECTOR) << e3t->sb.s_log_block_size;
+	len = e3t->ngroups * SB_DESC_SIZE(&e3t->sb);
+	nsect = (len + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR;
+	pieces = (nsect + CONSENSUS_PIECE_SECTORS - 1) / CONSENSUS_PIECE_SECTORS;
+	for (i = 0; i < n; i++)
+		free(copies[i].buf);
+	memset(copies, 0, sizeof(copies));
+	n = _consensus_groups(e3t, groups);
+	gdt = malloc(nsect * BYTES_PER_SECTOR);
+	if (!gdt)
+		goto out;
+	for (i = 0; i < n; i++)
+	{
+		copies[i].bg = groups[i];
+		copies[i].buf = malloc(CONSENSUS_PIECE_SECTORS * BYTES_PER_SECTOR);
+		if (!copies[i].buf)
+			goto out;
+	}
+	for (s = 0; s < nsect; s += k)
+	{
+		k = (nsect - s < CONSENSUS_PIECE_SECTORS) ? (nsect - s) : CONSENSUS_PIECE_SECTORS;
+		for (i = 0; i < n; i++)
+		{
+			copies[i].sector = (e3t->geom[groups[i]].start + 1) * (sector_t)sectors_per_block + s;
+			copies[i].nsect = k;
+		}
+		_consensus_read(e3t, copies, n);
+		for (i = 0; i < n; i++)
+			copies[i].unread += !copies[i].ok;
+		if (_consensus_gdt_piece(e3t, copies, n, (len - s * BYTES_PER_SECTOR < k * BYTES_PER_SECTOR) ? (len - s * BYTES_PER_SECTOR) : (k * BYTES_PER_SECTOR),
+		    gdt + s * BYTES_PER_SECTOR) < 0)
+		{
+			E3DEBUG(E3TOOLS_PFX "no copy of the descriptor table could be read at sector %d of it; no descriptor table consensus\n", s);
+			goto out;
+		}
+	}
+	_consensus_report("descriptor table", copies, n, pieces);
+	
+	free(e3t->gdt);
+	e3t->gdt = gdt;
+	gdt = NULL;
+
+done:
+	e3t->consensus = 1;
+	for (i = 0; i < n; i++)
+		free(copies[i].buf);
+	return 0;
+
+out:
+	for (i = 0; i < n; i++)
+		free(copies[i].buf);
+	free(gdt);
+	return -1;
 }
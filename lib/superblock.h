@@ -3,11 +3,42 @@
 
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
+#include <stdint.h>
 
 #include "e3tools.h"
 
+#ifndef U64
+#  define U64(x) ((uint64_t)(x))
+#endif
+
+/* ext4 grew the superblock into space that <linux/ext2_fs.h> still calls
+ * padding, so we have to go fishing for those fields by offset. */
+#define SB_FIELD(sb, type, off) (*(type *)((uint8_t *)(sb) + (off)))
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define SB_IS_64BIT(sb) ((sb)->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+#define SB_HI32(sb, off) (SB_IS_64BIT(sb) ? (U64(SB_FIELD(sb, uint32_t, off)) << 32) : 0)
+
 #define SB_BLOCK_SIZE(sb) (1024 << (sb)->s_log_block_size)
-#define SB_GROUPS(sb) ((sb)->s_blocks_count / (sb)->s_blocks_per_group + !!((sb)->s_blocks_count % (sb)->s_blocks_per_group))
+#define SB_BLOCKS_COUNT(sb) (U64((sb)->s_blocks_count) | SB_HI32(sb, 0x150))
+#define SB_R_BLOCKS_COUNT(sb) (U64((sb)->s_r_blocks_count) | SB_HI32(sb, 0x154))
+#define SB_FREE_BLOCKS_COUNT(sb) (U64((sb)->s_free_blocks_count) | SB_HI32(sb, 0x158))
+#define SB_RAW_DESC_SIZE(sb) SB_FIELD(sb, uint16_t, 0xFE)
+#define SB_DESC_SIZE(sb) ((SB_IS_64BIT(sb) && (SB_RAW_DESC_SIZE(sb) >= 64)) ? SB_RAW_DESC_SIZE(sb) : 32)
+/* What the kernel will mount: 64-bit descriptors are a power of two, from
+ * 64 bytes up to 1K, and no bigger than a block. */
+#define EXT4_MAX_DESC_SIZE 1024
+#define SB_DESC_SIZE_OK(sb) (!SB_IS_64BIT(sb) || ((SB_RAW_DESC_SIZE(sb) >= 64) && \
+	(SB_RAW_DESC_SIZE(sb) <= EXT4_MAX_DESC_SIZE) && (SB_RAW_DESC_SIZE(sb) <= SB_BLOCK_SIZE(sb)) && \
+	!(SB_RAW_DESC_SIZE(sb) & (SB_RAW_DESC_SIZE(sb) - 1))))
+#define SB_GROUPS(sb) ((SB_BLOCKS_COUNT(sb) - (sb)->s_first_data_block + (sb)->s_blocks_per_group - 1) / (sb)->s_blocks_per_group)
+/* The descriptor table follows the superblock copy we were told to read. */
+#define SB_GDT_BLOCK(sb) (U64((sb)->s_block_group_nr) * (sb)->s_blocks_per_group + (sb)->s_first_data_block + 1)
+#define SB_RESERVED_GDT_BLOCKS(sb) ((sb)->s_padding1)	/* s_reserved_gdt_blocks, in ext3 and later */
+#define SB_LOG_GROUPS_PER_FLEX(sb) SB_FIELD(sb, uint8_t, 0x174)
+
+#define EXT3_FEATURE_COMPAT_RESIZE_INODE 0x0010
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG 0x0200
 extern void superblock_show(e3tools_t *sb);
+extern int superblock_consensus(e3tools_t *e3t);
 
 #endif
@@ -0,0 +1,216 @@
+// directio
+// Utilities to make sense out of really damaged ext2/ext3 filesystems.
+//
+// If you have to make an assumption, write it down. Better assumptions may
+// lead to better grades.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "diskio.h"
+#include "bufpool.h"
+
+/* Checks that the direct: mechanism hands back the same bytes as the
+ * simple one, for reads that O_DIRECT can take as they are and for the
+ * ones that have to go through its window: unaligned sectors, unaligned
+ * buffers, odd lengths, reads bigger than the window, reads that run up
+ * to and past the end of the disk, and several threads at once.
+ *
+ * The disk is a file of pseudo-random bytes made in the directory given
+ * (the current one by default).  It has to be on a filesystem that does
+ * O_DIRECT; tmpfs doesn't, and then there's nothing to test. */
+
+#define DISK_SECTORS (16 * 1024 + 3)	/* 8MB, and a bit that doesn't fill a page */
+#define MAX_SECTORS 1024
+#define NTHREADS 4
+
+extern diskio_t simpledisk_ops, directdisk_ops;
+
+static diskio_t *simple, *direct;
+static int failures;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads n sectors at s both ways, into a buffer ofs bytes past a page
+ * boundary, and complains if they don't agree. */
+static void _compare(sector_t s, int n, int ofs, uint8_t *a, uint8_t *b)
+{
+	int ra = simple->read_sectors(simple, s, n, a + ofs);
+	int rb = direct->read_sectors(direct, s, n, b + ofs);
+	
+	if ((ra != rb) || ((ra == 0) && memcmp(a + ofs, b + ofs, n * BYTES_PER_SECTOR)))
+	{
+		pthread_mutex_lock(&lock);
+		printf("FAIL: %d sectors at %lld, buffer +%d: simple %d, direct %d%s\n", n, (long long int)s, ofs, ra, rb,
+			(ra == rb) ? ", different bytes" : "");
+		failures++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void _compare_one(sector_t s, int ofs, uint8_t *a, uint8_t *b)
+{
+	int ra = simple->read_sector(simple, s, a + ofs);
+	int rb = direct->read_sector(direct, s, b + ofs);
+	
+	if ((ra != rb) || ((ra == 0) && memcmp(a + ofs, b + ofs, BYTES_PER_SECTOR)))
+	{
+		pthread_mutex_lock(&lock);
+		printf("FAIL: sector %lld, buffer +%d: simple %d, direct %d\n", (long long int)s, ofs, ra, rb);
+		failures++;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static uint8_t *_buf(void)
+{
+	uint8_t *buf;
+	
+	if (posix_memalign((void **)&buf, BUFPOOL_ALIGN, MAX_SECTORS * BYTES_PER_SECTOR + BUFPOOL_ALIGN) != 0)
+	{
+		perror("directio: posix_memalign");
+		exit(1);
+	}
+	return buf;
+}
+
+static void *_random_reads(void *arg)
+{
+	unsigned int seed = (unsigned int)(uintptr_t)arg;
+	uint8_t *a = _buf(), *b = _buf();
+	int i;
+	
+	for (i = 0; i < 2000; i++)
+	{
+		sector_t s = rand_r(&seed) % DISK_SECTORS;
+		int n = 1 + rand_r(&seed) % ((rand_r(&seed) & 1) ? 16 : MAX_SECTORS);
+		int ofs = (rand_r(&seed) & 1) ? 0 : (rand_r(&seed) % 8) * BYTES_PER_SECTOR;
+		
+		if (s + n > DISK_SECTORS)
+			n = DISK_SECTORS - s;
+		_compare(s, n, ofs, a, b);
+	}
+	free(a);
+	free(b);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = (argc > 1) ? argv[1] : ".";
+	char *fname, *desc;
+	uint8_t *a, *b;
+	pthread_t threads[NTHREADS];
+	unsigned int seed = 1;
+	int fd, i, started = 0;
+	sector_t s;
+	
+	if (argc > 2)
+	{
+		printf("Usage: %s [dir]\n", argv[0]);
+		printf("Makes a scratch disk image in dir (default .), which has to be on a\n");
+		printf("filesystem that does O_DIRECT, and checks that direct: reads it the way\n");
+		printf("simple: does.\n");
+		exit(1);
+	}
+	
+	fname = malloc(strlen(dir) + 32);
+	desc = malloc(strlen(dir) + 40);
+	a = _buf();
+	b = _buf();
+	if (!fname || !desc)
+	{
+		perror("directio: malloc");
+		exit(1);
+	}
+	sprintf(fname, "%s/directio.%d", dir, (int)getpid());
+	sprintf(desc, "direct:%s", fname);
+	
+	fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		perror(fname);
+		exit(1);
+	}
+	for (s = 0; s < DISK_SECTORS; s++)
+	{
+		for (i = 0; i < BYTES_PER_SECTOR; i++)
+			a[i] = rand_r(&seed);
+		if (write(fd, a, BYTES_PER_SECTOR) != BYTES_PER_SECTOR)
+		{
+			perror(fname);
+			unlink(fname);
+			exit(1);
+		}
+	}
+	close(fd);
+	
+	simple = simpledisk_ops.open(fname);
+	direct = directdisk_ops.open(desc);
+	if (!simple || !direct)
+	{
+		printf("SKIP: %s can't be opened both ways (no O_DIRECT here?)\n", fname);
+		unlink(fname);
+		exit(0);
+	}
+	
+	/* Reads O_DIRECT can take as they are. */
+	_compare(0, 8, 0, a, b);
+	_compare(8, 256, 0, a, b);
+	_compare(4096, MAX_SECTORS, 0, a, b);
+	
+	/* Single sectors, and runs that start, end, or sit in the wrong
+	 * place. */
+	for (s = 0; s < 64; s++)
+		_compare_one(s, 0, a, b);
+	for (s = 0; s < 16; s++)
+		for (i = 1; i <= 17; i++)
+			_compare(s, i, 0, a, b);
+	_compare(8, 8, BYTES_PER_SECTOR, a, b);
+	_compare(3, 300, 0, a, b);
+	_compare(3, 300, 3 * BYTES_PER_SECTOR, a, b);
+	
+	/* Bigger than the window. */
+	_compare(1, MAX_SECTORS, 0, a, b);
+	_compare(7, MAX_SECTORS - 9, 5 * BYTES_PER_SECTOR, a, b);
+	
+	/* Up to the end, across it, and past it. */
+	_compare(DISK_SECTORS - 3, 3, 0, a, b);
+	_compare(DISK_SECTORS - 8, 8, 0, a, b);
+	_compare_one(DISK_SECTORS - 1, 0, a, b);
+	_compare(DISK_SECTORS - 2, 4, 0, a, b);
+	_compare(DISK_SECTORS - 3, 8, 0, a, b);
+	_compare_one(DISK_SECTORS, 0, a, b);
+	_compare(DISK_SECTORS + 5, 8, 0, a, b);
+	
+	/* All at once, each thread with its own window. */
+	for (i = 0; i < NTHREADS; i++)
+	{
+		if (pthread_create(&threads[i], NULL, _random_reads, (void *)(uintptr_t)(i + 1)) != 0)
+			break;
+		started++;
+	}
+	if (started == 0)
+		_random_reads((void *)1);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	
+	simple->close(simple);
+	direct->close(direct);
+	unlink(fname);
+	free(fname);
+	free(desc);
+	free(a);
+	free(b);
+	
+	if (failures)
+	{
+		printf("directio: %d reads disagreed\n", failures);
+		return 1;
+	}
+	printf("directio: direct: and simple: agree\n");
+	return 0;
+}